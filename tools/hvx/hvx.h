@@ -8,6 +8,9 @@
 #define __user
 #endif
 
+/* Guest RAM starts at this IPA; images and mmap offsets are IPAs */
+#define HVX_GUEST_RAM_BASE	0x40000000UL
+
 #define HVX_IOCTL_HYPERCALL			\
 	_IOC(_IOC_NONE, 'P', 0, sizeof(struct hvx_proto_hypercall))
 struct hvx_proto_hypercall {
@@ -15,13 +18,26 @@ struct hvx_proto_hypercall {
 	__u64 params[5];
 };
 
+/*
+ * Returns a new domain fd. DOMAIN_DESTROY, MEMORY, MEMORY_ADOPT and
+ * VCPU_CONTEXT are issued on that fd, and guest memory is mapped by
+ * mmap()ing it (MAP_SHARED) at the IPA. Memory that is not backed yet is
+ * populated on the first access through the mapping, and released memory
+ * disappears from it. Closing it destroys the domain. The hypervisor
+ * domain id is returned in id.
+ */
 #define HVX_IOCTL_DOMAIN_CREATE	\
 	_IOC(_IOC_NONE, 'P', 1, sizeof(struct hvx_proto_domain_create))
 struct hvx_proto_domain_create {
 	__u64 vcpus;
 	__u64 memory;
+	__u64 flags;
+	__u64 id;
 };
 
+/* Allocate guest memory on the first stage-2 fault instead of up front */
+#define HVX_DOMAIN_LAZY		(1UL << 0)
+
 #define HVX_IOCTL_DOMAIN_DESTROY \
 	_IOC(_IOC_NONE, 'P', 2, sizeof(struct hvx_proto_domain_destroy))
 struct hvx_proto_domain_destroy {
@@ -35,6 +51,7 @@ struct hvx_proto_vcpu_context {
 	__u64 entry;
 	__u64 affinity;
 	__u64 contextid;
+	__u64 eventfd;
 };
 
 #define HVX_IOCTL_MEMORY	\
@@ -45,4 +62,285 @@ struct hvx_proto_memory {
 	__u64 size;
 };
 
+/*
+ * POPULATE backs [base, base + size) with memory, RELEASE gives the memory
+ * of every extent entirely inside the range back to the host and returns
+ * the number of bytes released.
+ */
+#define HVX_MEMORY_POPULATE	0
+#define HVX_MEMORY_RELEASE	1
+
+/*
+ * Map the pages backing a user mapping (typically a file mapped with
+ * MAP_SHARED) directly into the guest at [base, base + size) instead of
+ * copying them into guest memory. The pages stay pinned until the domain
+ * is destroyed. Without HVX_ADOPT_READONLY the user mapping must be
+ * writable, the pages are pinned for writing.
+ */
+#define HVX_IOCTL_MEMORY_ADOPT	\
+	_IOC(_IOC_NONE, 'P', 5, sizeof(struct hvx_proto_memory_adopt))
+struct hvx_proto_memory_adopt {
+	__u64 uaddr;
+	__u64 base;
+	__u64 size;
+	__u64 flags;
+};
+
+#define HVX_ADOPT_READONLY	(1UL << 0)
+
+/*
+ * Issue up to HVX_HYPERCALL_BATCH_MAX hypercalls in one ioctl. The result
+ * of each entry is stored in results[i]; the ioctl returns the number of
+ * entries executed.
+ */
+#define HVX_HYPERCALL_BATCH_MAX	64
+
+#define HVX_IOCTL_HYPERCALL_BATCH	\
+	_IOC(_IOC_NONE, 'P', 6, sizeof(struct hvx_proto_hypercall_batch))
+struct hvx_proto_hypercall_batch {
+	__u64 count;
+	__u64 entries;
+	__u64 results;
+	__u64 flags;
+};
+
+#define HVX_BATCH_STOP_ON_ERROR	(1UL << 0)
+
+/*
+ * Signal fd instead of handing the guest MMIO write of len bytes at addr
+ * to the vcpu consumer; with HVX_IOEVENTFD_DATAMATCH only writes of
+ * datamatch do. Matching writes are never queued on the exit ring. A
+ * domain has up to 64 of them. Issued on the domain fd.
+ */
+#define HVX_IOCTL_IOEVENTFD	\
+	_IOC(_IOC_NONE, 'P', 7, sizeof(struct hvx_proto_ioeventfd))
+struct hvx_proto_ioeventfd {
+	__u64 addr;
+	__u32 len;
+	__s32 fd;
+	__u64 datamatch;
+	__u64 flags;
+};
+
+#define HVX_IOEVENTFD_DATAMATCH	(1UL << 0)
+#define HVX_IOEVENTFD_DEASSIGN	(1UL << 1)
+
+/*
+ * Raise the guest interrupt irq every time fd is signalled. Issued on the
+ * domain fd.
+ */
+#define HVX_IOCTL_IRQFD	\
+	_IOC(_IOC_NONE, 'P', 8, sizeof(struct hvx_proto_irqfd))
+struct hvx_proto_irqfd {
+	__s32 fd;
+	__u32 irq;
+	__u64 flags;
+};
+
+#define HVX_IRQFD_DEASSIGN	(1UL << 0)
+
+/*
+ * Return the guest memory ranges that are backed, sorted by base. Up to
+ * count entries are stored in entries; the ioctl returns the number of
+ * ranges the domain has, which may be more. Issued on the domain fd.
+ */
+#define HVX_IOCTL_MEMORY_EXTENTS	\
+	_IOC(_IOC_NONE, 'P', 9, sizeof(struct hvx_proto_memory_extents))
+struct hvx_proto_memory_extents {
+	__u64 count;
+	__u64 entries;
+};
+
+struct hvx_memory_extent {
+	__u64 base;
+	__u64 size;
+	__u64 flags;
+};
+
+/* The range holds pages adopted with HVX_IOCTL_MEMORY_ADOPT */
+#define HVX_EXTENT_ADOPTED	(1UL << 0)
+
+/* Stop (pause != 0) or resume every vcpu of the domain */
+#define HVX_IOCTL_DOMAIN_PAUSE	\
+	_IOC(_IOC_NONE, 'P', 10, sizeof(struct hvx_proto_domain_pause))
+struct hvx_proto_domain_pause {
+	__u64 pause;
+};
+
+/*
+ * Back the 2MB granule holding base and fill it before the guest can see
+ * it: page i is copied from the user address pages[i], or cleared if that
+ * is 0 or i >= count. Does nothing if the granule is backed already, so
+ * that vcpus faulting on the same granule at once do not clobber each
+ * other. While dirty pages are logged, only the page at base is made
+ * writable and marked dirty, so base should be the faulting address.
+ */
+#define HVX_RESTORE_PAGES		512
+
+#define HVX_IOCTL_MEMORY_RESTORE	\
+	_IOC(_IOC_NONE, 'P', 11, sizeof(struct hvx_proto_memory_restore))
+struct hvx_proto_memory_restore {
+	__u64 base;
+	__u64 pages;
+	__u64 count;
+	__u64 flags;
+};
+
+/*
+ * Architectural state of a vcpu, read and written through the vcpu fd.
+ * The domain must be paused.
+ */
+struct hvx_vcpu_state {
+	__u64 regs[31];
+	__u64 sp_el0;
+	__u64 sp_el1;
+	__u64 pc;
+	__u64 pstate;
+	__u64 elr_el1;
+	__u64 spsr_el1;
+	__u64 sctlr_el1;
+	__u64 cpacr_el1;
+	__u64 ttbr0_el1;
+	__u64 ttbr1_el1;
+	__u64 tcr_el1;
+	__u64 mair_el1;
+	__u64 amair_el1;
+	__u64 vbar_el1;
+	__u64 contextidr_el1;
+	__u64 tpidr_el0;
+	__u64 tpidrro_el0;
+	__u64 tpidr_el1;
+	__u64 esr_el1;
+	__u64 far_el1;
+	__u64 afsr0_el1;
+	__u64 afsr1_el1;
+	__u64 par_el1;
+	__u64 csselr_el1;
+	__u64 cntkctl_el1;
+	__u64 cntv_ctl_el0;
+	__u64 cntv_cval_el0;
+	__u64 vregs[64];
+	__u32 fpsr;
+	__u32 fpcr;
+};
+
+#define HVX_IOCTL_VCPU_GET_STATE	\
+	_IOC(_IOC_NONE, 'P', 12, sizeof(struct hvx_vcpu_state))
+#define HVX_IOCTL_VCPU_SET_STATE	\
+	_IOC(_IOC_NONE, 'P', 13, sizeof(struct hvx_vcpu_state))
+
+/*
+ * Issued on the domain fd of a running domain, which is paused for good
+ * and becomes the template of a new domain with its own vcpus. The new
+ * domain shares the memory of the template and gets a private copy of a
+ * 2MB granule on its first write to it. While it has clones the template
+ * can neither run nor change its memory, and DOMAIN_DESTROY fails with
+ * EBUSY. Clones cannot be cloned. Returns the new domain fd, and its id
+ * in id.
+ */
+#define HVX_IOCTL_DOMAIN_CLONE	\
+	_IOC(_IOC_NONE, 'P', 14, sizeof(struct hvx_proto_domain_clone))
+struct hvx_proto_domain_clone {
+	__u64 vcpus;
+	__u64 flags;
+	__u64 id;
+};
+
+/*
+ * Dirty page logging, issued on the domain fd. ENABLE write protects the
+ * guest memory at stage-2 and DISABLE lifts the protection. While it is
+ * enabled, the first guest write to a page raises HVX_EXIT_MEMORY_FAULT.
+ * Handling that with HVX_MEMORY_POPULATE, or HVX_IOCTL_MEMORY_RESTORE,
+ * marks the page dirty and makes it writable. Memory backed while logging
+ * counts as dirty. Writes through the userspace mapping of the domain
+ * fd are logged too, the mapping is write protected like stage-2.
+ *
+ * FETCH stores one bit per page of [base, base + pages * 4K) in bitmap,
+ * bit i of 64-bit word w standing for page w * 64 + i. It clears those
+ * bits and protects the dirty pages again, so the caller must copy them
+ * after the ioctl returns.
+ */
+#define HVX_IOCTL_DIRTY_LOG	\
+	_IOC(_IOC_NONE, 'P', 15, sizeof(struct hvx_proto_dirty_log))
+struct hvx_proto_dirty_log {
+	__u64 op;
+	__u64 base;
+	__u64 pages;
+	__u64 bitmap;
+};
+
+#define HVX_DIRTY_LOG_ENABLE	0
+#define HVX_DIRTY_LOG_DISABLE	1
+#define HVX_DIRTY_LOG_FETCH		2
+
+/*
+ * Every vcpu file descriptor can be mapped at offset HVX_VCPU_RING_OFFSET
+ * to get the ring the hypervisor fills with exit records. The consumer
+ * advances tail after handling records; the vcpu eventfd is only signalled
+ * when new records are produced after the consumer has caught up, so it
+ * must re-check head after publishing tail before going back to sleep.
+ */
+#define HVX_EXIT_NONE		0
+/*
+ * MMIO writes are posted: the vcpu does not wait for the record to be
+ * consumed. For reads the consumer stores the value in data before
+ * publishing tail, and the vcpu is resumed with it.
+ */
+#define HVX_EXIT_MMIO		1
+#define HVX_EXIT_HYPERCALL	2
+#define HVX_EXIT_SHUTDOWN	3
+/*
+ * Stage-2 fault on guest memory that is not populated yet, a write to
+ * memory a clone still shares with its template, or a write to a page
+ * protected for dirty logging; addr holds the faulting IPA. The vcpu is
+ * resumed once the record has been consumed.
+ */
+#define HVX_EXIT_MEMORY_FAULT	4
+#define HVX_EXIT_REASONS		5
+
+#define HVX_EXIT_WRITE		(1U << 0)
+
+struct hvx_exit {
+	__u32 reason;
+	__u32 flags;
+	__u64 addr;
+	__u64 data;
+	__u32 len;
+	__u32 reserved;
+};
+
+#define HVX_VCPU_RING_OFFSET	0
+#define HVX_EXIT_RING_ENTRIES	64
+
+/*
+ * signalled is the CLOCK_MONOTONIC time in ns at which the driver last
+ * signalled the eventfd. The consumer stores the time at which it was
+ * done with the records in acked before publishing tail, which gives the
+ * driver the exit handling latency.
+ */
+struct hvx_exit_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 size;
+	__u32 reserved;
+	__u64 signalled;
+	__u64 acked;
+	struct hvx_exit entries[HVX_EXIT_RING_ENTRIES];
+};
+
+/*
+ * Per-vcpu statistics, mapped read-only from the vcpu fd at page offset
+ * HVX_VCPU_STATS_OFFSET. latency[i] counts the exit batches handled in
+ * [2^i, 2^(i+1)) microseconds; the first bucket also holds anything
+ * faster and the last one anything slower.
+ */
+#define HVX_VCPU_STATS_OFFSET	1
+#define HVX_LATENCY_BUCKETS		20
+
+struct hvx_vcpu_stats {
+	__u64 exits[HVX_EXIT_REASONS];
+	__u64 signals;
+	__u64 latency[HVX_LATENCY_BUCKETS];
+};
+
 #endif /*!__HVX_H__*/
@@ -27,9 +27,28 @@
 #define VMI_DOMAIN_DESTROY 1
 #define VMI_DOMAIN_PAUSE   2
 #define VMI_DOMAIN_UNPAUSE 3
+/* Takes the IPA and size of the range to flush, size 0 flushes the VMID */
+#define VMI_DOMAIN_FLUSH_TLB 4
+/* Takes the interrupt to raise in the guest */
+#define VMI_DOMAIN_INJECT_IRQ 5
+/*
+ * Takes a struct ioeventfd_control instead of a struct domain_control. A
+ * posted MMIO write that matches it is not queued on the exit ring: the
+ * hypervisor sets bit slot of the word at pending and raises the event
+ * irq instead. A len of 0 frees the slot.
+ */
+#define VMI_DOMAIN_IOEVENTFD 6
 
+/*
+ * Minor versions:
+ *  1: vcpus get an exit ring, vcpu_control.ring
+ *  2: VMI_DOMAIN_FLUSH_TLB
+ *  3: VMI_DOMAIN_FLUSH_TLB takes a range
+ *  4: VMI_DOMAIN_INJECT_IRQ, VMI_DOMAIN_IOEVENTFD
+ *  5: VMI_VCPU_GET_STATE, VMI_VCPU_SET_STATE
+ */
 #define HVX_API_VERSION_MAJOR	1
-#define HVX_API_VERSION_MINOR	0
+#define HVX_API_VERSION_MINOR	5
 
 struct domain_control {
     union {
@@ -41,8 +60,31 @@ struct domain_control {
     };
 };
 
+#define VMI_IOEVENTFD_DATAMATCH	(1UL << 0)
+
+struct ioeventfd_control {
+	unsigned long domain;
+	unsigned long slot;
+	unsigned long addr;
+	unsigned long len;
+	unsigned long data;
+	unsigned long flags;
+	/* Physical address of the word of slots with a pending match */
+	unsigned long pending;
+};
+
 #define VMI_VCPU_CREATE  0
+/*
+ * Takes the index of the vcpu in the domain. The hypervisor is done with
+ * its exit ring when this returns.
+ */
 #define VMI_VCPU_DESTROY 1
+/*
+ * Take the index of the vcpu in the domain and the physical address of a
+ * struct hvx_vcpu_state. The domain must be paused.
+ */
+#define VMI_VCPU_GET_STATE 2
+#define VMI_VCPU_SET_STATE 3
 
 struct vcpu_control {
     unsigned long domain;
@@ -51,6 +93,8 @@ struct vcpu_control {
 		unsigned long affinity;
 		unsigned long contextid;
     };
+	/* Physical address of the page holding the vcpu exit ring */
+	unsigned long ring;
 };
 
 #define vmcall(a, b, c, d, e, f) \
@@ -26,6 +26,13 @@
 #define SECTION_FRAME_SIZE	(1 << (30 - IPA_PAGE_SHIFT))
 #define SECTION_FRAME_MASK	(~(SECTION_FRAME_SIZE - 1))
 
+/* 16 naturally aligned level 2 blocks can share one TLB entry */
+#define CONTIG_ENTRIES		16
+#define CONTIG_BLOCK_SIZE	(BLOCK_FRAME_SIZE * CONTIG_ENTRIES)
+
+/* Larger ranges are cheaper to drop with one flush of the whole VMID */
+#define IPA_FLUSH_MAX_PAGES	512
+
 #define REGION_FRAME_SIZE   (1 << (39 - IPA_PAGE_SHIFT))
 #define REGION_FRAME_MASK   (~(REGION_FRAME_SIZE - 1))
 
@@ -79,16 +86,34 @@ static inline bool ipa_map_is_aligned(unsigned long addr, unsigned int size)
 	return ((addr & (size - 1)) == 0);
 }
 
+/*
+ * Entries are written with plain stores; ipa_pte_sync() makes all of them
+ * visible to the table walker at once when a batch is committed.
+ */
 static inline void ipa_pte_update(unsigned long *p, unsigned long v)
 {
-	asm volatile (
-		"dsb sy;"
-		"str %0, [%1];"
-		"dsb sy;"
-		:
-		: "r"(v), "r"(p)
-		: "memory"
-	);
+	WRITE_ONCE(*p, v);
+}
+
+static inline void ipa_pte_sync(void)
+{
+	asm volatile ("dsb ishst" : : : "memory");
+}
+
+static inline unsigned long ipa_pte_to_addr_pfn(unsigned long pte)
+{
+	return (pte & IPA_PTE_ADDR_MASK) >> IPA_PAGE_SHIFT;
+}
+
+static inline void ipa_batch_touch(struct ipa_batch *batch, unsigned long vfn, unsigned long nr)
+{
+	if (batch->start == batch->end) {
+		batch->start = vfn;
+		batch->end = vfn + nr;
+	} else {
+		batch->start = min(batch->start, vfn);
+		batch->end = max(batch->end, vfn + nr);
+	}
 }
 
 static inline unsigned long *ipa_vfn_to_ptep(unsigned long *table, unsigned long vfn, int level)
@@ -121,7 +146,19 @@ unsigned long *ipa_alloc_table(void)
 	return table;
 }
 
-void ipa_pte_remove(unsigned long *entry, int depth)
+/*
+ * Tables removed from a live batch may still be walked through stale TLB
+ * entries, so they are only freed once the batch has been committed.
+ */
+static void ipa_free_table_page(struct ipa_batch *batch, struct page *pg)
+{
+	if (batch != NULL)
+		list_add(&pg->lru, &batch->free_tables);
+	else
+		__free_pages(pg, 0);
+}
+
+static void ipa_pte_remove(struct ipa_batch *batch, unsigned long *entry, int depth)
 {
 	unsigned long pte = 0;
 
@@ -131,13 +168,16 @@ void ipa_pte_remove(unsigned long *entry, int depth)
 		unsigned long pfn = ipa_pte_to_pfn(entry);
 		unsigned long *child = (unsigned long *)phys_to_virt(pfn << IPA_PAGE_SHIFT);
 		for (i = 0; i < IPA_ENTRIES; i++)
-			ipa_pte_remove(&child[i], depth + 1);
+			ipa_pte_remove(batch, &child[i], depth + 1);
 
 		pg = pfn_to_page(pfn);
 		hvx_info("page table freed: 0x%lx\n", pfn << IPA_PAGE_SHIFT);
-		__free_pages(pg, 0);
+		ipa_free_table_page(batch, pg);
 	}
 
+	if (ipa_pte_is_valid(entry) && batch != NULL)
+		batch->flush = true;
+
 	ipa_pte_update(entry, pte);
 }
 
@@ -147,20 +187,70 @@ void ipa_free_table(unsigned long *table)
 
 	for (i = 0; i < IPA_ENTRIES; i++) {
 		if (table[i]) {
-			ipa_pte_remove(&table[i], 0);
+			ipa_pte_remove(NULL, &table[i], 0);
 		}
 	}
 
+	ipa_pte_sync();
 	__free_pages(virt_to_page(table), 0);
 }
 
-inline void ipa_table_pte_update(unsigned long *entry, unsigned long *ptr)
+/*
+ * The contiguous hint of a live entry may only change with break-before-make:
+ * once the whole group at vfn has been invalidated, the TLB must forget it
+ * before any of its entries is written again.
+ */
+static void ipa_contig_flush(struct ipa_batch *batch, unsigned long vfn)
+{
+	ipa_pte_sync();
+
+	if (batch->flush_tlb != NULL)
+		batch->flush_tlb(batch->data, vfn & ~(CONTIG_BLOCK_SIZE - 1), CONTIG_BLOCK_SIZE);
+}
+
+/*
+ * All entries of a contiguous group must agree on the hint, so drop it
+ * from the whole group before any member is changed on its own.
+ */
+static void ipa_break_contig(struct ipa_batch *batch, unsigned long *entry, unsigned long vfn)
+{
+	unsigned long *group, old[CONTIG_ENTRIES];
+	int i;
+
+	if (!(*entry & IPA_PTE_CONTIG))
+		return;
+
+	group = (unsigned long *)((unsigned long)entry & ~(CONTIG_ENTRIES * sizeof(*entry) - 1));
+	for (i = 0; i < CONTIG_ENTRIES; i++) {
+		old[i] = group[i];
+		ipa_pte_update(group + i, 0);
+	}
+
+	ipa_contig_flush(batch, vfn);
+
+	for (i = 0; i < CONTIG_ENTRIES; i++)
+		ipa_pte_update(group + i, old[i] & ~IPA_PTE_CONTIG);
+}
+
+static inline void ipa_table_pte_update(unsigned long *entry, unsigned long *ptr)
 {
 	unsigned long pte = ipa_make_table_pte(virt_to_phys(ptr) >> IPA_PAGE_SHIFT);
+
+	/* The new table must be complete before the walker can reach it */
+	ipa_pte_sync();
+	ipa_pte_update(entry, pte);
+}
+
+/* Overwriting a live translation leaves the batch with a TLB flush to do */
+static inline void ipa_batch_pte_update(struct ipa_batch *batch, unsigned long *entry, unsigned long pte)
+{
+	if (ipa_pte_is_valid(entry))
+		batch->flush = true;
+
 	ipa_pte_update(entry, pte);
 }
 
-int ipa_map_downsize_section(unsigned long *entry)
+static int ipa_map_downsize_section(struct ipa_batch *batch, unsigned long *entry)
 {
 	int i;
 	unsigned long pte, *ptr;
@@ -177,6 +267,7 @@ int ipa_map_downsize_section(unsigned long *entry)
 			ipa_pte_update(ptr + i, pte);
 			pte += BLOCK_FRAME_SIZE << IPA_PAGE_SHIFT;
 		}
+		batch->flush = true;
 	}
 
 	ipa_table_pte_update(entry, ptr);
@@ -184,13 +275,15 @@ int ipa_map_downsize_section(unsigned long *entry)
 	return 0;
 }
 
-int ipa_map_downsize_block(unsigned long *entry)
+static int ipa_map_downsize_block(struct ipa_batch *batch, unsigned long *entry, unsigned long vfn)
 {
 	int i;
 	unsigned long pte, *ptr;
 
 	BUG_ON(entry == NULL);
 
+	ipa_break_contig(batch, entry, vfn);
+
 	pte = *entry;
 	ptr = ipa_alloc_table();
 	if (ptr == NULL)
@@ -202,6 +295,7 @@ int ipa_map_downsize_block(unsigned long *entry)
 			ipa_pte_update(ptr + i, pte);
 			pte += IPA_PAGE_SIZE;
 		}
+		batch->flush = true;
 	}
 
 	ipa_table_pte_update(entry, ptr);
@@ -230,7 +324,7 @@ void ipa_dump_page_maps(unsigned long *page_table, int depth)
 	} while (index < 512);
 }
 
-int ipa_map_page_range(unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
+static int ipa_map_page_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
 {
 	unsigned long *ptr, pte;
 	unsigned long end = vfn + nr;
@@ -241,7 +335,7 @@ int ipa_map_page_range(unsigned long *table, unsigned long vfn, unsigned long pf
 
 	do {
 		pte = ipa_make_page_pte(pfn, flags);
-		ipa_pte_update(ptr, pte);
+		ipa_batch_pte_update(batch, ptr, pte);
 
 		vfn++;
 		pfn++;
@@ -251,7 +345,7 @@ int ipa_map_page_range(unsigned long *table, unsigned long vfn, unsigned long pf
 	return 0;
 }
 
-int ipa_map_block_range(unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
+static int ipa_map_block_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
 {
 	int rc = 0;
 	unsigned long *submap, *ptr, pte;
@@ -264,18 +358,48 @@ int ipa_map_block_range(unsigned long *table, unsigned long vfn, unsigned long p
 	do {
 		unsigned long end = ipa_map_next_boundary(vfn, last, BLOCK_FRAME_SIZE);
 
+		if (ipa_map_is_aligned(vfn | pfn, CONTIG_BLOCK_SIZE) && last - vfn >= CONTIG_BLOCK_SIZE) {
+			bool live = false;
+			int i;
+
+			for (i = 0; i < CONTIG_ENTRIES; i++) {
+				if (ipa_pte_is_valid(ptr + i))
+					live = true;
+				ipa_pte_remove(batch, ptr + i, 2);
+			}
+
+			if (live)
+				ipa_contig_flush(batch, vfn);
+
+			for (i = 0; i < CONTIG_ENTRIES; i++, ptr++) {
+				pte = ipa_make_block_pte(pfn, flags) | IPA_PTE_CONTIG;
+				ipa_pte_update(ptr, pte);
+
+				vfn += BLOCK_FRAME_SIZE;
+				pfn += BLOCK_FRAME_SIZE;
+			}
+			continue;
+		}
+
 		if (ipa_map_is_aligned(vfn | pfn | end, BLOCK_FRAME_SIZE)) {
+			ipa_break_contig(batch, ptr, vfn);
+			if (ipa_pte_is_table(ptr))
+				ipa_pte_remove(batch, ptr, 2);
+
 			pte = ipa_make_block_pte(pfn, flags);
-			ipa_pte_update(ptr, pte);
+			ipa_batch_pte_update(batch, ptr, pte);
 
 			vfn += BLOCK_FRAME_SIZE;
 			pfn += BLOCK_FRAME_SIZE;
 		} else {
-			if (!ipa_pte_is_table(ptr))
-				ipa_map_downsize_block(ptr);
+			if (!ipa_pte_is_table(ptr)) {
+				rc = ipa_map_downsize_block(batch, ptr, vfn);
+				if (rc < 0)
+					break;
+			}
 
 			submap = ipa_pte_to_ptep(ptr);
-			rc = ipa_map_page_range(submap, vfn, pfn, end - vfn, flags);
+			rc = ipa_map_page_range(batch, submap, vfn, pfn, end - vfn, flags);
 			if (rc < 0)
 				break;
 
@@ -289,7 +413,7 @@ int ipa_map_block_range(unsigned long *table, unsigned long vfn, unsigned long p
 	return rc;
 }
 
-int ipa_map_section_range(unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
+static int __ipa_map_section_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
 {
 	int rc = 0;
 	unsigned long *submap, *ptr, pte;
@@ -303,17 +427,23 @@ int ipa_map_section_range(unsigned long *table, unsigned long vfn, unsigned long
 		unsigned long end = ipa_map_next_boundary(vfn, last, SECTION_FRAME_SIZE);
 
 		if (ipa_map_is_aligned(vfn | pfn | end, SECTION_FRAME_SIZE)) {
+			if (ipa_pte_is_table(ptr))
+				ipa_pte_remove(batch, ptr, 1);
+
 			pte = ipa_make_block_pte(pfn, flags);
-			ipa_pte_update(ptr, pte);
+			ipa_batch_pte_update(batch, ptr, pte);
 
 			vfn += SECTION_FRAME_SIZE;
 			pfn += SECTION_FRAME_SIZE;
 		} else {
-			if (!ipa_pte_is_table(ptr))
-				ipa_map_downsize_section(ptr);
+			if (!ipa_pte_is_table(ptr)) {
+				rc = ipa_map_downsize_section(batch, ptr);
+				if (rc < 0)
+					break;
+			}
 
 			submap = ipa_pte_to_ptep(ptr);
-			rc = ipa_map_block_range(submap, vfn, pfn, end - vfn, flags);
+			rc = ipa_map_block_range(batch, submap, vfn, pfn, end - vfn, flags);
 			if (rc < 0)
 				break;
 
@@ -327,7 +457,7 @@ int ipa_map_section_range(unsigned long *table, unsigned long vfn, unsigned long
 	return rc;
 }
 
-int ipa_map_range(unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
+static int __ipa_map_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
 {
 	int rc = 0;
 	unsigned long *ptr, last = vfn + nr;
@@ -343,13 +473,13 @@ int ipa_map_range(unsigned long *table, unsigned long vfn, unsigned long pfn, in
 		if (!ipa_pte_is_table(ptr)) {
 			unsigned long *pgt = ipa_alloc_table();
 			if (pgt == NULL) {
-				return -1;
+				return -ENOMEM;
 			}
 			ipa_table_pte_update(ptr, pgt);
 		}
 
 		submap = ipa_pte_to_ptep(ptr);
-		rc = ipa_map_section_range(submap, vfn, pfn, end - vfn, flags);
+		rc = __ipa_map_section_range(batch, submap, vfn, pfn, end - vfn, flags);
 		if (rc < 0)
 			 break;
 
@@ -362,7 +492,7 @@ int ipa_map_range(unsigned long *table, unsigned long vfn, unsigned long pfn, in
 	return rc;
 }
 
-int ipa_unmap_page_range(unsigned long *table, unsigned long vfn, int nr)
+static int ipa_unmap_page_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, int nr)
 {
 	unsigned long *ptr, pte = 0;
 	unsigned long end = vfn + nr;
@@ -372,7 +502,7 @@ int ipa_unmap_page_range(unsigned long *table, unsigned long vfn, int nr)
 	ptr = ipa_vfn_to_ptep(table, vfn, 3);
 
 	do {
-		ipa_pte_update(ptr, pte);
+		ipa_batch_pte_update(batch, ptr, pte);
 		vfn++;
 		ptr++;
 	} while (vfn < end);
@@ -380,7 +510,7 @@ int ipa_unmap_page_range(unsigned long *table, unsigned long vfn, int nr)
 	return 0;
 }
 
-int ipa_unmap_block_range(unsigned long *table, unsigned long  vfn, int nr)
+static int ipa_unmap_block_range(struct ipa_batch *batch, unsigned long *table, unsigned long  vfn, int nr)
 {
 	int rc = 0;
 	unsigned long *submap, *ptr;
@@ -394,14 +524,18 @@ int ipa_unmap_block_range(unsigned long *table, unsigned long  vfn, int nr)
 		unsigned long end = ipa_map_next_boundary(vfn, last, BLOCK_FRAME_SIZE);
 
 		if (ipa_map_is_aligned(vfn | end, BLOCK_FRAME_SIZE)) {
-			ipa_pte_remove(ptr, 2);
+			ipa_break_contig(batch, ptr, vfn);
+			ipa_pte_remove(batch, ptr, 2);
 			vfn += BLOCK_FRAME_SIZE;
 		} else {
-			if (!ipa_pte_is_table(ptr))
-				ipa_map_downsize_block(ptr);
+			if (!ipa_pte_is_table(ptr)) {
+				rc = ipa_map_downsize_block(batch, ptr, vfn);
+				if (rc < 0)
+					break;
+			}
 
 			submap = ipa_pte_to_ptep(ptr);
-			rc = ipa_unmap_page_range(submap, vfn, end - vfn);
+			rc = ipa_unmap_page_range(batch, submap, vfn, end - vfn);
 			if (rc < 0)
 				break;
 			vfn = end;
@@ -413,7 +547,7 @@ int ipa_unmap_block_range(unsigned long *table, unsigned long  vfn, int nr)
 	return rc;
 }
 
-int ipa_unmap_section_range(unsigned long* table, unsigned long vfn, int nr)
+static int __ipa_unmap_section_range(struct ipa_batch *batch, unsigned long* table, unsigned long vfn, int nr)
 {
 	int rc = 0;
 	unsigned long *submap, *ptr;
@@ -427,14 +561,17 @@ int ipa_unmap_section_range(unsigned long* table, unsigned long vfn, int nr)
 		unsigned long end = ipa_map_next_boundary(vfn, last, SECTION_FRAME_SIZE);
 
 		if (ipa_map_is_aligned(vfn | end, SECTION_FRAME_SIZE)) {
-			ipa_pte_remove(ptr, 1);
+			ipa_pte_remove(batch, ptr, 1);
 			vfn += SECTION_FRAME_SIZE;
 		} else {
-			if (!ipa_pte_is_table(ptr))
-				ipa_map_downsize_section(ptr);
+			if (!ipa_pte_is_table(ptr)) {
+				rc = ipa_map_downsize_section(batch, ptr);
+				if (rc < 0)
+					break;
+			}
 
 			submap = ipa_pte_to_ptep(ptr);
-			rc = ipa_unmap_block_range(submap, vfn, end - vfn);
+			rc = ipa_unmap_block_range(batch, submap, vfn, end - vfn);
 			if (rc < 0)
 				break;
 			vfn = end;
@@ -446,7 +583,7 @@ int ipa_unmap_section_range(unsigned long* table, unsigned long vfn, int nr)
 	return rc;
 }
 
-int ipa_unmap_range(unsigned long* table, unsigned long vfn, int nr)
+static int __ipa_unmap_range(struct ipa_batch *batch, unsigned long* table, unsigned long vfn, int nr)
 {
 	int rc = 0;
 	unsigned long *submap, *ptr;
@@ -463,7 +600,7 @@ int ipa_unmap_range(unsigned long* table, unsigned long vfn, int nr)
 			return -EINVAL;
 
 		submap = ipa_pte_to_ptep(ptr);
-		rc = ipa_unmap_section_range(submap, vfn, end - vfn);
+		rc = __ipa_unmap_section_range(batch, submap, vfn, end - vfn);
 		if (rc < 0)
 			 break;
 
@@ -474,3 +611,360 @@ int ipa_unmap_range(unsigned long* table, unsigned long vfn, int nr)
 	return rc;
 }
 
+static inline void ipa_protect_pte(struct ipa_batch *batch, unsigned long *entry, unsigned long flags)
+{
+	unsigned long pte = (*entry & ~IPA_PTE_PERM_MASK) | (flags & IPA_PTE_PERM_MASK);
+
+	if (pte != *entry)
+		ipa_batch_pte_update(batch, entry, pte);
+}
+
+static int ipa_protect_page_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, int nr, unsigned long flags)
+{
+	unsigned long *ptr;
+	unsigned long end = vfn + nr;
+
+	BUG_ON((table == NULL) && (nr == 0));
+
+	ptr = ipa_vfn_to_ptep(table, vfn, 3);
+
+	do {
+		if (ipa_pte_is_valid(ptr))
+			ipa_protect_pte(batch, ptr, flags);
+		vfn++;
+		ptr++;
+	} while (vfn < end);
+
+	return 0;
+}
+
+static int ipa_protect_block_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, int nr, unsigned long flags)
+{
+	int rc = 0;
+	unsigned long *ptr;
+	unsigned long last = vfn + nr;
+
+	BUG_ON((table == NULL) && (nr == 0));
+
+	ptr = ipa_vfn_to_ptep(table, vfn, 2);
+
+	do {
+		unsigned long end = ipa_map_next_boundary(vfn, last, BLOCK_FRAME_SIZE);
+
+		if (!ipa_pte_is_valid(ptr)) {
+			vfn = end;
+		} else if (ipa_pte_is_table(ptr)) {
+			rc = ipa_protect_page_range(batch, ipa_pte_to_ptep(ptr), vfn, end - vfn, flags);
+			if (rc < 0)
+				break;
+			vfn = end;
+		} else if (ipa_map_is_aligned(vfn | end, BLOCK_FRAME_SIZE)) {
+			ipa_break_contig(batch, ptr, vfn);
+			ipa_protect_pte(batch, ptr, flags);
+			vfn = end;
+		} else {
+			rc = ipa_map_downsize_block(batch, ptr, vfn);
+			if (rc < 0)
+				break;
+			/* Walk the new table on the next iteration */
+			continue;
+		}
+
+		ptr++;
+	} while (vfn < last);
+
+	return rc;
+}
+
+static int __ipa_protect_section_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, int nr, unsigned long flags)
+{
+	int rc = 0;
+	unsigned long *ptr;
+	unsigned long last = vfn + nr;
+
+	BUG_ON((table == NULL) && (nr == 0));
+
+	ptr = ipa_vfn_to_ptep(table, vfn, 1);
+
+	do {
+		unsigned long end = ipa_map_next_boundary(vfn, last, SECTION_FRAME_SIZE);
+
+		if (!ipa_pte_is_valid(ptr)) {
+			vfn = end;
+		} else if (ipa_pte_is_table(ptr)) {
+			rc = ipa_protect_block_range(batch, ipa_pte_to_ptep(ptr), vfn, end - vfn, flags);
+			if (rc < 0)
+				break;
+			vfn = end;
+		} else if (ipa_map_is_aligned(vfn | end, SECTION_FRAME_SIZE)) {
+			ipa_protect_pte(batch, ptr, flags);
+			vfn = end;
+		} else {
+			rc = ipa_map_downsize_section(batch, ptr);
+			if (rc < 0)
+				break;
+			continue;
+		}
+
+		ptr++;
+	} while (vfn < last);
+
+	return rc;
+}
+
+static int __ipa_protect_range(struct ipa_batch *batch, unsigned long *table, unsigned long vfn, int nr, unsigned long flags)
+{
+	int rc = 0;
+	unsigned long *ptr;
+	unsigned long last = vfn + nr;
+
+	BUG_ON((table == NULL) && (nr == 0));
+
+	ptr = ipa_vfn_to_ptep(table, vfn, 0);
+
+	do {
+		unsigned long end = ipa_map_next_boundary(vfn, last, REGION_FRAME_SIZE);
+
+		if (ipa_pte_is_table(ptr)) {
+			rc = __ipa_protect_section_range(batch, ipa_pte_to_ptep(ptr), vfn, end - vfn, flags);
+			if (rc < 0)
+				break;
+		}
+
+		vfn = end;
+		ptr++;
+	} while (vfn < last);
+
+	return rc;
+}
+
+/*
+ * Return the level 2 entry translating vfn, or NULL if the walk ends
+ * at a block or an invalid entry before reaching it.
+ */
+static unsigned long *ipa_lookup_block_pte(unsigned long *table, unsigned long vfn)
+{
+	unsigned long *ptr = ipa_vfn_to_ptep(table, vfn, 0);
+	int level;
+
+	for (level = 1; level <= 2; level++) {
+		if (!ipa_pte_is_table(ptr))
+			return NULL;
+		ptr = ipa_vfn_to_ptep(ipa_pte_to_ptep(ptr), vfn, level);
+	}
+
+	return ptr;
+}
+
+/*
+ * A level 3 table whose entries map one naturally aligned, physically
+ * contiguous 2MB region with identical attributes can be replaced by a
+ * single block. Returns the block entry, or 0 if the table does not qualify.
+ */
+static unsigned long ipa_coalesce_pte(const unsigned long *table)
+{
+	unsigned long first = table[0];
+	int i;
+
+	if ((first & IPA_PTE_MASK) != IPA_PTE_PAGE)
+		return 0;
+
+	if (!ipa_map_is_aligned(ipa_pte_to_addr_pfn(first), BLOCK_FRAME_SIZE))
+		return 0;
+
+	for (i = 1; i < IPA_ENTRIES; i++) {
+		if (table[i] != first + ((unsigned long)i << IPA_PAGE_SHIFT))
+			return 0;
+	}
+
+	return (first & ~IPA_PTE_MASK) | IPA_PTE_BLOCK;
+}
+
+/*
+ * Break the level 3 tables of the batch that can be coalesced, starting at
+ * *vfn. The entries are zeroed and remembered so that the blocks are only
+ * written after the TLB has been flushed (break-before-make).
+ */
+static void ipa_batch_collect(struct ipa_batch *batch, unsigned long *vfn)
+{
+	unsigned long *ptr, pte;
+
+	for (; *vfn < batch->end && batch->pending < IPA_BATCH_COALESCE; *vfn += BLOCK_FRAME_SIZE) {
+		ptr = ipa_lookup_block_pte(batch->table, *vfn);
+		if (ptr == NULL || !ipa_pte_is_table(ptr))
+			continue;
+
+		pte = ipa_coalesce_pte(ipa_pte_to_ptep(ptr));
+		if (pte == 0)
+			continue;
+
+		ipa_free_table_page(batch, pfn_to_page(ipa_pte_to_pfn(ptr)));
+		ipa_batch_pte_update(batch, ptr, 0);
+
+		batch->coalesce[batch->pending].vfn = *vfn;
+		batch->coalesce[batch->pending].entry = ptr;
+		batch->coalesce[batch->pending].pte = pte;
+		batch->pending++;
+		batch->coalesced++;
+	}
+}
+
+static void ipa_batch_flush(struct ipa_batch *batch, unsigned long start, unsigned long end)
+{
+	ipa_pte_sync();
+
+	if (!batch->flush || batch->flush_tlb == NULL)
+		return;
+
+	/* Invalidating by IPA only pays off for small ranges */
+	if (end - start > IPA_FLUSH_MAX_PAGES)
+		batch->flush_tlb(batch->data, 0, 0);
+	else
+		batch->flush_tlb(batch->data, start, end - start);
+
+	batch->flush = false;
+}
+
+void ipa_batch_init(struct ipa_batch *batch, unsigned long *table,
+					void (*flush_tlb)(void *data, unsigned long vfn, unsigned long nr),
+					void *data)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->table = table;
+	batch->flush_tlb = flush_tlb;
+	batch->data = data;
+	INIT_LIST_HEAD(&batch->free_tables);
+}
+
+int ipa_batch_map(struct ipa_batch *batch, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
+{
+	ipa_batch_touch(batch, vfn, nr);
+	return __ipa_map_range(batch, batch->table, vfn, pfn, nr, flags);
+}
+
+int ipa_batch_unmap(struct ipa_batch *batch, unsigned long vfn, int nr)
+{
+	ipa_batch_touch(batch, vfn, nr);
+	return __ipa_unmap_range(batch, batch->table, vfn, nr);
+}
+
+int ipa_batch_protect(struct ipa_batch *batch, unsigned long vfn, int nr, unsigned long flags)
+{
+	ipa_batch_touch(batch, vfn, nr);
+	return __ipa_protect_range(batch, batch->table, vfn, nr, flags);
+}
+
+/*
+ * Make every update of the batch visible with a single barrier and a single
+ * TLB invalidation for the touched range, then release the tables that were
+ * unlinked. Batches that can flush the TLB also get their fully populated
+ * level 3 tables folded back into blocks.
+ */
+void ipa_batch_commit(struct ipa_batch *batch)
+{
+	struct page *pg, *tmp;
+	unsigned long vfn;
+	int i;
+
+	ipa_batch_flush(batch, batch->start, batch->end);
+
+	if (batch->flush_tlb != NULL && batch->start != batch->end) {
+		vfn = batch->start & BLOCK_FRAME_MASK;
+		while (vfn < batch->end) {
+			ipa_batch_collect(batch, &vfn);
+			if (batch->pending == 0)
+				break;
+
+			/* Only the coalesced blocks are left to invalidate */
+			ipa_batch_flush(batch, batch->coalesce[0].vfn, vfn);
+
+			for (i = 0; i < batch->pending; i++)
+				ipa_pte_update(batch->coalesce[i].entry, batch->coalesce[i].pte);
+			batch->pending = 0;
+			ipa_pte_sync();
+		}
+	}
+
+	list_for_each_entry_safe(pg, tmp, &batch->free_tables, lru) {
+		list_del(&pg->lru);
+		__free_pages(pg, 0);
+	}
+
+	batch->start = batch->end = 0;
+}
+
+/*
+ * The unbatched helpers below are only meant for tables that no vcpu can
+ * walk yet, so they never need a TLB flush.
+ */
+int ipa_map_range(unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
+{
+	struct ipa_batch batch;
+	int rc;
+
+	ipa_batch_init(&batch, table, NULL, NULL);
+	rc = ipa_batch_map(&batch, vfn, pfn, nr, flags);
+	ipa_batch_commit(&batch);
+
+	return rc;
+}
+
+int ipa_map_section_range(unsigned long *table, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags)
+{
+	struct ipa_batch batch;
+	int rc;
+
+	ipa_batch_init(&batch, table, NULL, NULL);
+	rc = __ipa_map_section_range(&batch, table, vfn, pfn, nr, flags);
+	ipa_batch_commit(&batch);
+
+	return rc;
+}
+
+int ipa_unmap_range(unsigned long* table, unsigned long vfn, int nr)
+{
+	struct ipa_batch batch;
+	int rc;
+
+	ipa_batch_init(&batch, table, NULL, NULL);
+	rc = ipa_batch_unmap(&batch, vfn, nr);
+	ipa_batch_commit(&batch);
+
+	return rc;
+}
+
+int ipa_unmap_section_range(unsigned long* table, unsigned long vfn, int nr)
+{
+	struct ipa_batch batch;
+	int rc;
+
+	ipa_batch_init(&batch, table, NULL, NULL);
+	rc = __ipa_unmap_section_range(&batch, table, vfn, nr);
+	ipa_batch_commit(&batch);
+
+	return rc;
+}
+
+int ipa_protect_range(unsigned long* table, unsigned long vfn, int nr, unsigned long flags)
+{
+	struct ipa_batch batch;
+	int rc;
+
+	ipa_batch_init(&batch, table, NULL, NULL);
+	rc = ipa_batch_protect(&batch, vfn, nr, flags);
+	ipa_batch_commit(&batch);
+
+	return rc;
+}
+
+int ipa_protect_section_range(unsigned long* table, unsigned long vfn, int nr, unsigned long flags)
+{
+	struct ipa_batch batch;
+	int rc;
+
+	ipa_batch_init(&batch, table, NULL, NULL);
+	rc = __ipa_protect_section_range(&batch, table, vfn, nr, flags);
+	ipa_batch_commit(&batch);
+
+	return rc;
+}
@@ -1,6 +1,9 @@
 #ifndef __ARM_IPA_H__
 #define __ARM_IPA_H__
 
+#include <linux/types.h>
+#include <linux/list.h>
+
 #define IPA_PAGE_SHIFT		(12)
 #define IPA_PAGE_SIZE		(1 << IPA_PAGE_SHIFT)
 
@@ -19,6 +22,10 @@
 #define IPA_PTE_READABLE	((0x1UL) << 6)
 #define IPA_PTE_WRITABLE	((0x2UL) << 6)
 #define IPA_PTE_XN			((0x1UL) << 54)
+#define IPA_PTE_CONTIG		((0x1UL) << 52)
+
+#define IPA_PTE_PERM_MASK	(IPA_PTE_READABLE | IPA_PTE_WRITABLE | IPA_PTE_XN)
+#define IPA_PTE_ADDR_MASK	(0x0000FFFFFFFFF000UL)
 
 #define IPA_PTE_ACCESSED	((0x1UL) << 10)
 
@@ -31,6 +38,32 @@
 #define IPA_TYPE_NORMAL (IPA_PTE_OUTER | IPA_PTE_ACCESSED | ((IPA_PTE_READABLE | IPA_PTE_WRITABLE)) | (0xF << 2))
 #define IPA_TYPE_DEVICE (IPA_PTE_OUTER | IPA_PTE_ACCESSED | ((IPA_PTE_READABLE | IPA_PTE_WRITABLE)) | (0x1 << 2))
 
+#define IPA_BATCH_COALESCE	16
+
+/*
+ * A batch collects stage-2 updates so that they are published with one
+ * barrier and one TLB invalidation covering every entry that was touched.
+ * Tables unlinked by the batch are only freed on commit.
+ */
+struct ipa_batch {
+	unsigned long *table;
+	/* Range of vfns touched by the batch */
+	unsigned long start;
+	unsigned long end;
+	/* A valid translation was changed and the TLB must be flushed */
+	bool flush;
+	void (*flush_tlb)(void *data, unsigned long vfn, unsigned long nr);
+	void *data;
+	struct list_head free_tables;
+	unsigned long coalesced;
+	int pending;
+	struct {
+		unsigned long vfn;
+		unsigned long *entry;
+		unsigned long pte;
+	} coalesce[IPA_BATCH_COALESCE];
+};
+
 unsigned long *ipa_alloc_table(void);
 void ipa_free_table(unsigned long *table);
 
@@ -42,5 +75,17 @@ int ipa_unmap_section_range(unsigned long* table, unsigned long vfn, int nr);
 int ipa_protect_range(unsigned long* table, unsigned long vfn, int nr, unsigned long flags);
 int ipa_protect_section_range(unsigned long* table, unsigned long vfn, int nr, unsigned long flags);
 
+/*
+ * flush_tlb() is called with nr == 0 to flush every translation of the
+ * table, or may be NULL when no vcpu can walk the table yet.
+ */
+void ipa_batch_init(struct ipa_batch *batch, unsigned long *table,
+					void (*flush_tlb)(void *data, unsigned long vfn, unsigned long nr),
+					void *data);
+int ipa_batch_map(struct ipa_batch *batch, unsigned long vfn, unsigned long pfn, int nr, unsigned long flags);
+int ipa_batch_unmap(struct ipa_batch *batch, unsigned long vfn, int nr);
+int ipa_batch_protect(struct ipa_batch *batch, unsigned long vfn, int nr, unsigned long flags);
+void ipa_batch_commit(struct ipa_batch *batch);
+
 void ipa_dump_page_maps(unsigned long *page_table, int depth);
 #endif /*!__ARM_IPA_H__*/
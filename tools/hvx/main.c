@@ -40,6 +40,13 @@
 #include <linux/irqchip.h>
 #include <linux/irqdomain.h>
 #include <linux/interrupt.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/cma.h>
+#include <linux/rculist.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/bitmap.h>
 
 #include "log.h"
 #include "hvx.h"
@@ -47,19 +54,72 @@
 #include "interface.h"
 
 #define HVX_MAX_VCPUS	8
+/* One bit of hvx_domain.ioevents each */
+#define HVX_MAX_IOEVENTFDS	BITS_PER_LONG
+
+/*
+ * cma_alloc() is only exported to modules since 5.11. The CMA area comes
+ * from the optional memory-region of the hvx,event node.
+ */
+#if IS_ENABLED(CONFIG_DMA_CMA) && (LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0))
+#define HVX_HAVE_CMA
+#endif
 
 #define HVX_DEVICE_NAME "hvx"
 #define HVX_CLASS_NAME "hvx"
 
 struct hvx_memory_chunk {
 	struct page *page;
+	unsigned long ipa;
 	size_t size;
+	bool cma;
 	struct list_head head;
 };
 
+struct hvx_adopted_range {
+	unsigned long ipa;
+	unsigned long flags;
+	unsigned long nr_pages;
+	struct page **pages;
+	struct list_head head;
+};
+
+/* Dirty pages further apart than this are write protected in separate batches */
+#define HVX_DIRTY_FLUSH_PAGES	512
+
+/* hvx_domain.flags */
+#define HVX_DOMAIN_RUNNING	0
+/* Paused for good because clones share its memory */
+#define HVX_DOMAIN_FROZEN	1
+
+struct hvx_domain;
+
+struct hvx_ioeventfd {
+	struct list_head	head;
+	struct eventfd_ctx	*eventfd;
+	/* What the hypervisor matches, and the slot it reports a match in */
+	struct ioeventfd_control ctl;
+	struct rcu_head		rcu;
+};
+
+struct hvx_irqfd {
+	struct list_head	head;
+	struct hvx_domain	*domain;
+	struct eventfd_ctx	*eventfd;
+	unsigned int		irq;
+	wait_queue_entry_t	wait;
+	poll_table			pt;
+};
+
 struct hvx_vcpu {
 	unsigned int id;
 	struct eventfd_ctx  *eventfd;
+	struct hvx_domain	*domain;
+	struct hvx_exit_ring *ring;
+	u32					notified;
+	struct hvx_vcpu_stats *stats;
+	/* ring->signalled of the last batch whose latency was recorded */
+	u64					accounted;
 };
 
 struct hvx_domain {
@@ -68,10 +128,26 @@ struct hvx_domain {
 	struct device 		*dev;
 	struct list_head	head;
 	struct list_head	extent_list;
+	struct list_head	adopted_list;
+	struct list_head	ioeventfd_list;
+	struct list_head	irqfd_list;
+	/* Slots in use, and slots the hypervisor matched a write for */
+	unsigned long		ioeventfd_slots;
+	unsigned long		ioevents;
+	size_t				memory;
 	atomic_t			refcnt;
 	struct mutex		lock;
 	unsigned long		flags;
 	struct page			*page_table;
+	struct hvx_vcpu __rcu *vcpu[HVX_MAX_VCPUS];
+	/* Domain whose memory a clone starts out sharing, and the number of those */
+	struct hvx_domain	*parent;
+	atomic_t			clones;
+	/* One bit per guest page written since the last fetch, NULL unless logging */
+	unsigned long		*dirty_bitmap;
+	/* Holds the userspace mappings of guest memory, see hvx_create_domain_fd() */
+	struct address_space mapping;
+	struct rcu_head		rcu;
 };
 
 struct hvx_event {
@@ -82,21 +158,52 @@ static int hvx_dev_major;
 static struct class *hvx_class;
 static struct device *hvx_device;
 
+/*
+ * Only taken to add or remove a domain; the event irq walks the list
+ * under RCU, and everything else goes through the domain fd.
+ */
 static LIST_HEAD(hvx_domain_list);
-static DEFINE_RWLOCK(hvx_domain_list_lock);
+static DEFINE_SPINLOCK(hvx_domain_list_lock);
 static struct hvx_event __percpu *hvx_event;
 
 static unsigned int hvx_event_irq = 31;
 
+static void hvx_get_domain(struct hvx_domain *domain)
+{
+	atomic_inc(&domain->refcnt);
+}
+
+static void hvx_destroy_address_space(struct hvx_domain *dom);
+static long hvx_ioctl_domain_clone(struct hvx_domain *parent, void __user *udata);
+
+/*
+ * The memory of a domain with clones outlives its fd and goes with the
+ * last reference, which the last clone holds.
+ */
+static void hvx_put_domain(struct hvx_domain *domain)
+{
+	struct hvx_domain *parent = domain->parent;
+
+	if (!atomic_dec_and_test(&domain->refcnt))
+		return;
+
+	hvx_destroy_address_space(domain);
+	kfree_rcu(domain, rcu);
+
+	if (parent != NULL) {
+		atomic_dec(&parent->clones);
+		hvx_put_domain(parent);
+	}
+}
+
 void free_guest_pages(struct page *pg, size_t size)
 {
-	unsigned long addr = page_to_phys(pg);
-	unsigned long end = addr + PAGE_ALIGN(size);
+	unsigned long pfn = page_to_pfn(pg);
+	unsigned long end = pfn + (PAGE_ALIGN(size) >> PAGE_SHIFT);
 
-	while (addr < end) {
-		__free_pages(pg, 0);
-		addr += PAGE_SIZE;
-		pg++;
+	while (pfn < end) {
+		__free_pages(pfn_to_page(pfn), 0);
+		pfn++;
 	}
 }
 
@@ -106,6 +213,9 @@ struct page *alloc_guest_pages(size_t size, gfp_t gfp_mask)
 	unsigned long addr, end, used;
 	struct page *pg;
 
+	if (order >= MAX_ORDER)
+		return NULL;
+
 	pg = alloc_pages(gfp_mask, order);
 	if (pg == NULL)
 		return NULL;
@@ -123,13 +233,24 @@ struct page *alloc_guest_pages(size_t size, gfp_t gfp_mask)
 	return pg;
 }
 
+static void hvx_free_chunk(struct hvx_memory_chunk *ext)
+{
+#ifdef HVX_HAVE_CMA
+	if (ext->cma) {
+		cma_release(hvx_device->cma_area, ext->page, ext->size >> PAGE_SHIFT);
+		return;
+	}
+#endif
+	free_guest_pages(ext->page, ext->size);
+}
+
 void hvx_free_extents(struct hvx_domain *domain)
 {
 	unsigned long freed = 0;
 	struct hvx_memory_chunk *ext, *tmp;
 
 	list_for_each_entry_safe(ext, tmp, &domain->extent_list, head) {
-		free_guest_pages(ext->page, ext->size);
+		hvx_free_chunk(ext);
 		freed += ext->size;
 		list_del(&ext->head);
 		kfree(ext);
@@ -140,52 +261,186 @@ void hvx_free_extents(struct hvx_domain *domain)
 
 #define MIN_PAGE_SIZE	(PAGE_SIZE * 512)
 
+/*
+ * Extent sizes tried in order. 1GB extents are mapped with level 1 block
+ * descriptors, 32MB ones with contiguous level 2 blocks. Both are larger
+ * than the buddy allocator hands out, so they only come from the CMA area;
+ * without one every extent is 2MB.
+ */
+static const size_t hvx_extent_sizes[] = {
+	1UL << 30,
+	32UL << 20,
+	MIN_PAGE_SIZE,
+};
+
+static struct page *hvx_alloc_block(size_t size, bool *cma)
+{
+	*cma = false;
+
+#ifdef HVX_HAVE_CMA
+	if (hvx_device->cma_area && size > MIN_PAGE_SIZE) {
+		struct page *pg = cma_alloc(hvx_device->cma_area, size >> PAGE_SHIFT, get_order(size), true);
+		if (pg != NULL) {
+			*cma = true;
+			return pg;
+		}
+	}
+#endif
+
+	if (size > MIN_PAGE_SIZE)
+		return NULL;
+
+	return alloc_guest_pages(size, GFP_HIGHUSER);
+}
+
+/*
+ * Userspace may have guest memory mapped for as long as the domain lives,
+ * so its mappings must go before the memory behind them is given back.
+ * A size of 0 covers everything from @ipa on.
+ */
+static void hvx_zap_user_range(struct hvx_domain *dom, unsigned long ipa, size_t size)
+{
+	unmap_mapping_range(&dom->mapping, ipa, size, 1);
+}
+
+static struct hvx_memory_chunk *hvx_find_extent(struct hvx_domain *domain,
+												unsigned long start, unsigned long end)
+{
+	struct hvx_memory_chunk *ext;
+
+	list_for_each_entry(ext, &domain->extent_list, head) {
+		if (ext->ipa < end && ext->ipa + ext->size > start)
+			return ext;
+	}
+
+	return NULL;
+}
+
+/*
+ * Allocate the largest extent that starts at @ipa, fits in @maxsize and
+ * does not overlap memory the guest already has.
+ */
+static struct hvx_memory_chunk *hvx_alloc_extent(struct hvx_domain *domain,
+												 unsigned long ipa, size_t maxsize)
+{
+	struct hvx_memory_chunk *ext;
+	struct page *pg = NULL;
+	size_t size = MIN_PAGE_SIZE;
+	bool cma = false;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hvx_extent_sizes); i++) {
+		size = hvx_extent_sizes[i];
+
+		/* The smallest extent may round the domain size up */
+		if (size > MIN_PAGE_SIZE &&
+			(maxsize < size || !IS_ALIGNED(ipa, size) ||
+			 hvx_find_extent(domain, ipa, ipa + size)))
+			continue;
+
+		pg = hvx_alloc_block(size, &cma);
+		if (pg != NULL)
+			break;
+	}
+
+	if (pg == NULL)
+		return NULL;
+
+	ext = kmalloc(sizeof(*ext), GFP_KERNEL);
+	if (ext == NULL) {
+		struct hvx_memory_chunk tmp = { .page = pg, .size = size, .cma = cma };
+		hvx_free_chunk(&tmp);
+		return NULL;
+	}
+
+	ext->page  = pg;
+	ext->ipa   = ipa;
+	ext->size  = size;
+	ext->cma   = cma;
+	list_add_tail(&ext->head, &domain->extent_list);
+
+	return ext;
+}
+
 int hvx_alloc_extents(struct hvx_domain *domain, size_t maxmem)
 {
 	size_t allocated = 0;
+	unsigned long ipa = HVX_GUEST_RAM_BASE;
+	unsigned long blocks[ARRAY_SIZE(hvx_extent_sizes)] = { 0 };
+	int i;
 
 	while (allocated < maxmem) {
-		struct hvx_memory_chunk *ext;
-
-		struct page *pg = alloc_guest_pages(MIN_PAGE_SIZE, GFP_HIGHUSER);
-		if (pg == NULL) {
+		struct hvx_memory_chunk *ext = hvx_alloc_extent(domain, ipa, maxmem - allocated);
+		if (ext == NULL) {
 			hvx_error("Not enough memory: %ld allocated\n", allocated);
 			hvx_free_extents(domain);
 			return -ENOMEM;
 		}
 
-		ext = kmalloc(sizeof(*ext), GFP_KERNEL);
-		if (ext == NULL) {
-			free_guest_pages(pg, MIN_PAGE_SIZE);
-			break;
+		for (i = 0; i < ARRAY_SIZE(hvx_extent_sizes); i++) {
+			if (ext->size == hvx_extent_sizes[i])
+				blocks[i]++;
 		}
 
-		ext->page  = pg;
-		ext->size  = MIN_PAGE_SIZE;
-		list_add_tail(&ext->head, &domain->extent_list);
-
-		allocated += MIN_PAGE_SIZE;
+		allocated += ext->size;
+		ipa += ext->size;
 	}
 
-	if (allocated < maxmem) {
-		hvx_error("Not enough memory: %ld allocated\n", allocated);
-		hvx_free_extents(domain);
-		return -ENOMEM;
-	}
-
-	hvx_debug("%ld memories allocated\n", maxmem);
+	hvx_debug("%ld memories allocated: %lu x 1G, %lu x 32M, %lu x 2M\n",
+			  maxmem, blocks[0], blocks[1], blocks[2]);
 
 	return 0;
 }
 
-static long hvx_create_address_space(struct hvx_domain *dom, size_t size)
+static void hvx_flush_tlb_range(struct hvx_domain *dom, unsigned long ipa, size_t size)
+{
+	struct domain_control domctl;
+
+	if (!test_bit(HVX_DOMAIN_RUNNING, &dom->flags))
+		return;
+
+	domctl.id = dom->id;
+	if (vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_FLUSH_TLB, &domctl, ipa, size, 0) < 0)
+		hvx_error("Failed to flush stage-2 TLB of domain %ld\n", dom->id);
+}
+
+static void hvx_batch_flush_tlb(void *data, unsigned long vfn, unsigned long nr)
+{
+	hvx_flush_tlb_range(data, vfn << PAGE_SHIFT, nr << PAGE_SHIFT);
+}
+
+/* Stage-2 updates of a domain that vcpus may already be running on */
+static void hvx_batch_init(struct ipa_batch *batch, struct hvx_domain *dom)
+{
+	ipa_batch_init(batch, page_to_virt(dom->page_table), hvx_batch_flush_tlb, dom);
+}
+
+static void hvx_batch_commit(struct ipa_batch *batch)
+{
+	ipa_batch_commit(batch);
+	if (batch->coalesced)
+		hvx_debug("%lu page tables coalesced into blocks\n", batch->coalesced);
+}
+
+/*
+ * Device pages every domain gets: two host pages at 0x50046000 are passed
+ * through at 0x50042000, and the page at 0x50041000 is left unmapped so
+ * that the guest traps on it.
+ */
+static void hvx_map_device_window(unsigned long *ptr)
+{
+	ipa_map_range(ptr, 0x50042000 >> PAGE_SHIFT, 0x50046000 >> PAGE_SHIFT, 2, IPA_TYPE_DEVICE);
+	ipa_unmap_range(ptr, 0x50041000 >> PAGE_SHIFT, 1);
+}
+
+static long hvx_create_address_space(struct hvx_domain *dom, size_t size, bool lazy)
 {
 	struct page *pgd;
 	struct hvx_memory_chunk *ext;
 	unsigned long *ptr;
-	unsigned long vaddr = 0x40000000UL >> IPA_PAGE_SHIFT; 
 
-	if (hvx_alloc_extents(dom, size) != 0) {
+	/* Lazy domains get their memory on the first stage-2 fault */
+	if (!lazy && hvx_alloc_extents(dom, size) != 0) {
 		hvx_error("Failed to allocate memory\n");
 		return -ENOMEM;
 	}
@@ -201,44 +456,2018 @@ static long hvx_create_address_space(struct hvx_domain *dom, size_t size)
 	list_for_each_entry(ext, &dom->extent_list, head) {
 		unsigned long nr = ext->size >> PAGE_SHIFT;
 		unsigned long pfn = page_to_pfn(ext->page);
-		ipa_map_range(ptr, vaddr, pfn, nr, IPA_TYPE_NORMAL);
-		vaddr += nr;
+		ipa_map_range(ptr, ext->ipa >> PAGE_SHIFT, pfn, nr, IPA_TYPE_NORMAL);
+	}
+
+	hvx_map_device_window(ptr);
+
+	dom->page_table = pgd;
+	dom->memory = size;
+
+	ipa_dump_page_maps(ptr, 0);
+
+	return 0;
+}
+
+static void hvx_release_adopted(struct hvx_adopted_range *range)
+{
+	unsigned long i;
+
+	for (i = 0; i < range->nr_pages; i++) {
+		/* Whatever the guest wrote has to make it back to the file */
+		if (range->flags & IPA_PTE_WRITABLE)
+			set_page_dirty_lock(range->pages[i]);
+		put_page(range->pages[i]);
+	}
+
+	kvfree(range->pages);
+	kfree(range);
+}
+
+static void hvx_destroy_address_space(struct hvx_domain *dom)
+{
+	struct hvx_adopted_range *range, *tmp;
+
+	if (dom->page_table) {
+		ipa_free_table(page_to_virt(dom->page_table));
+		dom->page_table = NULL;
+	}
+
+	list_for_each_entry_safe(range, tmp, &dom->adopted_list, head) {
+		list_del(&range->head);
+		hvx_release_adopted(range);
+	}
+
+	hvx_zap_user_range(dom, 0, 0);
+	hvx_free_extents(dom);
+	dom->memory = 0;
+
+	kvfree(dom->dirty_bitmap);
+	dom->dirty_bitmap = NULL;
+}
+
+/*
+ * Extents that are entirely shadowed by adopted pages are no longer
+ * reachable by the guest, so give them back to the host. The caller has
+ * zapped the user mapping of the range already.
+ */
+static void hvx_release_shadowed_extents(struct hvx_domain *dom,
+										 unsigned long ipa, size_t size)
+{
+	struct hvx_memory_chunk *ext, *tmp;
+
+	list_for_each_entry_safe(ext, tmp, &dom->extent_list, head) {
+		if (ext->ipa < ipa || ext->ipa + ext->size > ipa + size)
+			continue;
+
+		hvx_free_chunk(ext);
+		list_del(&ext->head);
+		kfree(ext);
+	}
+}
+
+/*
+ * Map the adopted pages that fall in [start, end), physically contiguous
+ * runs of page cache pages in one go.
+ */
+static int hvx_map_adopted(struct ipa_batch *batch, struct hvx_adopted_range *range,
+						   unsigned long start, unsigned long end, unsigned long flags)
+{
+	unsigned long first, last, i, run;
+	int ret;
+
+	first = max(start, range->ipa);
+	last = min(end, range->ipa + (range->nr_pages << PAGE_SHIFT));
+	if (first >= last)
+		return 0;
+
+	first = (first - range->ipa) >> PAGE_SHIFT;
+	last = (last - range->ipa) >> PAGE_SHIFT;
+
+	for (run = first, i = first + 1; i <= last; i++) {
+		if (i < last &&
+			page_to_pfn(range->pages[i]) == page_to_pfn(range->pages[i - 1]) + 1)
+			continue;
+
+		ret = ipa_batch_map(batch, (range->ipa >> PAGE_SHIFT) + run,
+							page_to_pfn(range->pages[run]), i - run, flags);
+		if (ret < 0)
+			return ret;
+
+		run = i;
+	}
+
+	return 0;
+}
+
+static bool hvx_range_adopted(struct hvx_domain *dom, unsigned long start, unsigned long end)
+{
+	struct hvx_adopted_range *range;
+
+	list_for_each_entry(range, &dom->adopted_list, head) {
+		if (range->ipa <= start && range->ipa + (range->nr_pages << PAGE_SHIFT) >= end)
+			return true;
+	}
+
+	return false;
+}
+
+static long hvx_ioctl_memory_adopt(struct hvx_domain *dom, void __user *udata)
+{
+	long ret = 0;
+	struct hvx_proto_memory_adopt op;
+	struct hvx_adopted_range *range;
+	struct ipa_batch batch;
+	int pinned;
+
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
+
+	if (op.size == 0 || !PAGE_ALIGNED(op.uaddr) || !PAGE_ALIGNED(op.base))
+		return -EINVAL;
+
+	op.size = PAGE_ALIGN(op.size);
+
+	range = kzalloc(sizeof(*range), GFP_KERNEL);
+	if (range == NULL)
+		return -ENOMEM;
+
+	range->ipa = op.base;
+	range->nr_pages = op.size >> PAGE_SHIFT;
+	range->pages = kvmalloc_array(range->nr_pages, sizeof(struct page *), GFP_KERNEL);
+	if (range->pages == NULL) {
+		kfree(range);
+		return -ENOMEM;
+	}
+
+	/* The guest may only write to pages that were pinned for writing */
+	pinned = get_user_pages_fast(op.uaddr, range->nr_pages,
+								 (op.flags & HVX_ADOPT_READONLY) ? 0 : FOLL_WRITE, range->pages);
+	if (pinned < 0 || pinned != range->nr_pages) {
+		range->nr_pages = pinned < 0 ? 0 : pinned;
+		hvx_release_adopted(range);
+		return pinned < 0 ? pinned : -EFAULT;
+	}
+
+	range->flags = IPA_TYPE_NORMAL;
+	if (op.flags & HVX_ADOPT_READONLY)
+		range->flags &= ~IPA_PTE_WRITABLE;
+
+	mutex_lock(&dom->lock);
+
+	if (test_bit(HVX_DOMAIN_FROZEN, &dom->flags)) {
+		mutex_unlock(&dom->lock);
+		hvx_release_adopted(range);
+		return -EBUSY;
+	}
+
+	if (dom->page_table == NULL ||
+		op.base < HVX_GUEST_RAM_BASE ||
+		op.base + op.size > HVX_GUEST_RAM_BASE + dom->memory) {
+		mutex_unlock(&dom->lock);
+		hvx_release_adopted(range);
+		return -EINVAL;
+	}
+
+	hvx_batch_init(&batch, dom);
+
+	ret = hvx_map_adopted(&batch, range, op.base, op.base + op.size, range->flags);
+	if (ret < 0) {
+		/* Fall back to the regular guest memory for the whole range */
+		struct hvx_memory_chunk *ext;
+
+		list_for_each_entry(ext, &dom->extent_list, head) {
+			if (ext->ipa + ext->size <= op.base || ext->ipa >= op.base + op.size)
+				continue;
+			ipa_batch_map(&batch, ext->ipa >> PAGE_SHIFT, page_to_pfn(ext->page),
+						  ext->size >> PAGE_SHIFT, IPA_TYPE_NORMAL);
+		}
+		hvx_batch_commit(&batch);
+		mutex_unlock(&dom->lock);
+		hvx_release_adopted(range);
+		return -ENOMEM;
+	}
+
+	/*
+	 * The shadowed extents must be unreachable before they are freed.
+	 * Userspace must not see them anymore either, even where an extent
+	 * is only partly shadowed and stays.
+	 */
+	hvx_batch_commit(&batch);
+	hvx_zap_user_range(dom, op.base, op.size);
+	hvx_release_shadowed_extents(dom, op.base, op.size);
+	list_add_tail(&range->head, &dom->adopted_list);
+
+	mutex_unlock(&dom->lock);
+
+	hvx_debug("%lu pages adopted at 0x%llx\n", range->nr_pages, op.base);
+
+	return 0;
+}
+
+static void hvx_dirty_mark(struct hvx_domain *dom, unsigned long ipa, size_t size)
+{
+	if (dom->dirty_bitmap == NULL)
+		return;
+
+	bitmap_set(dom->dirty_bitmap, (ipa - HVX_GUEST_RAM_BASE) >> PAGE_SHIFT, size >> PAGE_SHIFT);
+}
+
+/*
+ * Make [start, end) of the domain's own memory writable again. Adopted
+ * pages in there are mapped again with their own permissions.
+ */
+static int hvx_dirty_unprotect(struct hvx_domain *dom, struct ipa_batch *batch,
+							   unsigned long start, unsigned long end)
+{
+	struct hvx_adopted_range *range;
+	int ret;
+
+	ret = ipa_batch_protect(batch, start >> PAGE_SHIFT, (end - start) >> PAGE_SHIFT, IPA_TYPE_NORMAL);
+	if (ret < 0)
+		return ret;
+
+	list_for_each_entry(range, &dom->adopted_list, head) {
+		ret = hvx_map_adopted(batch, range, start, end, range->flags);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * A clone starts out with every page of its parent mapped read-only, so
+ * that only writes fault and copy.
+ */
+static long hvx_create_clone_address_space(struct hvx_domain *dom, struct hvx_domain *parent)
+{
+	struct page *pgd;
+	struct hvx_memory_chunk *ext;
+	struct hvx_adopted_range *range;
+	struct ipa_batch batch;
+	unsigned long *ptr;
+	long ret = 0;
+
+	pgd = alloc_pages(GFP_KERNEL | __GFP_ZERO, 0);
+	if (pgd == NULL)
+		return -ENOMEM;
+
+	ptr = page_to_virt(pgd);
+
+	/* Nothing runs on the new tables yet, nothing to flush */
+	ipa_batch_init(&batch, ptr, NULL, NULL);
+
+	list_for_each_entry(ext, &parent->extent_list, head) {
+		ret = ipa_batch_map(&batch, ext->ipa >> PAGE_SHIFT, page_to_pfn(ext->page),
+							ext->size >> PAGE_SHIFT, IPA_TYPE_NORMAL & ~IPA_PTE_WRITABLE);
+		if (ret < 0)
+			break;
+	}
+
+	list_for_each_entry(range, &parent->adopted_list, head) {
+		if (ret < 0)
+			break;
+		ret = hvx_map_adopted(&batch, range, range->ipa,
+							  range->ipa + (range->nr_pages << PAGE_SHIFT),
+							  range->flags & ~IPA_PTE_WRITABLE);
 	}
 
-	ipa_map_range(ptr, 0x50042000 >> PAGE_SHIFT, 0x50046000 >> PAGE_SHIFT, 2, IPA_TYPE_DEVICE);
-	ipa_unmap_range(ptr, 0x50041000 >> PAGE_SHIFT, 1);
+	ipa_batch_commit(&batch);
+
+	if (ret < 0) {
+		ipa_free_table(ptr);
+		return ret;
+	}
+
+	hvx_map_device_window(ptr);
+
+	dom->page_table = pgd;
+	dom->memory = parent->memory;
+
+	return 0;
+}
+
+/*
+ * What the parent of a clone has at @ipa, adopted pages first since they
+ * shadow the extent below them. NULL if it has nothing there.
+ */
+static struct page *hvx_parent_page(struct hvx_domain *parent, struct hvx_memory_chunk *ext,
+									unsigned long ipa)
+{
+	struct hvx_adopted_range *range;
+
+	list_for_each_entry(range, &parent->adopted_list, head) {
+		if (ipa >= range->ipa && ipa < range->ipa + (range->nr_pages << PAGE_SHIFT))
+			return range->pages[(ipa - range->ipa) >> PAGE_SHIFT];
+	}
+
+	if (ext == NULL)
+		return NULL;
+
+	return ext->page + ((ipa - ext->ipa) >> PAGE_SHIFT);
+}
+
+/*
+ * Give a clone its own copy of the 2MB granule at @ipa, on its first
+ * write to it or first access to a granule the parent never backed. The
+ * parent is frozen: the ioctls that change its memory fail and it has no
+ * user mapping left, see hvx_freeze_domain(), so neither its lists nor
+ * its memory change under us although its lock is not held.
+ */
+static int hvx_cow_granule(struct hvx_domain *dom, struct ipa_batch *batch, unsigned long ipa)
+{
+	struct hvx_domain *parent = dom->parent;
+	struct hvx_memory_chunk *ext, *src;
+	struct ipa_batch bbm;
+	struct page *page;
+	unsigned long i;
+
+	ext = hvx_alloc_extent(dom, ipa, MIN_PAGE_SIZE);
+	if (ext == NULL)
+		return -ENOMEM;
+
+	/* Parent extents are at least 2MB and aligned, one covers the whole granule */
+	src = hvx_find_extent(parent, ipa, ipa + MIN_PAGE_SIZE);
+
+	for (i = 0; i < MIN_PAGE_SIZE >> PAGE_SHIFT; i++) {
+		page = hvx_parent_page(parent, src, ipa + (i << PAGE_SHIFT));
+		if (page != NULL)
+			copy_page(page_address(ext->page + i), page_address(page));
+		else
+			clear_page(page_address(ext->page + i));
+	}
+
+	/* Break before make, the read-only mapping must be gone from the TLBs first */
+	hvx_batch_init(&bbm, dom);
+	ipa_batch_unmap(&bbm, ipa >> PAGE_SHIFT, MIN_PAGE_SIZE >> PAGE_SHIFT);
+	hvx_batch_commit(&bbm);
+
+	return ipa_batch_map(batch, ipa >> PAGE_SHIFT, page_to_pfn(ext->page),
+						 MIN_PAGE_SIZE >> PAGE_SHIFT, IPA_TYPE_NORMAL);
+}
+
+/*
+ * Back every 2MB granule of [base, base + size) that has no memory yet.
+ * Granules that only hold adopted pages are left alone, while adopted
+ * pages inside a newly backed granule are mapped again on top of it.
+ * Clones get a copy of what their parent has instead.
+ */
+static long hvx_populate_range(struct hvx_domain *dom, unsigned long base, size_t size)
+{
+	unsigned long ipa = ALIGN_DOWN(base, MIN_PAGE_SIZE);
+	unsigned long end = ALIGN(base + size, MIN_PAGE_SIZE);
+	struct hvx_memory_chunk *ext;
+	struct hvx_adopted_range *range;
+	struct ipa_batch batch;
+	int ret = 0;
+
+	hvx_batch_init(&batch, dom);
+
+	while (ipa < end) {
+		ext = hvx_find_extent(dom, ipa, ipa + MIN_PAGE_SIZE);
+		if (ext != NULL) {
+			/* A write fault on memory that is write protected for dirty logging */
+			if (dom->dirty_bitmap != NULL) {
+				unsigned long first = ALIGN_DOWN(max(base, ext->ipa), PAGE_SIZE);
+				unsigned long last = PAGE_ALIGN(min(base + size, ext->ipa + ext->size));
+
+				ret = hvx_dirty_unprotect(dom, &batch, first, last);
+				if (ret < 0)
+					break;
+				hvx_dirty_mark(dom, first, last - first);
+			}
+
+			ipa = ext->ipa + ext->size;
+			continue;
+		}
+
+		if (hvx_range_adopted(dom, ipa, ipa + MIN_PAGE_SIZE)) {
+			ipa += MIN_PAGE_SIZE;
+			continue;
+		}
+
+		if (dom->parent != NULL) {
+			ret = hvx_cow_granule(dom, &batch, ipa);
+			if (ret < 0)
+				break;
+
+			hvx_dirty_mark(dom, ipa, MIN_PAGE_SIZE);
+			ipa += MIN_PAGE_SIZE;
+			continue;
+		}
+
+		ext = hvx_alloc_extent(dom, ipa, end - ipa);
+		if (ext == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ret = ipa_batch_map(&batch, ext->ipa >> PAGE_SHIFT, page_to_pfn(ext->page),
+							ext->size >> PAGE_SHIFT, IPA_TYPE_NORMAL);
+		if (ret < 0)
+			break;
+
+		list_for_each_entry(range, &dom->adopted_list, head)
+			hvx_map_adopted(&batch, range, ext->ipa, ext->ipa + ext->size, range->flags);
+
+		/* New memory is writable right away, so it counts as written */
+		hvx_dirty_mark(dom, ext->ipa, ext->size);
+		ipa += ext->size;
+	}
+
+	hvx_batch_commit(&batch);
+
+	return ret;
+}
+
+/* Give every extent entirely inside [base, base + size) back to the host */
+static long hvx_release_range(struct hvx_domain *dom, unsigned long base, size_t size)
+{
+	struct hvx_memory_chunk *ext, *tmp;
+	unsigned long released = 0;
+	struct ipa_batch batch;
+	LIST_HEAD(freed);
+
+	hvx_batch_init(&batch, dom);
+
+	list_for_each_entry_safe(ext, tmp, &dom->extent_list, head) {
+		if (ext->ipa < base || ext->ipa + ext->size > base + size)
+			continue;
+
+		ipa_batch_unmap(&batch, ext->ipa >> PAGE_SHIFT, ext->size >> PAGE_SHIFT);
+		list_move(&ext->head, &freed);
+	}
+
+	/* The guest must not reach the pages through stale TLB entries */
+	hvx_batch_commit(&batch);
+
+	/* Nor userspace through its mapping of them, before they go back to the host */
+	list_for_each_entry_safe(ext, tmp, &freed, head) {
+		released += ext->size;
+		hvx_zap_user_range(dom, ext->ipa, ext->size);
+		hvx_free_chunk(ext);
+		list_del(&ext->head);
+		kfree(ext);
+	}
+
+	return released;
+}
+
+static long hvx_ioctl_memory(struct hvx_domain *dom, void __user *udata)
+{
+	long ret;
+	struct hvx_proto_memory op;
+
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
+
+	if (op.size == 0)
+		return -EINVAL;
+
+	mutex_lock(&dom->lock);
+
+	if (test_bit(HVX_DOMAIN_FROZEN, &dom->flags)) {
+		mutex_unlock(&dom->lock);
+		return -EBUSY;
+	}
+
+	if (dom->page_table == NULL ||
+		op.base < HVX_GUEST_RAM_BASE ||
+		op.base + op.size > HVX_GUEST_RAM_BASE + dom->memory) {
+		mutex_unlock(&dom->lock);
+		return -EINVAL;
+	}
+
+	switch (op.type) {
+	case HVX_MEMORY_POPULATE:
+		ret = hvx_populate_range(dom, op.base, op.size);
+		break;
+
+	case HVX_MEMORY_RELEASE:
+		ret = hvx_release_range(dom, op.base, op.size);
+		break;
+
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	mutex_unlock(&dom->lock);
+
+	return ret;
+}
+
+static int hvx_extent_cmp(const void *a, const void *b)
+{
+	const struct hvx_memory_extent *x = a, *y = b;
+
+	if (x->base == y->base)
+		return 0;
+
+	return x->base < y->base ? -1 : 1;
+}
+
+static long hvx_ioctl_memory_extents(struct hvx_domain *dom, void __user *udata)
+{
+	struct hvx_proto_memory_extents op;
+	struct hvx_memory_extent *entries;
+	struct hvx_memory_chunk *ext;
+	struct hvx_adopted_range *range;
+	unsigned long total = 0, n = 0;
+	long ret;
+
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
+
+	mutex_lock(&dom->lock);
+
+	list_for_each_entry(ext, &dom->extent_list, head)
+		total++;
+	list_for_each_entry(range, &dom->adopted_list, head)
+		total++;
+
+	entries = kvmalloc_array(max(total, 1UL), sizeof(*entries), GFP_KERNEL);
+	if (entries == NULL) {
+		mutex_unlock(&dom->lock);
+		return -ENOMEM;
+	}
+
+	list_for_each_entry(ext, &dom->extent_list, head) {
+		entries[n].base = ext->ipa;
+		entries[n].size = ext->size;
+		entries[n].flags = 0;
+		n++;
+	}
+	list_for_each_entry(range, &dom->adopted_list, head) {
+		entries[n].base = range->ipa;
+		entries[n].size = range->nr_pages << PAGE_SHIFT;
+		entries[n].flags = HVX_EXTENT_ADOPTED;
+		n++;
+	}
+
+	mutex_unlock(&dom->lock);
+
+	/* Copied out without the lock, the copy may fault on a guest memory mapping */
+	sort(entries, n, sizeof(*entries), hvx_extent_cmp, NULL);
+
+	ret = n;
+	if (copy_to_user(u64_to_user_ptr(op.entries), entries, min_t(u64, op.count, n) * sizeof(*entries)))
+		ret = -EFAULT;
+
+	kvfree(entries);
+
+	return ret;
+}
+
+/*
+ * Called with the domain lock held. If the granule holding @ipa is backed
+ * already, another vcpu got there first, or this is a write fault on a page
+ * that is write protected for dirty logging. Only that page needs its
+ * protection lifted then. Returns 1 if there is nothing to restore.
+ */
+static long hvx_restore_backed(struct hvx_domain *dom, unsigned long ipa)
+{
+	unsigned long granule = ALIGN_DOWN(ipa, MIN_PAGE_SIZE);
+	long ret;
+
+	if (!hvx_find_extent(dom, granule, granule + MIN_PAGE_SIZE) &&
+		!hvx_range_adopted(dom, granule, granule + MIN_PAGE_SIZE))
+		return 0;
+
+	if (dom->dirty_bitmap == NULL)
+		return 1;
+
+	ret = hvx_populate_range(dom, ALIGN_DOWN(ipa, PAGE_SIZE), PAGE_SIZE);
+
+	return ret < 0 ? ret : 1;
+}
+
+/* Called with the domain lock held */
+static long hvx_restore_check(struct hvx_domain *dom, unsigned long ipa)
+{
+	if (test_bit(HVX_DOMAIN_FROZEN, &dom->flags))
+		return -EBUSY;
+
+	if (dom->page_table == NULL ||
+		ipa < HVX_GUEST_RAM_BASE ||
+		ipa >= HVX_GUEST_RAM_BASE + dom->memory)
+		return -EINVAL;
+
+	return hvx_restore_backed(dom, ipa);
+}
+
+/*
+ * The granule is filled before the lock is taken because the copy may
+ * fault on a mapping of this very domain, and it only becomes visible
+ * to the guest once it is complete. A granule that is backed already is
+ * looked for first, so that faults on it do not copy 2MB for nothing.
+ */
+static long hvx_ioctl_memory_restore(struct hvx_domain *dom, void __user *udata)
+{
+	struct hvx_proto_memory_restore op;
+	struct hvx_memory_chunk *ext;
+	struct hvx_adopted_range *range;
+	struct ipa_batch batch;
+	unsigned long flags = IPA_TYPE_NORMAL;
+	u64 *pages;
+	unsigned long i;
+	long ret = 0;
+
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
+
+	if (op.count > HVX_RESTORE_PAGES)
+		return -EINVAL;
+
+	mutex_lock(&dom->lock);
+	ret = hvx_restore_check(dom, op.base);
+	mutex_unlock(&dom->lock);
+	if (ret != 0)
+		return ret < 0 ? ret : 0;
+
+	pages = kcalloc(HVX_RESTORE_PAGES, sizeof(*pages), GFP_KERNEL);
+	if (pages == NULL)
+		return -ENOMEM;
+
+	if (copy_from_user(pages, u64_to_user_ptr(op.pages), op.count * sizeof(*pages))) {
+		ret = -EFAULT;
+		goto free_pages;
+	}
+
+	ext = kmalloc(sizeof(*ext), GFP_KERNEL);
+	if (ext == NULL) {
+		ret = -ENOMEM;
+		goto free_pages;
+	}
+
+	ext->ipa = ALIGN_DOWN(op.base, MIN_PAGE_SIZE);
+	ext->size = MIN_PAGE_SIZE;
+	ext->page = hvx_alloc_block(MIN_PAGE_SIZE, &ext->cma);
+	if (ext->page == NULL) {
+		ret = -ENOMEM;
+		goto free_ext;
+	}
+
+	for (i = 0; i < HVX_RESTORE_PAGES; i++) {
+		void *dst = page_address(ext->page + i);
+
+		if (pages[i] == 0) {
+			clear_page(dst);
+		} else if (copy_from_user(dst, u64_to_user_ptr(pages[i]), PAGE_SIZE)) {
+			ret = -EFAULT;
+			goto free_chunk;
+		}
+	}
+
+	mutex_lock(&dom->lock);
+
+	/* Things may have changed while the granule was filled */
+	ret = hvx_restore_check(dom, op.base);
+	if (ret != 0) {
+		mutex_unlock(&dom->lock);
+		if (ret > 0)
+			ret = 0;
+		goto free_chunk;
+	}
+
+	/*
+	 * The granule holds what the guest saw all along, only the page that
+	 * faulted counts as written. The rest stays write protected while
+	 * dirty pages are logged, so that the log keeps 4K granularity.
+	 */
+	if (dom->dirty_bitmap != NULL)
+		flags &= ~IPA_PTE_WRITABLE;
+
+	hvx_batch_init(&batch, dom);
+
+	ret = ipa_batch_map(&batch, ext->ipa >> PAGE_SHIFT, page_to_pfn(ext->page),
+						ext->size >> PAGE_SHIFT, flags);
+	if (ret < 0) {
+		ipa_batch_unmap(&batch, ext->ipa >> PAGE_SHIFT, ext->size >> PAGE_SHIFT);
+		hvx_batch_commit(&batch);
+		mutex_unlock(&dom->lock);
+		goto free_chunk;
+	}
+
+	list_for_each_entry(range, &dom->adopted_list, head)
+		hvx_map_adopted(&batch, range, ext->ipa, ext->ipa + ext->size,
+						range->flags & (flags | ~IPA_PTE_WRITABLE));
+
+	hvx_batch_commit(&batch);
+	list_add_tail(&ext->head, &dom->extent_list);
+
+	if (dom->dirty_bitmap != NULL)
+		ret = hvx_populate_range(dom, ALIGN_DOWN(op.base, PAGE_SIZE), PAGE_SIZE);
+
+	mutex_unlock(&dom->lock);
+
+	kfree(pages);
+
+	return ret;
+
+free_chunk:
+	hvx_free_chunk(ext);
+free_ext:
+	kfree(ext);
+free_pages:
+	kfree(pages);
+
+	return ret;
+}
+
+/* Write protect [vfn, vfn + nr) of the domain's own memory */
+static int hvx_dirty_protect(struct ipa_batch *batch, unsigned long vfn, unsigned long nr)
+{
+	return ipa_batch_protect(batch, vfn, nr, IPA_TYPE_NORMAL & ~IPA_PTE_WRITABLE);
+}
+
+static long hvx_dirty_log_enable(struct hvx_domain *dom)
+{
+	struct hvx_memory_chunk *ext;
+	struct ipa_batch batch;
+	long ret = 0;
+
+	if (dom->dirty_bitmap != NULL)
+		return -EBUSY;
+
+	dom->dirty_bitmap = kvzalloc(BITS_TO_LONGS(dom->memory >> PAGE_SHIFT) * sizeof(unsigned long),
+								 GFP_KERNEL);
+	if (dom->dirty_bitmap == NULL)
+		return -ENOMEM;
+
+	/* Blocks stay blocks, they are only split when a page in them is written */
+	hvx_batch_init(&batch, dom);
+	list_for_each_entry(ext, &dom->extent_list, head) {
+		ret = hvx_dirty_protect(&batch, ext->ipa >> PAGE_SHIFT, ext->size >> PAGE_SHIFT);
+		if (ret < 0)
+			break;
+	}
+	hvx_batch_commit(&batch);
+
+	/* Userspace maps it again read-only, see hvx_vma_pfn_mkwrite() */
+	hvx_zap_user_range(dom, HVX_GUEST_RAM_BASE, dom->memory);
+
+	return ret;
+}
+
+static long hvx_dirty_log_disable(struct hvx_domain *dom)
+{
+	struct hvx_memory_chunk *ext;
+	struct ipa_batch batch;
+	long ret = 0;
+
+	if (dom->dirty_bitmap == NULL)
+		return -EINVAL;
+
+	hvx_batch_init(&batch, dom);
+	list_for_each_entry(ext, &dom->extent_list, head) {
+		ret = hvx_dirty_unprotect(dom, &batch, ext->ipa, ext->ipa + ext->size);
+		if (ret < 0)
+			break;
+	}
+	hvx_batch_commit(&batch);
+
+	kvfree(dom->dirty_bitmap);
+	dom->dirty_bitmap = NULL;
+
+	return ret;
+}
+
+/*
+ * Move the dirty bits of [first, first + nr) pages to @bits and write
+ * protect those pages again, for the guest and for userspace. Runs of dirty pages close to each other share
+ * a batch, so that the TLB is invalidated by range once per cluster
+ * instead of once per page or all at once.
+ */
+static long hvx_dirty_log_fetch(struct hvx_domain *dom, unsigned long first, unsigned long nr,
+								unsigned long *bits)
+{
+	unsigned long base = HVX_GUEST_RAM_BASE >> PAGE_SHIFT;
+	unsigned long start, end, batch_start = 0;
+	struct ipa_batch batch;
+	bool pending = false;
+	long ret = 0;
+
+	bitmap_zero(bits, nr);
+
+	for (start = find_next_bit(dom->dirty_bitmap, first + nr, first);
+		 start < first + nr;
+		 start = find_next_bit(dom->dirty_bitmap, first + nr, end)) {
+		end = find_next_zero_bit(dom->dirty_bitmap, first + nr, start);
+
+		bitmap_set(bits, start - first, end - start);
+		bitmap_clear(dom->dirty_bitmap, start, end - start);
+
+		if (pending && end - batch_start > HVX_DIRTY_FLUSH_PAGES) {
+			hvx_batch_commit(&batch);
+			pending = false;
+		}
+
+		if (!pending) {
+			hvx_batch_init(&batch, dom);
+			batch_start = start;
+			pending = true;
+		}
+
+		ret = hvx_dirty_protect(&batch, base + start, end - start);
+		if (ret < 0)
+			break;
+		hvx_zap_user_range(dom, (base + start) << PAGE_SHIFT, (end - start) << PAGE_SHIFT);
+	}
+
+	if (pending)
+		hvx_batch_commit(&batch);
+
+	return ret;
+}
+
+static long hvx_ioctl_dirty_log(struct hvx_domain *dom, void __user *udata)
+{
+	struct hvx_proto_dirty_log op;
+	unsigned long *bits = NULL;
+	unsigned long first = 0;
+	long ret;
+
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
+
+	if (op.op == HVX_DIRTY_LOG_FETCH) {
+		if (!IS_ALIGNED(op.base, PAGE_SIZE) || op.base < HVX_GUEST_RAM_BASE ||
+			op.pages == 0 || op.pages > dom->memory >> PAGE_SHIFT)
+			return -EINVAL;
+
+		/* The bitmap is copied out once the lock is dropped */
+		bits = kvzalloc(BITS_TO_LONGS(op.pages) * sizeof(unsigned long), GFP_KERNEL);
+		if (bits == NULL)
+			return -ENOMEM;
+		first = (op.base - HVX_GUEST_RAM_BASE) >> PAGE_SHIFT;
+	}
+
+	mutex_lock(&dom->lock);
+
+	if (dom->page_table == NULL) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	switch (op.op) {
+	case HVX_DIRTY_LOG_ENABLE:
+		ret = hvx_dirty_log_enable(dom);
+		break;
+
+	case HVX_DIRTY_LOG_DISABLE:
+		ret = hvx_dirty_log_disable(dom);
+		break;
+
+	case HVX_DIRTY_LOG_FETCH:
+		if (dom->dirty_bitmap == NULL || first > dom->memory >> PAGE_SHIFT ||
+			op.pages > (dom->memory >> PAGE_SHIFT) - first) {
+			ret = -EINVAL;
+			break;
+		}
+		ret = hvx_dirty_log_fetch(dom, first, op.pages, bits);
+		break;
+
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+unlock:
+	mutex_unlock(&dom->lock);
+
+	if (ret == 0 && bits != NULL &&
+		copy_to_user(u64_to_user_ptr(op.bitmap), bits, BITS_TO_LONGS(op.pages) * sizeof(unsigned long)))
+		ret = -EFAULT;
+
+	kvfree(bits);
+
+	return ret;
+}
+
+static long hvx_ioctl_domain_pause(struct hvx_domain *dom, void __user *udata)
+{
+	struct hvx_proto_domain_pause op;
+	struct domain_control domctl;
+
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
+
+	if (!test_bit(HVX_DOMAIN_RUNNING, &dom->flags))
+		return -EINVAL;
+
+	domctl.id = dom->id;
+	if (vmcall(VMI_DOMAIN_CONTROL, op.pause ? VMI_DOMAIN_PAUSE : VMI_DOMAIN_UNPAUSE,
+			   &domctl, 0, 0, 0) < 0) {
+		hvx_error("Failed to %s domain %ld\n", op.pause ? "pause" : "unpause", dom->id);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static long hvx_ioctl_domain_destroy(struct hvx_domain *dom, void __user *udata)
+{
+	struct hvx_proto_domain_destroy domain;
+	struct domain_control domctl;
+
+	if (copy_from_user(&domain, udata, sizeof(domain)))
+		return -EFAULT;
+
+	if (!test_bit(HVX_DOMAIN_RUNNING, &dom->flags))
+		return -EINVAL;
+
+	domctl.id = dom->id;
+	if (vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_DESTROY, &domctl, 0, 0, 0) < 0) {
+		hvx_error("Failed to destroy domain. domain busy\n");
+		return -EFAULT;
+	}
+
+	clear_bit(HVX_DOMAIN_RUNNING, &dom->flags);
+
+	mutex_lock(&dom->lock);
+	hvx_destroy_address_space(dom);
+	mutex_unlock(&dom->lock);
+
+	return 0;
+}
+
+static long hvx_vcpu_state(struct hvx_vcpu *vcpu, unsigned long op, void __user *udata)
+{
+	struct hvx_vcpu_state *state;
+	struct vcpu_control vcpuctl;
+	long r = 0;
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (state == NULL)
+		return -ENOMEM;
+
+	if (op == VMI_VCPU_SET_STATE && copy_from_user(state, udata, sizeof(*state))) {
+		r = -EFAULT;
+		goto out;
+	}
+
+	vcpuctl.domain = vcpu->domain->id;
+	if (vmcall(VMI_VCPU_CONTROL, op, &vcpuctl, vcpu->id, virt_to_phys(state), 0) < 0) {
+		hvx_error("Failed to access the state of vcpu %u, domain not paused?\n", vcpu->id);
+		r = -EBUSY;
+		goto out;
+	}
+
+	if (op == VMI_VCPU_GET_STATE && copy_to_user(udata, state, sizeof(*state)))
+		r = -EFAULT;
+
+out:
+	kfree(state);
+
+	return r;
+}
+
+static long hvx_vcpu_ioctl(struct file *filp, unsigned int ioctl, unsigned long arg)
+{
+	struct hvx_vcpu *vcpu = filp->private_data;
+	void __user *udata = (void __user *)arg;
+	long r = -ENOTTY;
+
+	switch (ioctl) {
+	case HVX_IOCTL_VCPU_GET_STATE:
+		r = hvx_vcpu_state(vcpu, VMI_VCPU_GET_STATE, udata);
+		break;
+
+	case HVX_IOCTL_VCPU_SET_STATE:
+		r = hvx_vcpu_state(vcpu, VMI_VCPU_SET_STATE, udata);
+		break;
+
+	default:
+		break;
+	}
+
+	return r;
+}
+
+/*
+ * Have the hypervisor drop the exit ring of vcpu @id, which it writes to
+ * for as long as the vcpu exists. A domain that is not running anymore
+ * has no vcpus left. On failure the ring must not be freed.
+ */
+static int hvx_vcpu_unregister(struct hvx_domain *dom, unsigned int id)
+{
+	struct vcpu_control vcpuctl;
+
+	if (!test_bit(HVX_DOMAIN_RUNNING, &dom->flags))
+		return 0;
+
+	vcpuctl.domain = dom->id;
+	if (vmcall(VMI_VCPU_CONTROL, VMI_VCPU_DESTROY, &vcpuctl, id, 0, 0) < 0) {
+		hvx_error("Failed to destroy vcpu %u of domain %ld, leaking its ring\n", id, dom->id);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static int hvx_vcpu_release(struct inode *inode, struct file *filp)
+{
+	struct hvx_vcpu *vcpu = filp->private_data;
+	struct hvx_domain *dom = vcpu->domain;
+
+	mutex_lock(&dom->lock);
+	if (rcu_access_pointer(dom->vcpu[vcpu->id]) == vcpu)
+		RCU_INIT_POINTER(dom->vcpu[vcpu->id], NULL);
+	mutex_unlock(&dom->lock);
+
+	/* Wait for the event irq to stop looking at the ring */
+	synchronize_rcu();
+
+	eventfd_ctx_put(vcpu->eventfd);
+	if (hvx_vcpu_unregister(dom, vcpu->id) == 0)
+		free_page((unsigned long)vcpu->ring);
+	free_page((unsigned long)vcpu->stats);
+	kfree(vcpu);
+
+	hvx_put_domain(dom);
+
+	return 0;
+}
+
+static int hvx_vcpu_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct hvx_vcpu *vcpu = filp->private_data;
+	void *page;
+
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+
+	switch (vma->vm_pgoff) {
+	case HVX_VCPU_RING_OFFSET:
+		page = vcpu->ring;
+		break;
+
+	case HVX_VCPU_STATS_OFFSET:
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+		page = vcpu->stats;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP;
+
+	return remap_pfn_range(vma, vma->vm_start, virt_to_pfn(page),
+						   PAGE_SIZE, vma->vm_page_prot);
+}
+
+static struct file_operations hvx_vcpu_fops = {
+	.owner          = THIS_MODULE,
+	.release        = hvx_vcpu_release,
+	.unlocked_ioctl = hvx_vcpu_ioctl,
+	.mmap			= hvx_vcpu_mmap,
+	.llseek			= noop_llseek,
+};
+
+/*
+ * Account the records in [from, to) and the handling time of the previous
+ * batch, which the consumer has acknowledged by the time it catches up.
+ * Only the last ring's worth of records is still there to look at.
+ */
+static void hvx_vcpu_account(struct hvx_vcpu *vcpu, u32 from, u32 to)
+{
+	struct hvx_vcpu_stats *stats = vcpu->stats;
+	u64 signalled = READ_ONCE(vcpu->ring->signalled);
+	u64 acked = READ_ONCE(vcpu->ring->acked);
+	u32 reason;
+
+	/* This runs in the event irq, bound it whatever to is */
+	if (to - from > HVX_EXIT_RING_ENTRIES)
+		from = to - HVX_EXIT_RING_ENTRIES;
+
+	for (; from != to; from++) {
+		reason = READ_ONCE(vcpu->ring->entries[from % HVX_EXIT_RING_ENTRIES].reason);
+		if (reason < HVX_EXIT_REASONS)
+			WRITE_ONCE(stats->exits[reason], stats->exits[reason] + 1);
+	}
+
+	if (signalled != 0 && signalled != vcpu->accounted && acked >= signalled) {
+		u64 us = div_u64(acked - signalled, NSEC_PER_USEC);
+		int bucket = us ? min_t(int, ilog2(us), HVX_LATENCY_BUCKETS - 1) : 0;
+
+		WRITE_ONCE(stats->latency[bucket], stats->latency[bucket] + 1);
+		vcpu->accounted = signalled;
+	}
+
+	WRITE_ONCE(stats->signals, stats->signals + 1);
+}
+
+/*
+ * Wake up the consumer only if it has caught up with everything it was
+ * told about so far; otherwise it is still draining the ring and will
+ * pick up the new records by itself.
+ */
+static void hvx_vcpu_notify(struct hvx_vcpu *vcpu)
+{
+	u32 head = READ_ONCE(vcpu->ring->head);
+	u32 notified = READ_ONCE(vcpu->notified);
+	u32 from, tail;
+
+	if (head == notified)
+		return;
+
+	/*
+	 * The consumer may be past notified already, having picked up
+	 * records that came in while it was draining.
+	 */
+	smp_mb();
+	tail = READ_ONCE(vcpu->ring->tail);
+	if ((s32)(tail - notified) < 0)
+		return;
+
+	/* The event irq may be handled on several cpus at once */
+	if (cmpxchg(&vcpu->notified, notified, head) != notified)
+		return;
+
+	/*
+	 * The ring page is mapped writable to userspace, so head may be
+	 * anything. Only the last ring's worth of records can be accounted.
+	 */
+	from = notified;
+	if (head - from > HVX_EXIT_RING_ENTRIES)
+		from = head - HVX_EXIT_RING_ENTRIES;
+
+	hvx_vcpu_account(vcpu, from, head);
+	WRITE_ONCE(vcpu->ring->signalled, ktime_get_ns());
+
+	eventfd_signal(vcpu->eventfd, 1);
+}
+
+static int hvx_create_eventfd(struct hvx_vcpu *vcpu, long r)
+{
+	int ret = 0;
+	struct fd f;
+	struct eventfd_ctx *eventfd = NULL;
+
+	f = fdget(r);
+	if (!f.file) {
+		ret = -EBADF;
+		goto out;
+	}
+
+	eventfd = eventfd_ctx_fileget(f.file);
+	if (IS_ERR(eventfd)) {
+		ret = PTR_ERR(eventfd);
+		goto out_fdput;
+	}
+
+	vcpu->eventfd = eventfd;
+
+out_fdput:
+	fdput(f);
+
+out:
+	return ret;
+}
+
+#define ITOA_MAX_LEN 12
+
+static int hvx_create_vcpu_fd(struct hvx_vcpu *vcpu)
+{
+	char name[8 + 1 + ITOA_MAX_LEN + 1];
+
+	snprintf(name, sizeof(name), "hvx-vcpu:%d", vcpu->id);
+	return anon_inode_getfd(name, &hvx_vcpu_fops, vcpu, O_RDWR | O_CLOEXEC);
+}
+
+static long hvx_ioctl_vcpu_context(struct hvx_domain *dom, void __user *udata)
+{
+	long r = 0;
+	struct hvx_vcpu *v;
+	struct hvx_proto_vcpu_context vcpu;
+	struct vcpu_control vcpuctl;
+
+	if (copy_from_user(&vcpu, udata, sizeof(vcpu)))
+		return -EFAULT;
+
+	v = kzalloc(sizeof(*v), GFP_KERNEL);
+	if (!v)
+		return -ENOMEM;
+
+	v->ring = (struct hvx_exit_ring *)get_zeroed_page(GFP_KERNEL);
+	if (v->ring == NULL) {
+		r = -ENOMEM;
+		goto free_vcpu;
+	}
+	v->ring->size = HVX_EXIT_RING_ENTRIES;
+
+	v->stats = (struct hvx_vcpu_stats *)get_zeroed_page(GFP_KERNEL);
+	if (v->stats == NULL) {
+		r = -ENOMEM;
+		goto free_vcpu;
+	}
+
+	r = hvx_create_eventfd(v, vcpu.eventfd);
+	if (r < 0) {
+		hvx_error("Invalid vcpu eventfd\n");
+		goto free_vcpu;
+	}
+
+	vcpuctl.domain = dom->id;
+	vcpuctl.entry = vcpu.entry + HVX_GUEST_RAM_BASE;
+	vcpuctl.affinity = vcpu.affinity;
+	vcpuctl.contextid = vcpu.contextid;
+	vcpuctl.ring = virt_to_phys(v->ring);
+	if (vmcall(VMI_VCPU_CONTROL, VMI_VCPU_CREATE, &vcpuctl, 0, 0, 0) < 0) {
+		hvx_error("Failed to destroy domain. domain busy\n");
+		r = -EFAULT;
+		goto free_vcpu;
+	}
+
+	mutex_lock(&dom->lock);
+	if (dom->vcpus == HVX_MAX_VCPUS) {
+		/* The index the hypervisor gave it */
+		v->id = dom->vcpus;
+		mutex_unlock(&dom->lock);
+		hvx_error("Maximum vcpus\n");
+		r = -EINVAL;
+		goto destroy_vcpu;
+	}
+
+	v->id = dom->vcpus++;
+	v->domain = dom;
+	hvx_get_domain(dom);
+	mutex_unlock(&dom->lock);
+
+	r = hvx_create_vcpu_fd(v);
+	if (r < 0) {
+		goto unlock_vcpu_destroy;
+	}
+
+	mutex_lock(&dom->lock);
+	rcu_assign_pointer(dom->vcpu[v->id], v);
+	mutex_unlock(&dom->lock);
+
+	return r;
+
+unlock_vcpu_destroy:
+	mutex_lock(&dom->lock);
+	dom->vcpus--;
+	mutex_unlock(&dom->lock);
+	hvx_put_domain(dom);
+
+destroy_vcpu:
+	if (hvx_vcpu_unregister(dom, v->id) < 0)
+		v->ring = NULL;
+
+free_vcpu:
+	if (v->eventfd)
+		eventfd_ctx_put(v->eventfd);
+	free_page((unsigned long)v->ring);
+	free_page((unsigned long)v->stats);
+	kfree(v);
+	
+	return r;
+}
+
+static long hvx_ioctl_hypercall(void __user *udata)
+{
+	long ret;
+	struct hvx_proto_hypercall hcall;
+
+	if (copy_from_user(&hcall, udata, sizeof(hcall)))
+		return -EFAULT;
+
+	ret = hypercall(hcall.op,
+					hcall.params[0],
+					hcall.params[1],
+					hcall.params[2],
+					hcall.params[3],
+					hcall.params[4]);
+
+	return ret;
+}
+
+static long hvx_ioctl_hypercall_batch(void __user *udata)
+{
+	long ret, i;
+	struct hvx_proto_hypercall_batch batch;
+	struct hvx_proto_hypercall *hcalls;
+	__s64 *results;
+
+	if (copy_from_user(&batch, udata, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.count == 0 || batch.count > HVX_HYPERCALL_BATCH_MAX)
+		return -EINVAL;
+
+	hcalls = kmalloc_array(batch.count, sizeof(*hcalls), GFP_KERNEL);
+	results = kmalloc_array(batch.count, sizeof(*results), GFP_KERNEL);
+	if (hcalls == NULL || results == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(hcalls, u64_to_user_ptr(batch.entries),
+					   batch.count * sizeof(*hcalls))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		results[i] = hypercall(hcalls[i].op,
+							   hcalls[i].params[0],
+							   hcalls[i].params[1],
+							   hcalls[i].params[2],
+							   hcalls[i].params[3],
+							   hcalls[i].params[4]);
+		if (results[i] < 0 && (batch.flags & HVX_BATCH_STOP_ON_ERROR)) {
+			i++;
+			break;
+		}
+	}
+
+	if (copy_to_user(u64_to_user_ptr(batch.results), results, i * sizeof(*results))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	ret = i;
+
+out:
+	kfree(results);
+	kfree(hcalls);
+
+	return ret;
+}
+
+void hvx_vma_close(struct vm_area_struct *vma)
+{
+	hvx_debug("Release memory area %lx-%lx\n", vma->vm_start, vma->vm_end);
+	vma->vm_private_data = NULL;
+}
+
+static void hvx_ioeventfd_free(struct rcu_head *rcu)
+{
+	struct hvx_ioeventfd *p = container_of(rcu, struct hvx_ioeventfd, rcu);
+
+	eventfd_ctx_put(p->eventfd);
+	kfree(p);
+}
+
+/*
+ * Posted writes are matched by the hypervisor, so that they never make
+ * it to the exit ring. It is on the list before the hypervisor can
+ * report a match for it.
+ */
+static long hvx_ioeventfd_assign(struct hvx_domain *dom, struct hvx_proto_ioeventfd *op)
+{
+	struct hvx_ioeventfd *p;
+	struct eventfd_ctx *eventfd;
+	unsigned long slot;
+	long ret = 0;
+
+	eventfd = eventfd_ctx_fdget(op->fd);
+	if (IS_ERR(eventfd))
+		return PTR_ERR(eventfd);
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (p == NULL) {
+		eventfd_ctx_put(eventfd);
+		return -ENOMEM;
+	}
+
+	p->eventfd = eventfd;
+
+	mutex_lock(&dom->lock);
+
+	slot = find_first_zero_bit(&dom->ioeventfd_slots, HVX_MAX_IOEVENTFDS);
+	if (!test_bit(HVX_DOMAIN_RUNNING, &dom->flags) || slot == HVX_MAX_IOEVENTFDS) {
+		ret = test_bit(HVX_DOMAIN_RUNNING, &dom->flags) ? -ENOSPC : -EINVAL;
+		goto unlock;
+	}
+
+	p->ctl.domain = dom->id;
+	p->ctl.slot = slot;
+	p->ctl.addr = op->addr;
+	p->ctl.len = op->len;
+	p->ctl.data = op->datamatch;
+	p->ctl.flags = (op->flags & HVX_IOEVENTFD_DATAMATCH) ? VMI_IOEVENTFD_DATAMATCH : 0;
+	p->ctl.pending = virt_to_phys(&dom->ioevents);
+
+	set_bit(slot, &dom->ioeventfd_slots);
+	list_add_tail_rcu(&p->head, &dom->ioeventfd_list);
+
+	if (vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_IOEVENTFD, &p->ctl, 0, 0, 0) < 0) {
+		hvx_error("Failed to assign ioeventfd to domain %ld\n", dom->id);
+		list_del_rcu(&p->head);
+		clear_bit(slot, &dom->ioeventfd_slots);
+		mutex_unlock(&dom->lock);
+		call_rcu(&p->rcu, hvx_ioeventfd_free);
+		return -EBUSY;
+	}
+
+	mutex_unlock(&dom->lock);
+
+	return 0;
+
+unlock:
+	mutex_unlock(&dom->lock);
+	eventfd_ctx_put(eventfd);
+	kfree(p);
+
+	return ret;
+}
+
+static long hvx_ioeventfd_deassign(struct hvx_domain *dom, struct hvx_proto_ioeventfd *op)
+{
+	struct hvx_ioeventfd *p, *tmp;
+	struct eventfd_ctx *eventfd;
+	long ret = -ENOENT;
+
+	eventfd = eventfd_ctx_fdget(op->fd);
+	if (IS_ERR(eventfd))
+		return PTR_ERR(eventfd);
+
+	mutex_lock(&dom->lock);
+	list_for_each_entry_safe(p, tmp, &dom->ioeventfd_list, head) {
+		if (p->eventfd != eventfd || p->ctl.addr != op->addr || p->ctl.len != op->len)
+			continue;
+
+		/* A domain that is gone matches nothing anymore */
+		p->ctl.len = 0;
+		if (test_bit(HVX_DOMAIN_RUNNING, &dom->flags) &&
+			vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_IOEVENTFD, &p->ctl, 0, 0, 0) < 0) {
+			p->ctl.len = op->len;
+			ret = -EBUSY;
+			break;
+		}
+
+		/* The next ioeventfd in the slot must not see a match for this one */
+		clear_bit(p->ctl.slot, &dom->ioevents);
+		clear_bit(p->ctl.slot, &dom->ioeventfd_slots);
+		list_del_rcu(&p->head);
+		call_rcu(&p->rcu, hvx_ioeventfd_free);
+		ret = 0;
+		break;
+	}
+	mutex_unlock(&dom->lock);
+
+	eventfd_ctx_put(eventfd);
+
+	return ret;
+}
+
+/* Signal the ioeventfds of the slots the hypervisor matched. Called under RCU. */
+static void hvx_ioeventfd_signal(struct hvx_domain *dom)
+{
+	struct hvx_ioeventfd *p;
+	unsigned long pending;
+
+	if (READ_ONCE(dom->ioevents) == 0)
+		return;
+
+	pending = xchg(&dom->ioevents, 0);
+	list_for_each_entry_rcu(p, &dom->ioeventfd_list, head) {
+		if (pending & BIT(p->ctl.slot))
+			eventfd_signal(p->eventfd, 1);
+	}
+}
+
+static long hvx_ioctl_ioeventfd(struct hvx_domain *dom, void __user *udata)
+{
+	struct hvx_proto_ioeventfd op;
+
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
+
+	if (op.len == 0 || op.len > sizeof(u64))
+		return -EINVAL;
+
+	if (op.flags & HVX_IOEVENTFD_DEASSIGN)
+		return hvx_ioeventfd_deassign(dom, &op);
+
+	return hvx_ioeventfd_assign(dom, &op);
+}
+
+static void hvx_irqfd_inject(struct hvx_irqfd *irqfd)
+{
+	struct domain_control domctl;
+
+	domctl.id = irqfd->domain->id;
+	if (vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_INJECT_IRQ, &domctl, irqfd->irq, 0, 0) < 0)
+		hvx_error("Failed to inject irq %u into domain %ld\n", irqfd->irq, domctl.id);
+}
+
+/*
+ * Called with the eventfd wait queue lock held whenever it is signalled.
+ * The count is never consumed, every write wakes us up again.
+ */
+static int hvx_irqfd_wakeup(wait_queue_entry_t *wait, unsigned mode, int sync, void *key)
+{
+	struct hvx_irqfd *irqfd = container_of(wait, struct hvx_irqfd, wait);
+
+	if (key_to_poll(key) & EPOLLIN)
+		hvx_irqfd_inject(irqfd);
+
+	return 0;
+}
+
+static void hvx_irqfd_ptable_queue_proc(struct file *file, wait_queue_head_t *wqh, poll_table *pt)
+{
+	struct hvx_irqfd *irqfd = container_of(pt, struct hvx_irqfd, pt);
+
+	add_wait_queue(wqh, &irqfd->wait);
+}
+
+static void hvx_irqfd_release(struct hvx_irqfd *irqfd)
+{
+	u64 cnt;
+
+	eventfd_ctx_remove_wait_queue(irqfd->eventfd, &irqfd->wait, &cnt);
+	eventfd_ctx_put(irqfd->eventfd);
+	kfree(irqfd);
+}
+
+static long hvx_irqfd_assign(struct hvx_domain *dom, struct hvx_proto_irqfd *op)
+{
+	struct hvx_irqfd *irqfd;
+	struct eventfd_ctx *eventfd;
+	__poll_t events;
+	struct fd f;
+	long ret = 0;
+
+	f = fdget(op->fd);
+	if (!f.file)
+		return -EBADF;
+
+	eventfd = eventfd_ctx_fileget(f.file);
+	if (IS_ERR(eventfd)) {
+		ret = PTR_ERR(eventfd);
+		goto out;
+	}
+
+	irqfd = kzalloc(sizeof(*irqfd), GFP_KERNEL);
+	if (irqfd == NULL) {
+		eventfd_ctx_put(eventfd);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	irqfd->domain = dom;
+	irqfd->eventfd = eventfd;
+	irqfd->irq = op->irq;
+	init_waitqueue_func_entry(&irqfd->wait, hvx_irqfd_wakeup);
+	init_poll_funcptr(&irqfd->pt, hvx_irqfd_ptable_queue_proc);
+
+	/*
+	 * Queues us on the eventfd and catches a signal that came in before.
+	 * Only published once that is done: a deassign from another thread
+	 * frees it as soon as it is on the list.
+	 */
+	events = vfs_poll(f.file, &irqfd->pt);
+	if (events & EPOLLIN)
+		hvx_irqfd_inject(irqfd);
+
+	mutex_lock(&dom->lock);
+	list_add_tail(&irqfd->head, &dom->irqfd_list);
+	mutex_unlock(&dom->lock);
+
+out:
+	fdput(f);
+
+	return ret;
+}
+
+static long hvx_irqfd_deassign(struct hvx_domain *dom, struct hvx_proto_irqfd *op)
+{
+	struct hvx_irqfd *irqfd, *tmp;
+	struct eventfd_ctx *eventfd;
+	long ret = -ENOENT;
+
+	eventfd = eventfd_ctx_fdget(op->fd);
+	if (IS_ERR(eventfd))
+		return PTR_ERR(eventfd);
+
+	mutex_lock(&dom->lock);
+	list_for_each_entry_safe(irqfd, tmp, &dom->irqfd_list, head) {
+		if (irqfd->eventfd != eventfd || irqfd->irq != op->irq)
+			continue;
+
+		list_del(&irqfd->head);
+		hvx_irqfd_release(irqfd);
+		ret = 0;
+		break;
+	}
+	mutex_unlock(&dom->lock);
+
+	eventfd_ctx_put(eventfd);
+
+	return ret;
+}
+
+static long hvx_ioctl_irqfd(struct hvx_domain *dom, void __user *udata)
+{
+	struct hvx_proto_irqfd op;
+
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
+
+	if (op.flags & HVX_IRQFD_DEASSIGN)
+		return hvx_irqfd_deassign(dom, &op);
+
+	return hvx_irqfd_assign(dom, &op);
+}
+
+static void hvx_release_eventfds(struct hvx_domain *dom)
+{
+	struct hvx_ioeventfd *p, *ptmp;
+	struct hvx_irqfd *irqfd, *itmp;
+
+	mutex_lock(&dom->lock);
+	list_for_each_entry_safe(irqfd, itmp, &dom->irqfd_list, head) {
+		list_del(&irqfd->head);
+		hvx_irqfd_release(irqfd);
+	}
+
+	list_for_each_entry_safe(p, ptmp, &dom->ioeventfd_list, head) {
+		clear_bit(p->ctl.slot, &dom->ioeventfd_slots);
+		list_del_rcu(&p->head);
+		call_rcu(&p->rcu, hvx_ioeventfd_free);
+	}
+	mutex_unlock(&dom->lock);
+}
+
+static long hvx_domain_ioctl(struct file *file, unsigned int cmd, unsigned long data)
+{
+	int ret = -ENOTTY;
+	struct hvx_domain *dom = file->private_data;
+	void __user *udata = (void __user *)data;
+
+	/*
+	 * Nothing may run or change the memory clones share. This is only the
+	 * fast path, the memory calls check again under the domain lock, which
+	 * a concurrent clone freezes the domain under.
+	 */
+	if (test_bit(HVX_DOMAIN_FROZEN, &dom->flags)) {
+		switch (cmd) {
+		case HVX_IOCTL_MEMORY:
+		case HVX_IOCTL_MEMORY_ADOPT:
+		case HVX_IOCTL_MEMORY_RESTORE:
+		case HVX_IOCTL_DOMAIN_PAUSE:
+		case HVX_IOCTL_VCPU_CONTEXT:
+			return -EBUSY;
+
+		case HVX_IOCTL_DOMAIN_DESTROY:
+			if (atomic_read(&dom->clones) > 0)
+				return -EBUSY;
+			break;
+		}
+	}
+
+	switch (cmd) {
+	case HVX_IOCTL_DOMAIN_CLONE:
+		ret = hvx_ioctl_domain_clone(dom, udata);
+		break;
+
+	case HVX_IOCTL_DOMAIN_DESTROY:
+		ret = hvx_ioctl_domain_destroy(dom, udata);
+		hvx_debug("Domain %ld destroyed\n", dom->id);
+		break;
+
+	case HVX_IOCTL_MEMORY:
+		ret = hvx_ioctl_memory(dom, udata);
+		break;
+
+	case HVX_IOCTL_MEMORY_ADOPT:
+		ret = hvx_ioctl_memory_adopt(dom, udata);
+		break;
+
+	case HVX_IOCTL_MEMORY_EXTENTS:
+		ret = hvx_ioctl_memory_extents(dom, udata);
+		break;
+
+	case HVX_IOCTL_MEMORY_RESTORE:
+		ret = hvx_ioctl_memory_restore(dom, udata);
+		break;
+
+	case HVX_IOCTL_DOMAIN_PAUSE:
+		ret = hvx_ioctl_domain_pause(dom, udata);
+		break;
+
+	case HVX_IOCTL_DIRTY_LOG:
+		ret = hvx_ioctl_dirty_log(dom, udata);
+		break;
+
+	case HVX_IOCTL_IOEVENTFD:
+		ret = hvx_ioctl_ioeventfd(dom, udata);
+		break;
+
+	case HVX_IOCTL_IRQFD:
+		ret = hvx_ioctl_irqfd(dom, udata);
+		break;
+
+	case HVX_IOCTL_VCPU_CONTEXT:
+		ret = hvx_ioctl_vcpu_context(dom, udata);
+		hvx_debug("Vcpu started on domain %ld\n", dom->id);
+		break;
+
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ * Guest memory that was not backed when it was mmap()ed, because the
+ * domain is lazy or the range was released since. It is populated like
+ * on a stage-2 fault, and the whole 2MB granule around the fault is
+ * mapped so that walking guest memory does not fault on every page.
+ * Adopted pages are never mapped here, not even the ones in that granule,
+ * and still fault with SIGBUS.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0))
+static int hvx_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+#else
+static vm_fault_t hvx_vma_fault(struct vm_fault *vmf)
+#endif
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0))
+	struct vm_area_struct *vma = vmf->vma;
+#endif
+	struct hvx_domain *dom = vma->vm_file->private_data;
+	unsigned long ipa = vmf->pgoff << PAGE_SHIFT;
+	unsigned long vma_ipa = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long start, end, pfn;
+	struct hvx_memory_chunk *ext;
+	vm_fault_t ret = VM_FAULT_NOPAGE;
+	pgprot_t prot;
+
+	mutex_lock(&dom->lock);
+
+	/* The memory of a frozen domain is only there for its clones */
+	if (dom->page_table == NULL || test_bit(HVX_DOMAIN_FROZEN, &dom->flags) ||
+		ipa < HVX_GUEST_RAM_BASE ||
+		ipa >= HVX_GUEST_RAM_BASE + dom->memory) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	/* Adopted pages shadow whatever extent is left below them */
+	if (hvx_range_adopted(dom, ipa, ipa + PAGE_SIZE)) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	ext = hvx_find_extent(dom, ipa, ipa + PAGE_SIZE);
+	if (ext == NULL && hvx_populate_range(dom, ipa, PAGE_SIZE) == 0)
+		ext = hvx_find_extent(dom, ipa, ipa + PAGE_SIZE);
+	if (ext == NULL) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	start = max3(ALIGN_DOWN(ipa, MIN_PAGE_SIZE), ext->ipa, vma_ipa);
+	end = min3(ALIGN_DOWN(ipa, MIN_PAGE_SIZE) + MIN_PAGE_SIZE, ext->ipa + ext->size,
+			   vma_ipa + (vma->vm_end - vma->vm_start));
+
+	/* While dirty pages are logged, writes go through hvx_vma_pfn_mkwrite() */
+	prot = dom->dirty_bitmap != NULL ? vm_get_page_prot(vma->vm_flags & ~VM_WRITE) : vma->vm_page_prot;
+
+	for (; start < end; start += PAGE_SIZE) {
+		if (hvx_range_adopted(dom, start, start + PAGE_SIZE))
+			continue;
+
+		pfn = page_to_pfn(ext->page) + ((start - ext->ipa) >> PAGE_SHIFT);
+		ret = vmf_insert_pfn_prot(vma, vma->vm_start + (start - vma_ipa), pfn, prot);
+		if (ret & VM_FAULT_ERROR)
+			break;
+	}
+
+out:
+	mutex_unlock(&dom->lock);
+
+	return ret;
+}
+
+/*
+ * First write through a read-only mapping of guest memory since dirty
+ * logging was enabled or the page was fetched, the page is dirty now.
+ * The backends write guest memory this way, not through stage-2.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0))
+static int hvx_vma_pfn_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+#else
+static vm_fault_t hvx_vma_pfn_mkwrite(struct vm_fault *vmf)
+#endif
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0))
+	struct vm_area_struct *vma = vmf->vma;
+#endif
+	struct hvx_domain *dom = vma->vm_file->private_data;
+	unsigned long ipa = vmf->pgoff << PAGE_SHIFT;
+
+	mutex_lock(&dom->lock);
+	if (dom->dirty_bitmap != NULL && ipa >= HVX_GUEST_RAM_BASE &&
+		ipa < HVX_GUEST_RAM_BASE + dom->memory)
+		hvx_dirty_mark(dom, ipa, PAGE_SIZE);
+	mutex_unlock(&dom->lock);
+
+	return 0;
+}
+
+static const struct vm_operations_struct hvx_vm_ops = {
+	.close = hvx_vma_close,
+	.fault = hvx_vma_fault,
+	.pfn_mkwrite = hvx_vma_pfn_mkwrite
+};
+
+/*
+ * Map the pages of @ext in [start, end) at their place in @vma, but for
+ * those shadowed by adopted pages, which are not mapped at all.
+ */
+static int hvx_remap_extent(struct hvx_domain *dom, struct vm_area_struct *vma,
+							struct hvx_memory_chunk *ext, unsigned long start, unsigned long end)
+{
+	unsigned long vma_ipa = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long run, ipa;
+	int ret;
+
+	for (run = ipa = start; ipa <= end; ipa += PAGE_SIZE) {
+		if (ipa < end && !hvx_range_adopted(dom, ipa, ipa + PAGE_SIZE))
+			continue;
+
+		if (run < ipa) {
+			ret = remap_pfn_range(vma, vma->vm_start + (run - vma_ipa),
+								  page_to_pfn(ext->page) + ((run - ext->ipa) >> PAGE_SHIFT),
+								  ipa - run, vma->vm_page_prot);
+			if (ret != 0)
+				return ret;
+		}
+		run = ipa + PAGE_SIZE;
+	}
+
+	return 0;
+}
+
+static int hvx_domain_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long uaddr = vma->vm_start  & PAGE_MASK;
+	unsigned long usize = ((vma->vm_end - uaddr) + (PAGE_SIZE - 1)) & PAGE_MASK;
+	unsigned long ipa = vma->vm_pgoff << PAGE_SHIFT;
+	struct hvx_domain *dom = (struct hvx_domain *)file->private_data;
+	struct hvx_memory_chunk *ext;
+
+	if (usize == 0)
+		return 0;
+
+	if (ipa < HVX_GUEST_RAM_BASE)
+		return -ENOMEM;
+
+	/* A private mapping would be COW, which pfn mappings cannot do */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	vma->vm_flags = vma->vm_flags | VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP | VM_PFNMAP | VM_IO;
+
+	/*
+	 * Everything that is backed now is mapped up front, so that a mapping
+	 * of the whole guest, which userspace keeps for the lifetime of the
+	 * domain, never faults on it. The rest is left to hvx_vma_fault(),
+	 * and so is everything while dirty pages are logged.
+	 */
+	mutex_lock(&dom->lock);
+	if (test_bit(HVX_DOMAIN_FROZEN, &dom->flags)) {
+		mutex_unlock(&dom->lock);
+		return -EBUSY;
+	}
+	list_for_each_entry(ext, &dom->extent_list, head) {
+		unsigned long start = max(ipa, ext->ipa);
+		unsigned long end = min(ipa + usize, ext->ipa + ext->size);
+		unsigned long pfn;
+
+		if (start >= end || dom->dirty_bitmap != NULL)
+			continue;
+
+		pfn = page_to_pfn(ext->page) + ((start - ext->ipa) >> PAGE_SHIFT);
+		hvx_info("mmap: 0x%lx, 0x%lx:0x%lx\n", uaddr + (start - ipa), pfn, end - start);
+		if (hvx_remap_extent(dom, vma, ext, start, end) != 0) {
+			mutex_unlock(&dom->lock);
+			return -EINVAL;
+		}
+	}
+	mutex_unlock(&dom->lock);
+
+	vma->vm_ops = &hvx_vm_ops;
+
+	hvx_debug("Memory area 0x%lx - 0x%lx allocated to %d\n", vma->vm_start, vma->vm_end, current->pid);
+
+	return 0;
+}
+
+static int hvx_domain_release(struct inode *ino, struct file *file)
+{
+	struct hvx_domain *dom = file->private_data;
+	struct domain_control domctl;
+
+	/* No more interrupts for a domain that is going away */
+	hvx_release_eventfds(dom);
+
+	if (test_and_clear_bit(HVX_DOMAIN_RUNNING, &dom->flags)) {
+		domctl.id = dom->id;
+		if (vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_DESTROY, &domctl, 0, 0, 0) < 0)
+			hvx_error("Failed to destroy domain %ld\n", dom->id);
+	}
+
+	spin_lock(&hvx_domain_list_lock);
+	list_del_rcu(&dom->head);
+	spin_unlock(&hvx_domain_list_lock);
+
+	/* Clones still use the memory, it goes with the last of them */
+	if (atomic_read(&dom->clones) == 0) {
+		mutex_lock(&dom->lock);
+		hvx_destroy_address_space(dom);
+		mutex_unlock(&dom->lock);
+	}
+
+	hvx_put_domain(dom);
+
+	hvx_debug("All resources are released\n");
+
+	return 0;
+}
+
+static struct file_operations hvx_domain_fops = {
+	.owner          = THIS_MODULE,
+	.release        = hvx_domain_release,
+	.unlocked_ioctl = hvx_domain_ioctl,
+	.mmap			= hvx_domain_mmap,
+	.llseek			= noop_llseek,
+};
+
+static struct hvx_domain *hvx_alloc_domain(void)
+{
+	struct hvx_domain *domain;
+
+	domain = kzalloc(sizeof(struct hvx_domain), GFP_KERNEL);
+	if (!domain)
+		return NULL;
 
-	dom->page_table = pgd;
+	domain->dev = hvx_device;
 
-	ipa_dump_page_maps(ptr, 0);
+	INIT_LIST_HEAD(&domain->head);
+	INIT_LIST_HEAD(&domain->extent_list);
+	INIT_LIST_HEAD(&domain->adopted_list);
+	INIT_LIST_HEAD(&domain->ioeventfd_list);
+	INIT_LIST_HEAD(&domain->irqfd_list);
+	address_space_init_once(&domain->mapping);
 
-	return 0;
+	mutex_init(&domain->lock);
+	atomic_set(&domain->refcnt, 1);
+
+	return domain;
 }
 
-static void hvx_destroy_address_space(struct hvx_domain *dom)
+static int hvx_create_domain_fd(struct hvx_domain *dom)
 {
-	if (dom->page_table) {
-		ipa_free_table(page_to_virt(dom->page_table));
-		dom->page_table = NULL;
+	char name[10 + 1 + ITOA_MAX_LEN + 1];
+	struct file *file;
+	int fd;
+
+	snprintf(name, sizeof(name), "hvx-domain:%ld", dom->id);
+
+	fd = get_unused_fd_flags(O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return fd;
+
+	file = anon_inode_getfile(name, &hvx_domain_fops, dom, O_RDWR);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		return PTR_ERR(file);
 	}
 
-	hvx_free_extents(dom);
+	/*
+	 * All anonymous inodes share one address space. Give the domain its
+	 * own so that hvx_zap_user_range() only hits mappings of this domain.
+	 */
+	file->f_mapping = &dom->mapping;
+	fd_install(fd, file);
+
+	return fd;
 }
 
-static long hvx_ioctl_domain_create(struct hvx_domain *dom, void __user *udata)
+/*
+ * Create the hypervisor side of @dom, whose address space is set up, and
+ * return a domain fd for it. The domain id is stored in @uid first. On
+ * failure everything but the address space and @dom itself is undone.
+ */
+static long hvx_publish_domain(struct hvx_domain *dom, unsigned long vcpus, __u64 __user *uid)
 {
-	long id = -1;
-	struct hvx_proto_domain_create op;
+	long id, fd;
 	struct domain_control domctl;
 
-	if (copy_from_user(&op, udata, sizeof(op)))
-		return -EFAULT;
-
-	if (hvx_create_address_space(dom, op.memory) != 0) {
-		return -ENOMEM;
-	}
-
-	domctl.vcpus = op.vcpus;
+	domctl.vcpus = vcpus;
 	domctl.xlate = page_to_phys(dom->page_table);
 	if ((id = vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_CREATE, &domctl, 0, 0, 0)) < 0) {
 		hvx_error("Failed to create domain\n");
@@ -246,168 +2475,173 @@ static long hvx_ioctl_domain_create(struct hvx_domain *dom, void __user *udata)
 	}
 
 	dom->id = id;
+	set_bit(HVX_DOMAIN_RUNNING, &dom->flags);
 
-	return id;
-}
-
-static long hvx_ioctl_domain_destroy(struct hvx_domain *dom, void __user *udata)
-{
-	struct hvx_proto_domain_destroy domain;
-	struct domain_control domctl;
+	if (put_user((__u64)id, uid)) {
+		fd = -EFAULT;
+		goto destroy;
+	}
 
-	if (copy_from_user(&domain, udata, sizeof(domain)))
-		return -EFAULT;
+	spin_lock(&hvx_domain_list_lock);
+	list_add_rcu(&dom->head, &hvx_domain_list);
+	spin_unlock(&hvx_domain_list_lock);
 
-	domctl.id = dom->id;
-	if (vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_DESTROY, &domctl, 0, 0, 0) < 0) {
-		hvx_error("Failed to destroy domain. domain busy\n");
-		return -EFAULT;
+	fd = hvx_create_domain_fd(dom);
+	if (fd < 0) {
+		spin_lock(&hvx_domain_list_lock);
+		list_del_rcu(&dom->head);
+		spin_unlock(&hvx_domain_list_lock);
+		goto destroy;
 	}
 
-	hvx_destroy_address_space(dom);
+	hvx_debug("Domain %ld created\n", id);
 
-	return 0;
-}
+	return fd;
 
-static long hvx_vcpu_ioctl(struct file *filp, unsigned int ioctl, unsigned long arg)
-{
-	long r = 0;
-	return r;
+destroy:
+	domctl.id = id;
+	vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_DESTROY, &domctl, 0, 0, 0);
+	clear_bit(HVX_DOMAIN_RUNNING, &dom->flags);
+
+	return fd;
 }
 
-static int hvx_vcpu_release(struct inode *inode, struct file *filp)
+/*
+ * Every domain lives behind its own anonymous fd, so one process can run
+ * several of them and closing the fd tears the domain down.
+ */
+static long hvx_ioctl_domain_create(void __user *udata)
 {
-    return 0;
-}
+	long fd;
+	struct hvx_proto_domain_create op;
+	struct hvx_domain *dom;
 
-static struct file_operations hvx_vcpu_fops = {
-	.release        = hvx_vcpu_release,
-	.unlocked_ioctl = hvx_vcpu_ioctl,
-	.llseek			= noop_llseek,
-};
+	if (copy_from_user(&op, udata, sizeof(op)))
+		return -EFAULT;
 
-static int hvx_create_eventfd(struct hvx_vcpu *vcpu, long r)
-{
-	int ret = 0;
-	struct fd f;
-	struct eventfd_ctx *eventfd = NULL;
+	dom = hvx_alloc_domain();
+	if (dom == NULL)
+		return -ENOMEM;
 
-	f = fdget(r);
-	if (!f.file) {
-		ret = -EBADF;
-		goto out;
+	if (hvx_create_address_space(dom, op.memory, op.flags & HVX_DOMAIN_LAZY) != 0) {
+		kfree(dom);
+		return -ENOMEM;
 	}
 
-	eventfd = eventfd_ctx_fileget(f.file);
-	if (IS_ERR(eventfd)) {
-		ret = PTR_ERR(eventfd);
-		goto out_fdput;
-	}
+	fd = hvx_publish_domain(dom, op.vcpus, &((struct hvx_proto_domain_create __user *)udata)->id);
+	if (fd < 0)
+		hvx_put_domain(dom);
 
-	vcpu->eventfd = eventfd;
+	return fd;
+}
 
-out_fdput:
-	fdput(f);
+/*
+ * Pause @dom for good, its memory is shared with clones from now on.
+ * Userspace loses its mapping of it too, hvx_vma_fault() refuses to map
+ * it again. Called with the domain lock held.
+ */
+static int hvx_freeze_domain(struct hvx_domain *dom)
+{
+	struct domain_control domctl;
 
-out:
-	return ret;
-}
+	domctl.id = dom->id;
+	if (vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_PAUSE, &domctl, 0, 0, 0) < 0) {
+		hvx_error("Failed to pause domain %ld\n", dom->id);
+		return -EBUSY;
+	}
 
-#define ITOA_MAX_LEN 12
+	set_bit(HVX_DOMAIN_FROZEN, &dom->flags);
+	hvx_zap_user_range(dom, 0, 0);
 
-static int hvx_create_vcpu_fd(struct hvx_vcpu *vcpu)
+	return 0;
+}
+
+/* Undo hvx_freeze_domain() of a domain that ended up without clones */
+static void hvx_thaw_domain(struct hvx_domain *dom)
 {
-	char name[8 + 1 + ITOA_MAX_LEN + 1];
+	struct domain_control domctl;
 
-	snprintf(name, sizeof(name), "hvx-vcpu:%d", vcpu->id);
-	return anon_inode_getfd(name, &hvx_vcpu_fops, vcpu, O_RDWR | O_CLOEXEC);
+	mutex_lock(&dom->lock);
+	if (atomic_read(&dom->clones) == 0 && test_and_clear_bit(HVX_DOMAIN_FROZEN, &dom->flags)) {
+		domctl.id = dom->id;
+		if (vmcall(VMI_DOMAIN_CONTROL, VMI_DOMAIN_UNPAUSE, &domctl, 0, 0, 0) < 0)
+			hvx_error("Failed to unpause domain %ld\n", dom->id);
+	}
+	mutex_unlock(&dom->lock);
 }
 
-static long hvx_ioctl_vcpu_context(struct hvx_domain *dom, void __user *udata)
+/*
+ * The parent is paused for good and its memory is shared read-only with
+ * the clone, which copies a 2MB granule on its first write to it. Clones
+ * of clones are not supported, every copy would have to walk the chain.
+ * If the first clone cannot be created, the parent runs again.
+ */
+static long hvx_ioctl_domain_clone(struct hvx_domain *parent, void __user *udata)
 {
-	long r = 0;
-	struct hvx_vcpu *v;
-	struct hvx_proto_vcpu_context vcpu;
-	struct vcpu_control vcpuctl;
+	long fd;
+	struct hvx_proto_domain_clone op;
+	struct hvx_domain *dom;
+	bool froze = false;
 
-	if (copy_from_user(&vcpu, udata, sizeof(vcpu)))
+	if (copy_from_user(&op, udata, sizeof(op)))
 		return -EFAULT;
 
-	v = kzalloc(sizeof(struct hvx_domain), GFP_KERNEL);
-	if (!v)
-		return -ENOMEM;
+	if (parent->parent != NULL)
+		return -EINVAL;
 
-	vcpuctl.domain = dom->id;
-	vcpuctl.entry = vcpu.entry + 0x40000000UL;
-	vcpuctl.affinity = vcpu.affinity;
-	vcpuctl.contextid = vcpu.contextid;
-	if (vmcall(VMI_VCPU_CONTROL, VMI_VCPU_CREATE, &vcpuctl, 0, 0, 0) < 0) {
-		hvx_error("Failed to destroy domain. domain busy\n");
-		r = -EFAULT;
-		goto free_vcpu;
-	}
+	mutex_lock(&parent->lock);
 
-	mutex_lock(&dom->lock);
-	if (dom->vcpus == HVX_MAX_VCPUS) {
-		mutex_unlock(&dom->lock);
-		hvx_error("Maximum vcpus\n");
-		r = -EINVAL;
-		goto destroy_vcpu;
+	if (!test_bit(HVX_DOMAIN_RUNNING, &parent->flags) || parent->page_table == NULL) {
+		mutex_unlock(&parent->lock);
+		return -EINVAL;
 	}
 
-	v->id = dom->vcpus++;
-	mutex_unlock(&dom->lock);
-
-	r = hvx_create_vcpu_fd(v);
-	if (r < 0) {
-		goto unlock_vcpu_destroy;
+	if (!test_bit(HVX_DOMAIN_FROZEN, &parent->flags)) {
+		if (hvx_freeze_domain(parent) < 0) {
+			mutex_unlock(&parent->lock);
+			return -EBUSY;
+		}
+		froze = true;
 	}
 
-	hvx_create_eventfd(v, r);
-
-	return r;
-
-unlock_vcpu_destroy:
-	mutex_lock(&dom->lock);
-	dom->vcpus--;
-	mutex_unlock(&dom->lock);
+	dom = hvx_alloc_domain();
+	if (dom == NULL) {
+		fd = -ENOMEM;
+		goto unlock;
+	}
 
-destroy_vcpu:
+	if (hvx_create_clone_address_space(dom, parent) != 0) {
+		kfree(dom);
+		fd = -ENOMEM;
+		goto unlock;
+	}
 
-free_vcpu:
-	kfree(v);
-	
-	return r;
-}
+	hvx_get_domain(parent);
+	atomic_inc(&parent->clones);
+	dom->parent = parent;
 
-static long hvx_ioctl_hypercall(void __user *udata)
-{
-	long ret;
-	struct hvx_proto_hypercall hcall;
+	mutex_unlock(&parent->lock);
 
-	if (copy_from_user(&hcall, udata, sizeof(hcall)))
-		return -EFAULT;
+	fd = hvx_publish_domain(dom, op.vcpus, &((struct hvx_proto_domain_clone __user *)udata)->id);
+	if (fd < 0) {
+		hvx_put_domain(dom);
+		if (froze)
+			hvx_thaw_domain(parent);
+	}
 
-	ret = hypercall(hcall.op,
-					hcall.params[0],
-					hcall.params[1],
-					hcall.params[2],
-					hcall.params[3],
-					hcall.params[4]);
+	return fd;
 
-	return ret;
-}
+unlock:
+	mutex_unlock(&parent->lock);
+	if (froze)
+		hvx_thaw_domain(parent);
 
-void hvx_vma_close(struct vm_area_struct *vma)
-{
-	hvx_debug("Release memory area %lx-%lx\n", vma->vm_start, vma->vm_end);
-	vma->vm_private_data = NULL;
+	return fd;
 }
 
 static long hvx_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
 	int ret = -ENOTTY;
-    struct hvx_domain *dom = file->private_data;
 	void __user *udata = (void __user *)data;
 
 	switch (cmd) {
@@ -415,21 +2649,12 @@ static long hvx_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 		ret = hvx_ioctl_hypercall(udata);
 		break;
 
-	case HVX_IOCTL_DOMAIN_CREATE:
-		ret = hvx_ioctl_domain_create(dom, udata);
-		hvx_error("Domain Created\n");
-		break;
-
-	case HVX_IOCTL_DOMAIN_DESTROY:
-		hvx_error("Destroy domain\n");
-		ret = hvx_ioctl_domain_destroy(dom, udata);
-		hvx_error("Domain destroyed\n");
+	case HVX_IOCTL_HYPERCALL_BATCH:
+		ret = hvx_ioctl_hypercall_batch(udata);
 		break;
 
-	case HVX_IOCTL_VCPU_CONTEXT:
-		hvx_error("Start vcpu\n");
-		ret = hvx_ioctl_vcpu_context(dom, udata);
-		hvx_error("Vcpu started\n");
+	case HVX_IOCTL_DOMAIN_CREATE:
+		ret = hvx_ioctl_domain_create(udata);
 		break;
 
 	default:
@@ -439,72 +2664,6 @@ static long hvx_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 	return ret;
 }
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0))
-static int hvx_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
-#else
-static int hvx_vma_fault(struct vm_fault *vmf)
-#endif
-{
-	return VM_FAULT_SIGBUS;
-}
-
-static const struct vm_operations_struct hvx_vm_ops = {
-	.close = hvx_vma_close,
-	.fault = hvx_vma_fault
-};
-
-static int hvx_mmap(struct file *file, struct vm_area_struct *vma)
-{
-	unsigned long uaddr = vma->vm_start  & PAGE_MASK;
-	unsigned long usize = ((vma->vm_end - uaddr) + (PAGE_SIZE - 1)) & PAGE_MASK;
-	unsigned long pgoff = vma->vm_pgoff << PAGE_SHIFT;
-	struct hvx_domain *dom = (struct hvx_domain *)file->private_data;
-	struct hvx_memory_chunk *ext;
-
-	if (usize == 0)
-		return 0;
-
-	if (pgoff < 0x40000000UL)
-		return -ENOMEM;
-
-	pgoff -= 0x40000000UL;
-
-	vma->vm_flags = vma->vm_flags | VM_DONTCOPY | VM_DONTEXPAND | VM_MIXEDMAP | VM_DONTDUMP | VM_PFNMAP;
-
-	list_for_each_entry(ext, &dom->extent_list, head) {
-		unsigned long mapsize, pfn;
-
-		if (ext->size < pgoff) {
-			pgoff -= ext->size;
-			continue;
-		}
-
-		pfn = page_to_pfn(ext->page);
-		pfn += pgoff >> PAGE_SHIFT;
-
-		if (usize < (ext->size - pgoff)) {
-			mapsize = usize;
-		} else {
-			mapsize = ext->size - pgoff;
-		}
-		pgoff = 0;
-		hvx_info("mmap: 0x%lx, 0x%lx:0x%lx\n", uaddr, pfn, mapsize);
-		if (remap_pfn_range(vma, uaddr, pfn, mapsize, vma->vm_page_prot) != 0)
-			return -EINVAL;
-
-		uaddr += mapsize;
-		usize -= mapsize;
-		if (usize == 0)
-			break;
-	}
-
-	vma->vm_ops = &hvx_vm_ops;
-
-	hvx_debug("Memory area 0x%lx - 0x%lx allocated to %d\n", vma->vm_start, vma->vm_end, current->pid);
-
-	return 0;
-}
-
 static ssize_t hvx_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
 	/* Does Nothing */
@@ -519,24 +2678,6 @@ static ssize_t hvx_write(struct file *filep, const char *buffer, size_t len, lof
 
 static int hvx_release(struct inode *ino, struct file *file)
 {
-	struct hvx_domain *domain = file->private_data;
-	if (domain == NULL) {
-		hvx_error("hvx: invalid domain\n");
-		return -EFAULT;
-	}
-
-	write_lock_bh(&hvx_domain_list_lock);
-	list_del_init(&domain->head);
-	write_unlock_bh(&hvx_domain_list_lock);
-
-	hvx_destroy_address_space(domain);
-
-	kfree(domain);
-
-	file->private_data = NULL;
-
-	hvx_debug("All resources are released\n");
-
 	return 0;
 }
 
@@ -547,26 +2688,6 @@ static unsigned int hvx_poll(struct file *file, poll_table *wait)
 
 static int hvx_open(struct inode *ino, struct file *file)
 {
-	struct hvx_domain *domain;
-
-	domain = kzalloc(sizeof(struct hvx_domain), GFP_KERNEL);
-	if (!domain)
-		return -ENOMEM;
-
-	domain->dev = hvx_device;
-
-	INIT_LIST_HEAD(&domain->head);
-	INIT_LIST_HEAD(&domain->extent_list);
-
-	mutex_init(&domain->lock);
-	atomic_set(&domain->refcnt, 1);
-
-	write_lock_bh(&hvx_domain_list_lock);
-	list_add(&domain->head, &hvx_domain_list);
-	write_unlock_bh(&hvx_domain_list_lock);
-
-	file->private_data = domain;
-
 	return 0;
 }
 
@@ -576,14 +2697,27 @@ const struct file_operations hvx_fops = {
 	.read = hvx_read,
 	.write = hvx_write,
 	.poll = hvx_poll,
-	.mmap = hvx_mmap,
 	.unlocked_ioctl = hvx_ioctl,
 	.release = hvx_release,
 };
 
 static irqreturn_t hvx_event_callback(int irq, void *arg)
 {
-	hvx_error("Event check\n");
+	struct hvx_domain *dom;
+	struct hvx_vcpu *vcpu;
+	int i;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(dom, &hvx_domain_list, head) {
+		hvx_ioeventfd_signal(dom);
+		for (i = 0; i < HVX_MAX_VCPUS; i++) {
+			vcpu = rcu_dereference(dom->vcpu[i]);
+			if (vcpu)
+				hvx_vcpu_notify(vcpu);
+		}
+	}
+	rcu_read_unlock();
+
     return IRQ_HANDLED;
 }
 
@@ -648,6 +2782,10 @@ int hvx_init(void)
 	}
 
 	hvx_event_irq = irq_of_parse_and_map(dn, 0);
+
+	/* Guest memory is carved out of this region when one is provided */
+	if (of_reserved_mem_device_init_by_idx(hvx_device, dn, 0) == 0)
+		hvx_info("Using reserved memory region for guest memory\n");
     of_node_put(dn);
 
 	irq_data = irq_get_irq_data(hvx_event_irq);
@@ -677,6 +2815,7 @@ out_irq:
 	free_percpu_irq(hvx_event_irq, hvx_event);
 
 out_dev:
+	of_reserved_mem_device_release(hvx_device);
 	device_destroy(hvx_class, MKDEV(hvx_dev_major, 0));
 
 out_class:
@@ -696,6 +2835,9 @@ out:
 void hvx_exit(void)
 {
 	free_percpu_irq(hvx_event_irq, hvx_event);
+	/* Domains and ioeventfds are freed after a grace period */
+	rcu_barrier();
+	of_reserved_mem_device_release(hvx_device);
 	device_destroy(hvx_class, MKDEV(hvx_dev_major, 0));
 	class_unregister(hvx_class);
 	class_destroy(hvx_class);
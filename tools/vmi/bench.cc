@@ -0,0 +1,337 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <ctime>
+
+#include "types.h"
+#include "session.h"
+#include "error.h"
+#include "option.h"
+#include "mainloop.h"
+#include "loader.h"
+#include "vcpu.h"
+#include "mock.h"
+
+/*
+ * Measures the userspace half of vmi: how long it takes from opening the
+ * device to the first exit of the guest, how long a domain takes to go
+ * away, and how quickly a guest notification reaches its Mainloop
+ * callback. Runs against the mock device unless -D is given, in which case
+ * the images passed with -i must hold a guest that keeps writing to MMIO.
+ */
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Schema {
+	unsigned int iterations = 100;
+	unsigned int exits = 100000;
+	unsigned int vcpus = 1;
+	unsigned int memory = 64 * 1024 * 1024;
+	bool device = false;
+	std::unordered_map<unsigned long, std::string> images;
+};
+
+define usage(const std::string& name) -> void {
+	std::cout << "Usage: " << name << " [options]\n"
+				 " -n count : number of domains to launch and destroy\n"
+				 " -e count : number of exits to ping-pong\n"
+				 " -v : number of vcpus\n"
+				 " -m : size\n"
+				 " -i file@address : load file to the given address\n"
+				 " -D : use /dev/hvx instead of the mock device\n"
+				 << std::endl;
+}
+
+define number(const std::string& value, unsigned int& result) -> int {
+	try {
+		result = std::stoi(value);
+	} catch (std::invalid_argument& e) {
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+namespace cli {
+
+class Iterations : public Option<Schema> {
+public:
+	define capture(Schema& schema, const std::string& value) -> int {
+		return number(value, schema.iterations);
+	}
+};
+
+class Exits : public Option<Schema> {
+public:
+	define capture(Schema& schema, const std::string& value) -> int {
+		return number(value, schema.exits);
+	}
+};
+
+class Vcpu : public Option<Schema> {
+public:
+	define capture(Schema& schema, const std::string& value) -> int {
+		return number(value, schema.vcpus);
+	}
+};
+
+class Memory : public Option<Schema> {
+public:
+	define capture(Schema& schema, const std::string& value) -> int {
+		if (number(value, schema.memory) < 0) {
+			return -1;
+		}
+		schema.memory *= 1024 * 1024;
+		return 0;
+	}
+};
+
+class Image : public Option<Schema> {
+public:
+	define capture(Schema& schema, const std::string& value) -> int {
+		size_t at = value.find('@');
+		if (at == std::string::npos || at == 0) {
+			std::cerr << "Invalid format. it should be path@location" << std::endl;
+			return -1;
+		}
+
+		try {
+			schema.images[std::stoul(value.substr(at + 1), 0, 16)] = value.substr(0, at);
+		} catch (std::invalid_argument& e) {
+			std::cerr << e.what() << std::endl;
+			return -1;
+		}
+		return 0;
+	}
+};
+
+class Device : public Option<Schema> {
+public:
+	define capture(Schema& schema, const std::string& value) -> int {
+		schema.device = true;
+		return 0;
+	}
+};
+
+class Usage : public Option<Schema> {
+public:
+	define capture(Schema& schema, const std::string& value) -> int {
+		usage(value);
+		return 0;
+	}
+};
+
+} // namespace cli
+
+define now() -> __u64 {
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+define microseconds(Clock::duration elapsed) -> double {
+	return std::chrono::duration<double, std::micro>(elapsed).count();
+}
+
+/* Prints p50/p99/p999 of the samples, which are in microseconds */
+define report(const std::string& what, std::vector<double>& samples) -> void {
+	if (samples.empty()) {
+		return;
+	}
+
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&samples](double p) -> double {
+		return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))];
+	};
+
+	std::cout << std::left << std::setw(10) << what << std::right
+			  << " n " << std::setw(8) << samples.size()
+			  << std::fixed << std::setprecision(1)
+			  << "  p50 " << std::setw(9) << percentile(0.5)
+			  << " us  p99 " << std::setw(9) << percentile(0.99)
+			  << " us  p999 " << std::setw(9) << percentile(0.999)
+			  << " us  max " << std::setw(9) << samples.back() << " us"
+			  << std::defaultfloat << std::endl;
+}
+
+/* One domain, set up the way Instance::launch does it */
+class Domain {
+public:
+	Domain(const std::shared_ptr<Mainloop>& loop) : mainloop(loop) {}
+
+	~Domain() {
+		destroy();
+	}
+
+	define launch(const Schema& schema, Vcpu::ExitHandler handler) -> int {
+		hvx_proto_domain_create ioc_create = {
+			.vcpus = schema.vcpus,
+			.memory = schema.memory,
+			.flags = 0,
+		};
+
+		session.reset(Session::create(mainloop));
+		if (!session) {
+			std::cerr << "Failed to open hvx device" << std::endl;
+			return -1;
+		}
+
+		if (session->createDomain(ioc_create) < 0) {
+			std::cerr << "Failed to create domain: " << Error::message() << std::endl;
+			return -1;
+		}
+
+		if (!schema.images.empty()) {
+			Loader loader(session.get());
+			for (auto it : schema.images) {
+				loader.add(it.second, it.first);
+			}
+			if (loader.run() < 0) {
+				return -1;
+			}
+		}
+
+		unsigned int cpus = std::max(1U, std::thread::hardware_concurrency());
+		for (unsigned int id = 0; id < schema.vcpus; id++) {
+			vcpus.emplace_back(new Vcpu(session.get(), id, id % cpus));
+			vcpus.back()->setExitHandler(Vcpu::ExitHandler(handler));
+			if (vcpus.back()->start(0, *mainloop) < 0) {
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	define destroy() -> void {
+		vcpus.clear();
+		if (session) {
+			session->destroyDomain();
+			session.reset();
+		}
+	}
+
+private:
+	std::shared_ptr<Mainloop> mainloop;
+	std::unique_ptr<Session> session;
+	std::vector<std::unique_ptr<Vcpu>> vcpus;
+};
+
+/* Device open to first guest exit, and destroy to the device being closed */
+define benchLaunch(const Schema& schema) -> int {
+	auto mainloop = std::make_shared<Mainloop>();
+	std::vector<double> launch, teardown;
+
+	for (unsigned int i = 0; i < schema.iterations; i++) {
+		bool started = false;
+		Domain domain(mainloop);
+
+		auto begin = Clock::now();
+		if (domain.launch(schema, [&started](Vcpu&, hvx_exit&) { started = true; }) < 0) {
+			return -1;
+		}
+		mainloop->run(started);
+		launch.push_back(microseconds(Clock::now() - begin));
+
+		begin = Clock::now();
+		domain.destroy();
+		teardown.push_back(microseconds(Clock::now() - begin));
+	}
+
+	report("launch", launch);
+	report("teardown", teardown);
+
+	return 0;
+}
+
+/* Guest notification to Mainloop callback, for every exit of one domain */
+define benchEvents(const Schema& schema) -> int {
+	auto mainloop = std::make_shared<Mainloop>();
+	Domain domain(mainloop);
+	std::vector<double> latency;
+	bool done = false;
+
+	latency.reserve(schema.exits);
+
+	auto handler = [&](Vcpu& vcpu, hvx_exit& exit) {
+		__u64 signalled = vcpu.getSignalled();
+		__u64 handled = now();
+
+		if (signalled != 0 && handled >= signalled) {
+			latency.push_back((handled - signalled) / 1000.0);
+		}
+		if (latency.size() >= schema.exits) {
+			done = true;
+		}
+	};
+
+	if (domain.launch(schema, handler) < 0) {
+		return -1;
+	}
+
+	mainloop->resetStatistics();
+	auto begin = Clock::now();
+	mainloop->run(done);
+	double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+	auto stats = mainloop->getStatistics();
+
+	domain.destroy();
+
+	report("event", latency);
+	std::cout << "throughput " << latency.size() << " exits in " << std::fixed << std::setprecision(3)
+			  << elapsed * 1000 << " ms (" << static_cast<unsigned long>(latency.size() / elapsed)
+			  << " exits/s, " << stats.events << " callbacks in " << stats.batches << " batches)"
+			  << std::defaultfloat << std::endl;
+
+	return 0;
+}
+
+define createOptions(OptionRegistry<Schema>& options) -> void {
+	options.createOption<cli::Usage>('h', false, "Show usage")
+		   .createOption<cli::Iterations>('n', true, "number of launches")
+		   .createOption<cli::Exits>('e', true, "number of exits")
+		   .createOption<cli::Vcpu>('v', true, "number of vcpus")
+		   .createOption<cli::Memory>('m', true, "memory size")
+		   .createOption<cli::Image>('i', true, "image to be loaded")
+		   .createOption<cli::Device>('D', false, "use /dev/hvx");
+}
+
+} // namespace
+
+define main(int argc, char* argv[]) -> int {
+	OptionRegistry<Schema> options;
+	createOptions(options);
+
+	if (argc > 1 && options.parse(--argc, &argv[1]) != 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const Schema& schema = options.schema;
+
+	try {
+		if (!schema.device) {
+			MockHvx::install();
+		} else if (schema.images.empty()) {
+			std::cerr << "A guest image is needed with -D" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		if (benchLaunch(schema) < 0 || benchEvents(schema) < 0) {
+			return EXIT_FAILURE;
+		}
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
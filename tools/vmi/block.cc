@@ -0,0 +1,192 @@
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include "error.h"
+#include "exception.h"
+#include "device.h"
+
+#define VIRTIO_ID_BLOCK			2
+
+#define VIRTIO_BLK_F_RO			(1ULL << 5)
+#define VIRTIO_BLK_F_BLK_SIZE	(1ULL << 6)
+#define VIRTIO_BLK_F_FLUSH		(1ULL << 9)
+
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_T_FLUSH		4
+#define VIRTIO_BLK_T_GET_ID		8
+
+#define VIRTIO_BLK_S_OK			0
+#define VIRTIO_BLK_S_IOERR		1
+#define VIRTIO_BLK_S_UNSUPP		2
+
+#define VIRTIO_BLK_ID_BYTES		20
+#define SECTOR_SIZE				512
+
+struct VirtioBlkHeader {
+	std::uint32_t type;
+	std::uint32_t reserved;
+	std::uint64_t sector;
+} __attribute__((packed));
+
+/*
+ * virtio block device backed by a file or block device. "path,ro" exposes
+ * it read-only. Requests are served synchronously from the domain loop.
+ */
+class BlockDevice : public VirtioDevice {
+public:
+	BlockDevice(const std::string& args) :
+		VirtioDevice(VIRTIO_ID_BLOCK, 1, features(args)), fd(-1), capacity(0)
+	{
+		std::string path = args.substr(0, args.find(','));
+		readonly = isReadonly(args);
+
+		if (path.empty()) {
+			throw std::runtime_error("block: no backing file given, use block:path[,ro]");
+		}
+
+		fd = ::open(path.c_str(), (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+		if (fd < 0) {
+			throw std::runtime_error("Failed to open " + path + ": " + Error::message());
+		}
+
+		off_t size = ::lseek(fd, 0, SEEK_END);
+		if (size < 0) {
+			::close(fd);
+			throw std::runtime_error("Failed to get the size of " + path + ": " + Error::message());
+		}
+		capacity = size / SECTOR_SIZE;
+	}
+
+	~BlockDevice() {
+		::close(fd);
+	}
+
+	auto getName() const -> std::string override {
+		return "block";
+	}
+
+protected:
+	auto readConfig(std::uint64_t offset, void *data, unsigned int len) -> void override {
+		std::uint8_t config[24] = {};
+		std::uint32_t blockSize = SECTOR_SIZE;
+
+		std::memcpy(&config[0], &capacity, sizeof(capacity));
+		std::memcpy(&config[20], &blockSize, sizeof(blockSize));
+
+		std::memset(data, 0, len);
+		if (offset < sizeof(config)) {
+			std::memcpy(data, config + offset, std::min<size_t>(len, sizeof(config) - offset));
+		}
+	}
+
+	auto notify(unsigned int index) -> void override {
+		VirtqChain chain;
+		bool used = false;
+
+		while (queue(0).pop(getMemory(), chain)) {
+			size_t inLength = VirtqChain::length(chain.in);
+			std::uint32_t written = 0;
+			std::uint8_t status;
+
+			if (inLength == 0) {
+				queue(0).push(getMemory(), chain, 0);
+				continue;
+			}
+
+			status = process(chain, inLength - 1, written);
+			VirtqChain::copyTo(chain.in, inLength - 1, &status, sizeof(status));
+			queue(0).push(getMemory(), chain, written + sizeof(status));
+			used = true;
+		}
+
+		if (used) {
+			interrupt();
+		}
+	}
+
+private:
+	static auto isReadonly(const std::string& args) -> bool {
+		size_t pos = args.find(',');
+		return pos != std::string::npos && args.substr(pos + 1) == "ro";
+	}
+
+	static auto features(const std::string& args) -> std::uint64_t {
+		return VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_BLK_SIZE | (isReadonly(args) ? VIRTIO_BLK_F_RO : 0);
+	}
+
+	auto transfer(const std::vector<iovec>& iov, off_t offset, bool write) -> bool {
+		size_t total = VirtqChain::length(iov), done = 0;
+
+		while (done < total) {
+			auto part = VirtqChain::slice(iov, done, total - done);
+			ssize_t n = write ? ::pwritev(fd, part.data(), part.size(), offset + done)
+							  : ::preadv(fd, part.data(), part.size(), offset + done);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				return false;
+			}
+			done += n;
+		}
+
+		return true;
+	}
+
+	/* dataLength is the room in the device writable buffers, without the status byte */
+	auto process(const VirtqChain& chain, size_t dataLength, std::uint32_t& written) -> std::uint8_t {
+		VirtioBlkHeader header;
+
+		if (VirtqChain::copyFrom(chain.out, 0, &header, sizeof(header)) != sizeof(header)) {
+			return VIRTIO_BLK_S_IOERR;
+		}
+
+		off_t offset = header.sector * SECTOR_SIZE;
+
+		switch (header.type) {
+		case VIRTIO_BLK_T_IN: {
+			auto data = VirtqChain::slice(chain.in, 0, dataLength);
+			if (header.sector + dataLength / SECTOR_SIZE > capacity || !transfer(data, offset, false)) {
+				return VIRTIO_BLK_S_IOERR;
+			}
+			written = dataLength;
+			return VIRTIO_BLK_S_OK;
+		}
+
+		case VIRTIO_BLK_T_OUT: {
+			auto data = VirtqChain::slice(chain.out, sizeof(header), SIZE_MAX);
+			if (readonly || header.sector + VirtqChain::length(data) / SECTOR_SIZE > capacity ||
+				!transfer(data, offset, true)) {
+				return VIRTIO_BLK_S_IOERR;
+			}
+			return VIRTIO_BLK_S_OK;
+		}
+
+		case VIRTIO_BLK_T_FLUSH:
+			return ::fdatasync(fd) == 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+
+		case VIRTIO_BLK_T_GET_ID: {
+			char id[VIRTIO_BLK_ID_BYTES] = "hvx-vmi-block";
+			written = VirtqChain::copyTo(chain.in, 0, id, std::min<size_t>(sizeof(id), dataLength));
+			return VIRTIO_BLK_S_OK;
+		}
+
+		default:
+			return VIRTIO_BLK_S_UNSUPP;
+		}
+	}
+
+private:
+	int fd;
+	bool readonly;
+	std::uint64_t capacity;
+};
+
+static DeviceRegistry::Registrar<BlockDevice> registrar("block");
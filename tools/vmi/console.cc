@@ -0,0 +1,132 @@
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <cerrno>
+
+#include "error.h"
+#include "exception.h"
+#include "device.h"
+
+#define VIRTIO_ID_CONSOLE	3
+
+/*
+ * virtio console on stdin/stdout, or writing to a file given as argument
+ * (without input), which is what supervised domains want.
+ */
+class ConsoleDevice : public VirtioDevice {
+public:
+	enum { RX_QUEUE, TX_QUEUE, QUEUES };
+
+	ConsoleDevice(const std::string& args) :
+		VirtioDevice(VIRTIO_ID_CONSOLE, QUEUES, 0),
+		input(-1), output(STDOUT_FILENO), inputFlags(-1), watching(false)
+	{
+		if (args.empty()) {
+			input = STDIN_FILENO;
+			return;
+		}
+
+		output = ::open(args.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (output < 0) {
+			throw std::runtime_error("Failed to open " + args + ": " + Error::message());
+		}
+	}
+
+	~ConsoleDevice() {
+		if (watching) {
+			getMainloop().removeEventSource(input);
+			::fcntl(input, F_SETFL, inputFlags);
+		}
+		if (output != STDOUT_FILENO) {
+			::close(output);
+		}
+	}
+
+	auto getName() const -> std::string override {
+		return "console";
+	}
+
+protected:
+	auto activate() -> void override {
+		if (input < 0 || watching) {
+			return;
+		}
+
+		inputFlags = ::fcntl(input, F_GETFL);
+		::fcntl(input, F_SETFL, inputFlags | O_NONBLOCK);
+
+		getMainloop().addEventSource(input, EPOLLIN | EPOLLET, [this](int fd, Mainloop::Event) {
+			std::lock_guard<std::mutex> guard(lock);
+			receive();
+		});
+		watching = true;
+	}
+
+	auto notify(unsigned int index) -> void override {
+		if (index == TX_QUEUE) {
+			transmit();
+		} else {
+			receive();
+		}
+	}
+
+private:
+	auto transmit() -> void {
+		VirtqChain chain;
+		bool used = false;
+
+		while (queue(TX_QUEUE).pop(getMemory(), chain)) {
+			for (auto& v : chain.out) {
+				size_t done = 0;
+				while (done < v.iov_len) {
+					ssize_t n = ::write(output, static_cast<char *>(v.iov_base) + done, v.iov_len - done);
+					if (n < 0 && errno == EINTR) {
+						continue;
+					}
+					if (n <= 0) {
+						break;
+					}
+					done += n;
+				}
+			}
+			queue(TX_QUEUE).push(getMemory(), chain, 0);
+			used = true;
+		}
+
+		if (used) {
+			interrupt();
+		}
+	}
+
+	/* Input is edge triggered, so read until there is nothing left or no buffer to put it in */
+	auto receive() -> void {
+		VirtqChain chain;
+		bool used = false;
+
+		if (input < 0) {
+			return;
+		}
+
+		while (queue(RX_QUEUE).pop(getMemory(), chain)) {
+			ssize_t n = ::readv(input, chain.in.data(), chain.in.size());
+			if (n <= 0) {
+				queue(RX_QUEUE).unpop();
+				break;
+			}
+			queue(RX_QUEUE).push(getMemory(), chain, n);
+			used = true;
+		}
+
+		if (used) {
+			interrupt();
+		}
+	}
+
+private:
+	int input;
+	int output;
+	int inputFlags;
+	bool watching;
+};
+
+static DeviceRegistry::Registrar<ConsoleDevice> registrar("console");
@@ -0,0 +1,64 @@
+#include <iostream>
+
+#include "exception.h"
+#include "device.h"
+
+auto DeviceRegistry::factories() -> std::map<std::string, Factory>& {
+	static std::map<std::string, Factory> registry;
+	return registry;
+}
+
+auto DeviceRegistry::add(const std::string& name, Factory&& factory) -> void {
+	factories()[name] = std::move(factory);
+}
+
+auto DeviceRegistry::create(const std::string& spec) -> std::unique_ptr<VirtioDevice> {
+	size_t pos = spec.find(':');
+	std::string name = spec.substr(0, pos);
+	std::string args = pos == std::string::npos ? "" : spec.substr(pos + 1);
+
+	auto it = factories().find(name);
+	if (it == factories().end()) {
+		throw std::runtime_error("Unknown device " + name + ", available: " + names());
+	}
+
+	return std::unique_ptr<VirtioDevice>(it->second(args));
+}
+
+auto DeviceRegistry::names() -> std::string {
+	std::string result;
+
+	for (auto& it : factories()) {
+		result += (result.empty() ? "" : ", ") + it.first;
+	}
+	return result;
+}
+
+auto MmioBus::add(VirtioDevice* device) -> void {
+	devices[device->getBase()] = device;
+}
+
+auto MmioBus::clear() -> void {
+	devices.clear();
+}
+
+auto MmioBus::handle(hvx_exit& exit) -> bool {
+	auto it = devices.upper_bound(exit.addr);
+	if (it == devices.begin()) {
+		return false;
+	}
+	--it;
+
+	std::uint64_t offset = exit.addr - it->first;
+	if (offset >= VirtioDevice::WINDOW_SIZE) {
+		return false;
+	}
+
+	if (exit.flags & HVX_EXIT_WRITE) {
+		it->second->write(offset, exit.data, exit.len);
+	} else {
+		exit.data = it->second->read(offset, exit.len);
+	}
+
+	return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <memory>
+#include <functional>
+
+#include "virtio.h"
+
+/*
+ * Devices are placed one after another from this IPA, and device n gets
+ * guest interrupt HVX_VIRTIO_IRQ_BASE + n (SPI 16 + n).
+ */
+#define HVX_VIRTIO_MMIO_BASE	0x0a000000UL
+#define HVX_VIRTIO_IRQ_BASE		48
+
+/*
+ * Device backends register a factory under a name at static
+ * initialization time; "-d name[:args]" creates one instance.
+ */
+class DeviceRegistry {
+public:
+	typedef std::function<VirtioDevice*(const std::string& args)> Factory;
+
+	template<typename T>
+	struct Registrar {
+		Registrar(const std::string& name) {
+			DeviceRegistry::add(name, [](const std::string& args) -> VirtioDevice* {
+				return new T(args);
+			});
+		}
+	};
+
+	static auto add(const std::string& name, Factory&& factory) -> void;
+	/* spec is "name" or "name:args" */
+	static auto create(const std::string& spec) -> std::unique_ptr<VirtioDevice>;
+	static auto names() -> std::string;
+
+private:
+	static auto factories() -> std::map<std::string, Factory>&;
+};
+
+/* Routes MMIO exits to the device whose register window they hit */
+class MmioBus {
+public:
+	auto add(VirtioDevice* device) -> void;
+	auto clear() -> void;
+	/* Returns false if no device claims the access */
+	auto handle(hvx_exit& exit) -> bool;
+
+private:
+	std::map<std::uint64_t, VirtioDevice*> devices;
+};
@@ -0,0 +1,67 @@
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+
+#include <iostream>
+
+#include "error.h"
+#include "exception.h"
+#include "eventthread.h"
+
+EventThread::EventThread(int cpu) :
+	cpu(cpu), stopped(false), wakeup(0, EFD_NONBLOCK | EFD_CLOEXEC)
+{
+	mainloop.addEventSource(wakeup.getFd(), EPOLLIN, [this](int fd, Mainloop::Event) {
+		wakeup.receive();
+	});
+}
+
+EventThread::~EventThread()
+{
+	stop();
+	mainloop.removeEventSource(wakeup.getFd());
+}
+
+auto EventThread::start() -> void {
+	sigset_t mask, saved;
+
+	if (thread.joinable()) {
+		return;
+	}
+
+	/* Signals are handled by the main thread only */
+	::sigfillset(&mask);
+	::pthread_sigmask(SIG_BLOCK, &mask, &saved);
+
+	stopped = false;
+	thread = std::thread(&EventThread::run, this);
+
+	::pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+}
+
+auto EventThread::stop() -> void {
+	if (!thread.joinable()) {
+		return;
+	}
+
+	stopped = true;
+	wakeup.send();
+	thread.join();
+}
+
+auto EventThread::run() -> void {
+	if (cpu != ANY_CPU) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		int ret = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+		if (ret != 0) {
+			std::cerr << "Failed to pin event thread to cpu" << cpu << ": "
+					  << Error::message(ret) << std::endl;
+		}
+	}
+
+	mainloop.run(stopped);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <thread>
+#include <atomic>
+
+#include "eventfd.h"
+#include "mainloop.h"
+
+/*
+ * A Mainloop dispatched from its own thread, optionally pinned to a host
+ * CPU. Used to handle the events of a vCPU close to where it runs.
+ */
+class EventThread {
+public:
+	static constexpr int ANY_CPU = -1;
+
+	EventThread(int cpu = ANY_CPU);
+	~EventThread();
+
+	EventThread(const EventThread&) = delete;
+	EventThread& operator=(const EventThread&) = delete;
+
+	auto start() -> void;
+	auto stop() -> void;
+
+	auto getMainloop() -> Mainloop& {
+		return mainloop;
+	}
+
+	auto getCpu() const -> int {
+		return cpu;
+	}
+
+private:
+	auto run() -> void;
+
+private:
+	int cpu;
+	std::atomic<bool> stopped;
+	Mainloop mainloop;
+	IoEvent wakeup;
+	std::thread thread;
+};
@@ -195,6 +195,23 @@ void File::read(void *buffer, const size_t size) const {
 	}
 }
 
+void File::pread(void *buffer, const size_t size, off_t offset) const {
+	size_t total = 0;
+
+	while (total < size) {
+		ssize_t bytes = ::pread(descriptor, reinterpret_cast<char*>(buffer) + total, size - total, offset + total);
+		if (bytes > 0) {
+			total += bytes;
+		} else if (bytes == 0) {
+			throw std::runtime_error("Unexpected end of file: " + path);
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			continue;
+		} else {
+			throw std::runtime_error(Error::message());
+		}
+	}
+}
+
 void File::write(const void *buffer, const size_t size) const {
 	size_t written = 0;
 
@@ -220,6 +237,13 @@ void File::lseek(off_t offset, int whence) const {
 	}
 }
 
+void File::advise(off_t offset, off_t len, int advice) const {
+	int ret = ::posix_fadvise(descriptor, offset, len, advice);
+	if (ret != 0) {
+		throw std::runtime_error(Error::message(ret));
+	}
+}
+
 void File::remove(bool recursive) {
 	if (isDirectory()) {
 		if (recursive) {
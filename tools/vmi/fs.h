@@ -63,10 +63,13 @@ public:
 	void close();
 	int fcntl(int cmd, int arg = 0);
 	void read(void *buffer, const size_t size) const;
+	void pread(void *buffer, const size_t size, off_t offset) const;
 	void write(const void *buffer, const size_t size) const;
 	void lseek(off_t offset, int whence) const;
 	void remove(bool recursive = false);
 
+	void advise(off_t offset, off_t len, int advice) const;
+
 	void lock() const;
 	void unlock() const;
 
@@ -0,0 +1,207 @@
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <algorithm>
+
+#include "error.h"
+#include "exception.h"
+#include "loader.h"
+
+Loader::Loader(Session* session, unsigned int workers, size_t chunkSize) :
+	session(session), workers(workers), chunkSize(chunkSize), next(0), failed(false)
+{
+	if (this->workers == 0) {
+		this->workers = std::max(1U, std::min(8U, std::thread::hardware_concurrency()));
+	}
+}
+
+auto Loader::add(const std::string& path, unsigned long address) -> void {
+	images.emplace_back(new Image(path, address));
+}
+
+auto Loader::adopt(const std::string& path, unsigned long address) -> void {
+	sharedImages.emplace_back(new Image(path, address));
+}
+
+/*
+ * Hand the page cache pages of a read-only image to the driver, which maps
+ * them into the guest directly. Our own mapping is only needed to pin them.
+ */
+auto Loader::share(Image& image) -> void {
+	image.started = Clock::now();
+	image.file.open(O_RDONLY);
+	image.size = image.file.size();
+	if (image.size == 0) {
+		image.file.close();
+		return;
+	}
+
+	image.map = image.file.mmap<void>(0, image.size, PROT_READ, MAP_SHARED | MAP_POPULATE);
+	if (image.map == MAP_FAILED) {
+		image.map = nullptr;
+		image.file.close();
+		throw std::runtime_error("Failed to map " + image.file.getPath() + ": " + Error::message());
+	}
+
+	hvx_proto_memory_adopt op = {
+		.uaddr = reinterpret_cast<unsigned long>(image.map),
+		.base = image.address,
+		.size = image.size,
+		.flags = HVX_ADOPT_READONLY,
+	};
+
+	int ret = session->domainIoctl(HVX_IOCTL_MEMORY_ADOPT, &op);
+	int error = Error::lastErrorCode();
+
+	image.file.munmap(image.map, image.size);
+	image.map = nullptr;
+	image.file.close();
+
+	if (ret < 0) {
+		throw std::runtime_error("Failed to share " + image.file.getPath() + ": " + Error::message(error));
+	}
+
+	image.finished = Clock::now();
+	report(image);
+}
+
+auto Loader::prepare(Image& image) -> void {
+	image.file.open(O_RDONLY);
+	image.size = image.file.size();
+	if (image.size == 0) {
+		return;
+	}
+
+	/* Let the page cache start reading ahead while the workers spin up */
+	image.file.advise(0, image.size, POSIX_FADV_SEQUENTIAL);
+	image.file.advise(0, image.size, POSIX_FADV_WILLNEED);
+
+	/* Back the image range in one go rather than one fault per 2MB granule */
+	if (session->populate(image.address, image.size) < 0) {
+		throw std::runtime_error("Failed to populate guest memory for " + image.file.getPath() + ": " + Error::message());
+	}
+
+	image.map = session->map(image.address, image.size);
+	if (image.map == MAP_FAILED) {
+		image.map = nullptr;
+		throw std::runtime_error("Failed to map guest memory for " + image.file.getPath() + ": " + Error::message());
+	}
+
+	image.pending = (image.size + chunkSize - 1) / chunkSize;
+}
+
+auto Loader::release(Image& image) -> void {
+	if (image.map != nullptr) {
+		session->unmap(image.map, image.size);
+		image.map = nullptr;
+	}
+	image.file.close();
+}
+
+auto Loader::worker() -> void {
+	size_t index;
+
+	while (!failed && (index = next++) < chunks.size()) {
+		Chunk& chunk = chunks[index];
+		try {
+			chunk.image->file.pread(static_cast<char *>(chunk.image->map) + chunk.offset,
+									chunk.length, chunk.offset);
+		} catch (std::exception& e) {
+			std::cerr << chunk.image->file.getPath() << ": " << e.what() << std::endl;
+			failed = true;
+			return;
+		}
+
+		if (--chunk.image->pending == 0) {
+			chunk.image->finished = Clock::now();
+		}
+	}
+}
+
+auto Loader::report(const Image& image) const -> void {
+	double elapsed = std::chrono::duration<double>(image.finished - image.started).count();
+	double mbytes = static_cast<double>(image.size) / (1024 * 1024);
+
+	std::cout << "Loaded " << image.file.getPath()
+			  << " @ 0x" << std::hex << image.address << std::dec
+			  << ": " << image.size << " bytes in "
+			  << std::fixed << std::setprecision(3) << elapsed * 1000 << " ms";
+	if (elapsed > 0) {
+		std::cout << " (" << std::setprecision(1) << mbytes / elapsed << " MB/s)";
+	}
+	std::cout << std::defaultfloat << std::endl;
+}
+
+auto Loader::run() -> int {
+	std::vector<std::thread> threads;
+	size_t offset = 0;
+	bool remaining = true;
+
+	try {
+		for (auto& image : sharedImages) {
+			share(*image);
+		}
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	try {
+		for (auto& image : images) {
+			prepare(*image);
+		}
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		for (auto& image : images) {
+			release(*image);
+		}
+		return -1;
+	}
+
+	/*
+	 * Interleave the chunks of all images so that every image makes
+	 * progress at the same time instead of being loaded one by one.
+	 */
+	chunks.clear();
+	while (remaining) {
+		remaining = false;
+		for (auto& image : images) {
+			if (offset >= image->size) {
+				continue;
+			}
+			chunks.push_back({image.get(), static_cast<off_t>(offset),
+							  std::min(chunkSize, image->size - offset)});
+			remaining = true;
+		}
+		offset += chunkSize;
+	}
+
+	next = 0;
+	failed = false;
+
+	auto started = Clock::now();
+	for (auto& image : images) {
+		image->started = image->finished = started;
+	}
+
+	unsigned int count = std::min<size_t>(workers, chunks.size());
+	for (unsigned int i = 0; i < count; i++) {
+		threads.emplace_back(&Loader::worker, this);
+	}
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	for (auto& image : images) {
+		release(*image);
+		if (!failed) {
+			report(*image);
+		}
+	}
+
+	return failed ? -1 : 0;
+}
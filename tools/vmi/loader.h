@@ -0,0 +1,66 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+
+#include "fs.h"
+#include "session.h"
+
+class Loader {
+public:
+	static constexpr size_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;
+
+	Loader(Session* session, unsigned int workers = 0, size_t chunkSize = DEFAULT_CHUNK_SIZE);
+
+	Loader(const Loader&) = delete;
+	Loader& operator=(const Loader&) = delete;
+
+	auto add(const std::string& path, unsigned long address) -> void;
+	auto adopt(const std::string& path, unsigned long address) -> void;
+	auto run() -> int;
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Image {
+		Image(const std::string& path, unsigned long address) :
+			file(path), address(address), size(0), map(nullptr), pending(0)
+		{
+		}
+
+		File file;
+		unsigned long address;
+		size_t size;
+		void *map;
+		std::atomic<size_t> pending;
+		Clock::time_point started;
+		Clock::time_point finished;
+	};
+
+	struct Chunk {
+		Image *image;
+		off_t offset;
+		size_t length;
+	};
+
+	auto share(Image& image) -> void;
+	auto prepare(Image& image) -> void;
+	auto release(Image& image) -> void;
+	auto worker() -> void;
+	auto report(const Image& image) const -> void;
+
+private:
+	Session* session;
+	unsigned int workers;
+	size_t chunkSize;
+	std::vector<std::unique_ptr<Image>> images;
+	std::vector<std::unique_ptr<Image>> sharedImages;
+	std::vector<Chunk> chunks;
+	std::atomic<size_t> next;
+	std::atomic<bool> failed;
+};
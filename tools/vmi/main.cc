@@ -4,10 +4,16 @@
 #include <libgen.h>
 
 #include <iostream>
+#include <fstream>
+#include <iterator>
 #include <string>
 #include <memory>
+#include <vector>
 #include <unordered_map>
+#include <algorithm>
+#include <thread>
 #include <sstream>
+#include <chrono>
 #include <iostream>
 
 #include "types.h"
@@ -19,13 +25,32 @@
 #include "mainloop.h"
 #include "fs.h"
 #include "property.h"
+#include "loader.h"
+#include "eventfd.h"
+#include "eventthread.h"
+#include "vcpu.h"
+#include "timer.h"
+#include "memory.h"
+#include "device.h"
+#include "snapshot.h"
 
 namespace {
 
 struct Schema {
-	unsigned int vcpus;
+	unsigned int vcpus = 1;
 	unsigned int memory;
+	unsigned int loaders = 0;
+	bool vcpuThreads = false;
+	bool lazy = false;
+	unsigned int statsInterval = 0;
+	std::vector<unsigned int> affinity;
     std::unordered_map<unsigned long, std::string> images;
+    std::unordered_map<unsigned long, std::string> sharedImages;
+    std::vector<std::string> devices;
+    std::string save;
+    std::string restore;
+    unsigned int clones = 0;
+    std::string config;
 };
 
 define usage(const std::string& name) -> void {
@@ -33,6 +58,17 @@ define usage(const std::string& name) -> void {
                  " -v : number of vcpus\n"
                  " -m : size\n"
                  " -i file@address : load file to the given address\n"
+                 " -r file@address : map file read-only to the given address without copying\n"
+                 " -j : number of image loader threads\n"
+                 " -l : allocate guest memory on first access\n"
+                 " -a cpu[,cpu...] : host cpu of each vcpu\n"
+                 " -t : handle the events of each vcpu on its own thread pinned to its cpu\n"
+                 " -s msec : print the exit statistics of every vcpu at the given interval\n"
+                 " -d name[:args] : add a virtio device (" << DeviceRegistry::names() << ")\n"
+                 " -S file : save the domain to file when it is shut down\n"
+                 " -R file : start the domain from a snapshot, memory is restored on first access\n"
+                 " -C count : run count copy-on-write clones of the domain instead of the domain itself\n"
+                 " -c directory : launch every domain described in the directory\n"
                  << std::endl;
 }
 
@@ -50,6 +86,11 @@ namespace cli {
 class Image : public Option<Schema> {
 public:
     define capture(Schema& schema, const std::string& value) -> int {
+        return parse(value, schema.images);
+    }
+
+protected:
+    define parse(const std::string& value, std::unordered_map<unsigned long, std::string>& images) -> int {
         try {
             size_t previous = 0, current;
             current = value.find('@');
@@ -66,7 +107,7 @@ public:
 
             previous = current + 1;
             unsigned long location = std::stoul(value.substr(previous), 0, 16);
-            schema.images[location] = path;
+            images[location] = path;
         } catch (std::invalid_argument& e) {
             std::cerr << e.what() << std::endl;
             return -1;
@@ -75,6 +116,13 @@ public:
     }
 };
 
+class SharedImage : public Image {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        return parse(value, schema.sharedImages);
+    }
+};
+
 class Memory : public Option<Schema> {
 public:
     define capture(Schema& schema, const std::string& value) -> int {
@@ -101,35 +149,132 @@ public:
     }
 };
 
-class Usage : public Option<Schema> {
+class Loaders : public Option<Schema> {
 public:
-	define capture(Schema& schema, const std::string& value) -> int {
-        usage(value);
-		return 0;
-	}
+    define capture(Schema& schema, const std::string& value) -> int {
+        try {
+            int loaders = std::stoi(value);
+            if (loaders <= 0) {
+                std::cerr << "Invalid number of loader threads: " << value << std::endl;
+                return -1;
+            }
+            schema.loaders = loaders;
+        } catch (std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+        return 0;
+    }
 };
 
-} // namespace cli
+class Affinity : public Option<Schema> {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        try {
+            std::istringstream stream(value);
+            std::string cpu;
+
+            schema.affinity.clear();
+            while (std::getline(stream, cpu, ',')) {
+                schema.affinity.push_back(std::stoul(cpu));
+            }
+        } catch (std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+};
 
-class Image {
+class Lazy : public Option<Schema> {
 public:
-    Image(const std::string name) : file(name) {
+    define capture(Schema& schema, const std::string& value) -> int {
+        schema.lazy = true;
+        return 0;
     }
+};
 
-    define loadAt(Session* session, unsigned long address) -> int {
-        file.open(O_RDONLY);;
-        void *map = session->map(address, file.size());
-        file.read(map, file.size());
-        session->unmap(map, file.size());
-        file.close();
+class VcpuThreads : public Option<Schema> {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        schema.vcpuThreads = true;
+        return 0;
+    }
+};
 
+class StatsInterval : public Option<Schema> {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        try {
+            schema.statsInterval = std::stoul(value);
+        } catch (std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
         return 0;
     }
+};
 
-private:
-    File file;
+class Device : public Option<Schema> {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        schema.devices.push_back(value);
+        return 0;
+    }
+};
+
+class Save : public Option<Schema> {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        schema.save = value;
+        return 0;
+    }
 };
 
+class Restore : public Option<Schema> {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        schema.restore = value;
+        return 0;
+    }
+};
+
+class Clones : public Option<Schema> {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        try {
+            int clones = std::stoi(value);
+            if (clones <= 0) {
+                std::cerr << "Invalid number of clones: " << value << std::endl;
+                return -1;
+            }
+            schema.clones = clones;
+        } catch (std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+};
+
+class Config : public Option<Schema> {
+public:
+    define capture(Schema& schema, const std::string& value) -> int {
+        schema.config = value;
+        return 0;
+    }
+};
+
+class Usage : public Option<Schema> {
+public:
+	define capture(Schema& schema, const std::string& value) -> int {
+        usage(value);
+		return 0;
+	}
+};
+
+} // namespace cli
+
 class Domain {
 public:
     Domain(Session* session) : session(session) {}
@@ -138,40 +283,206 @@ public:
 		hvx_proto_domain_create ioc_create = {
 			.vcpus = schema.vcpus,
 			.memory = schema.memory,
+			.flags = schema.lazy ? HVX_DOMAIN_LAZY : 0,
 		};
 
-		if (session->ioctl(HVX_IOCTL_DOMAIN_CREATE, &ioc_create) < 0) {
+		/* Device state is not part of a snapshot */
+		if ((!schema.save.empty() || !schema.restore.empty()) && !schema.devices.empty()) {
+			std::cerr << "Domains with devices cannot be saved or restored" << std::endl;
+			return -1;
+		}
+
+		/* Clones would share the device backends, and the template never runs to be saved */
+		if (schema.clones > 0 && (!schema.devices.empty() || !schema.save.empty())) {
+			std::cerr << "Cloned domains cannot have devices or be saved" << std::endl;
+			return -1;
+		}
+
+		if (!schema.restore.empty()) {
+			if (!schema.images.empty() || !schema.sharedImages.empty()) {
+				std::cerr << "Images cannot be loaded into a restored domain" << std::endl;
+				return -1;
+			}
+
+			try {
+				snapshot = std::make_shared<Snapshot>(schema.restore);
+			} catch (std::exception& e) {
+				std::cerr << e.what() << std::endl;
+				return -1;
+			}
+
+			/* Memory comes back from the snapshot as the vcpus touch it */
+			ioc_create.vcpus = snapshot->getVcpus();
+			ioc_create.memory = snapshot->getMemory();
+			ioc_create.flags = HVX_DOMAIN_LAZY;
+		}
+
+		savePath = schema.save;
+		memorySize = ioc_create.memory;
+
+		if (session->createDomain(ioc_create) < 0) {
 			std::cerr << "Failed to create domain" << std::endl;
 			return -1;
 		}
 
+		if (snapshot) {
+			lazyRestore = true;
+			return 0;
+		}
+
+		Loader loader(session, schema.loaders);
 		for (auto it : schema.images) {
-			Image(it.second).loadAt(session, it.first);
+			loader.add(it.second, it.first);
+		}
+		for (auto it : schema.sharedImages) {
+			loader.adopt(it.second, it.first);
+		}
+
+		if (loader.run() < 0) {
+			std::cerr << "Failed to load images" << std::endl;
+			return -1;
+		}
+
+		if (!schema.devices.empty() && attachDevices(schema) < 0) {
+			return -1;
 		}
 
         return 0;
     }
 
-    define start(const Schema& schema) -> int {
-		int ret;
-		hvx_proto_vcpu_context ioc_vcpu = {
-			.entry = 0,
-			.affinity = 0,
-			.contextid = 0,
+	/*
+	 * Clones only copy what the template has, so a template restored from
+	 * a snapshot must get all of its memory back before it is cloned.
+	 */
+	define prepareTemplate() -> int {
+		if (!snapshot) {
+			return 0;
+		}
+
+		if (snapshot->restoreAll(session) < 0) {
+			std::cerr << "Failed to restore memory: " << Error::message() << std::endl;
+			return -1;
+		}
+		lazyRestore = false;
+
+		return 0;
+	}
+
+	/* Becomes a copy-on-write clone of template, whose vcpus never run */
+	define clone(Domain& parent, const Schema& schema) -> int {
+		hvx_proto_domain_clone ioc_clone = {
+			.vcpus = parent.snapshot ? parent.snapshot->getVcpus() : schema.vcpus,
+			.flags = 0,
 		};
 
-		if ((ret = session->ioctl(HVX_IOCTL_VCPU_CONTEXT, &ioc_vcpu)) < 0) {
-			std::cerr << "Failed to create domain" << std::endl;
+		if (session->cloneDomain(*parent.session, ioc_clone) < 0) {
+			std::cerr << "Failed to clone domain: " << Error::message() << std::endl;
 			return -1;
 		}
 
-		return ret;
+		/* Only the vcpu states are taken from the snapshot */
+		snapshot = parent.snapshot;
+		memorySize = parent.memorySize;
+
+		return 0;
+	}
+
+    define start(const Schema& schema) -> int {
+		unsigned int cpus = std::max(1U, std::thread::hardware_concurrency());
+		unsigned int count = snapshot ? snapshot->getVcpus() : std::max(1U, schema.vcpus);
+
+		/* Restored vcpus must not run before they have their state back */
+		if (snapshot && session->pause(true) < 0) {
+			std::cerr << "Failed to pause domain: " << Error::message() << std::endl;
+			return -1;
+		}
+
+		for (unsigned int id = 0; id < count; id++) {
+			unsigned int affinity = id < schema.affinity.size() ? schema.affinity[id] : id % cpus;
+			Mainloop* loop = &session->getMainloop();
+
+			if (schema.vcpuThreads) {
+				threads.emplace_back(new EventThread(affinity));
+				loop = &threads.back()->getMainloop();
+			}
+
+			vcpus.emplace_back(new Vcpu(session, id, affinity));
+			vcpus.back()->setExitHandler([this](Vcpu& vcpu, hvx_exit& exit) {
+				handleExit(vcpu, exit);
+			});
+			if (vcpus.back()->start(0, *loop) < 0) {
+				return -1;
+			}
+
+			if (snapshot && vcpus.back()->setState(snapshot->getState(id)) < 0) {
+				std::cerr << "Failed to restore vcpu" << id << ": " << Error::message() << std::endl;
+				return -1;
+			}
+		}
+
+		if (snapshot && session->pause(false) < 0) {
+			std::cerr << "Failed to unpause domain: " << Error::message() << std::endl;
+			return -1;
+		}
+
+		for (auto& thread : threads) {
+			thread->start();
+		}
+
+		if (schema.statsInterval > 0) {
+			samples.resize(vcpus.size());
+			for (size_t i = 0; i < vcpus.size(); i++) {
+				samples[i] = vcpus[i]->getStatistics();
+			}
+
+			timer.reset(new Timer());
+			session->getMainloop().addEventSource(timer->getFd(), EPOLLIN, [this](int fd, Mainloop::Event) {
+				timer->receive();
+				sample();
+			});
+			timer->start(std::chrono::milliseconds(schema.statsInterval));
+		}
+
+		return vcpus.size();
 	}
 
 	define destroy() -> int {
-        hvx_proto_domain_destroy ioc_destroy;
+		if (timer) {
+			session->getMainloop().removeEventSource(timer->getFd());
+			timer.reset();
+		}
+
+		if (!savePath.empty() && !vcpus.empty()) {
+			auto started = std::chrono::steady_clock::now();
+			try {
+				Snapshot::save(session, vcpus, memorySize, savePath, snapshot.get());
+				std::cout << "Saved domain to " << savePath << " in "
+						  << std::chrono::duration_cast<std::chrono::milliseconds>(
+								 std::chrono::steady_clock::now() - started).count()
+						  << " ms" << std::endl;
+			} catch (std::exception& e) {
+				std::cerr << e.what() << std::endl;
+			}
+		}
+
+		/*
+		 * Stop dispatching before the vcpus the callbacks refer to go away,
+		 * but keep the threads until then: their mainloops hold the sources.
+		 */
+		for (auto& thread : threads) {
+			thread->stop();
+		}
+		vcpus.clear();
+		threads.clear();
 
-		if (session->ioctl(HVX_IOCTL_DOMAIN_DESTROY, &ioc_destroy) < 0) {
+		bus.clear();
+		for (auto& device : devices) {
+			device->detach();
+		}
+		devices.clear();
+		memory.reset();
+
+		if (session->destroyDomain() < 0) {
 			std::cerr << "Failed to destroy domain" << std::endl;
 			return -1;
 		}
@@ -180,32 +491,337 @@ public:
 	}
 
 private:
+	define attachDevices(const Schema& schema) -> int {
+		try {
+			memory.reset(new GuestMemory(session, HVX_GUEST_RAM_BASE, schema.memory));
+
+			for (auto& spec : schema.devices) {
+				std::uint64_t base = HVX_VIRTIO_MMIO_BASE + devices.size() * VirtioDevice::WINDOW_SIZE;
+				unsigned int irq = HVX_VIRTIO_IRQ_BASE + devices.size();
+
+				devices.push_back(DeviceRegistry::create(spec));
+				devices.back()->attach(session, memory.get(), session->getMainloop(), base, irq);
+				bus.add(devices.back().get());
+
+				std::cout << devices.back()->getName() << " @ 0x" << std::hex << base << std::dec
+						  << ", irq " << irq << std::endl;
+			}
+		} catch (std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	define handleExit(Vcpu& vcpu, hvx_exit& exit) -> void {
+		switch (exit.reason) {
+		case HVX_EXIT_MMIO:
+			/* Reads nobody claims complete with zero, writes are dropped */
+			if (!bus.handle(exit) && !(exit.flags & HVX_EXIT_WRITE)) {
+				exit.data = 0;
+			}
+			break;
+
+		case HVX_EXIT_MEMORY_FAULT:
+			if ((lazyRestore ? snapshot->restore(session, exit.addr) : session->populate(exit.addr, 1)) < 0) {
+				std::cerr << "vcpu" << vcpu.getId() << ": failed to populate 0x"
+						  << std::hex << exit.addr << std::dec << std::endl;
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	/* Upper bound in microseconds of the bucket holding the given percentile */
+	static define percentile(const __u64 (&latency)[HVX_LATENCY_BUCKETS], double p) -> unsigned long {
+		__u64 total = 0, seen = 0;
+
+		for (auto count : latency) {
+			total += count;
+		}
+		if (total == 0) {
+			return 0;
+		}
+
+		for (int i = 0; i < HVX_LATENCY_BUCKETS; i++) {
+			seen += latency[i];
+			if (seen >= total * p) {
+				return 2UL << i;
+			}
+		}
+		return 2UL << (HVX_LATENCY_BUCKETS - 1);
+	}
+
+	/* Print what every vcpu went through since the previous sample */
+	define sample() -> void {
+		static const char* reasons[HVX_EXIT_REASONS] = {
+			"none", "mmio", "hypercall", "shutdown", "fault"
+		};
+
+		for (size_t i = 0; i < vcpus.size(); i++) {
+			hvx_vcpu_stats current = vcpus[i]->getStatistics();
+			hvx_vcpu_stats delta;
+			__u64 exits = 0;
+
+			for (int r = 0; r < HVX_EXIT_REASONS; r++) {
+				delta.exits[r] = current.exits[r] - samples[i].exits[r];
+				exits += delta.exits[r];
+			}
+			for (int b = 0; b < HVX_LATENCY_BUCKETS; b++) {
+				delta.latency[b] = current.latency[b] - samples[i].latency[b];
+			}
+			delta.signals = current.signals - samples[i].signals;
+			samples[i] = current;
+
+			std::cout << "vcpu" << vcpus[i]->getId() << ": " << exits << " exits (";
+			for (int r = 1; r < HVX_EXIT_REASONS; r++) {
+				std::cout << (r > 1 ? ", " : "") << reasons[r] << " " << delta.exits[r];
+			}
+			std::cout << "), " << delta.signals << " signals, latency p50 < "
+					  << percentile(delta.latency, 0.5) << " us, p99 < "
+					  << percentile(delta.latency, 0.99) << " us" << std::endl;
+		}
+	}
+
     Session* session;
+	std::vector<std::unique_ptr<Vcpu>> vcpus;
+	std::vector<std::unique_ptr<EventThread>> threads;
+	std::unique_ptr<Timer> timer;
+	std::vector<hvx_vcpu_stats> samples;
+	std::unique_ptr<GuestMemory> memory;
+	std::vector<std::unique_ptr<VirtioDevice>> devices;
+	MmioBus bus;
+	std::shared_ptr<Snapshot> snapshot;
+	bool lazyRestore = false;
+	std::string savePath;
+	size_t memorySize = 0;
 };
 
 class Instance {
 public:
-	define run(const Schema& schema, bool& stop) -> int {
-		int ret = -1;
-		Session* session = Session::create();
-		Domain domain(session);
-		domain.create(schema);
-        int handle = domain.start(schema);
-		if (handle > 0) {
-			ret = session->eventloop(stop);
+	Instance(const std::string& name, const std::shared_ptr<Mainloop>& loop) :
+		name(name), mainloop(loop), launched(false)
+	{
+	}
+
+	~Instance() {
+		shutdown();
+	}
+
+	define launch(const Schema& schema) -> int {
+		session.reset(Session::create(mainloop));
+		if (!session) {
+			std::cerr << name << ": failed to open hvx device" << std::endl;
+			return -1;
+		}
+
+		domain.reset(new Domain(session.get()));
+		if (domain->create(schema) < 0) {
+			return -1;
+		}
+		launched = true;
+
+		if (schema.clones > 0) {
+			return launchClones(schema);
+		}
+
+		if (domain->start(schema) <= 0) {
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/* The domain is only the template of its clones, it never runs itself */
+	define launchClones(const Schema& schema) -> int {
+		if (domain->prepareTemplate() < 0) {
+			return -1;
+		}
+
+		auto started = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < schema.clones; i++) {
+			cloneSessions.emplace_back(Session::create(mainloop));
+			if (!cloneSessions.back()) {
+				std::cerr << name << ": failed to open hvx device" << std::endl;
+				return -1;
+			}
+
+			clones.emplace_back(new Domain(cloneSessions.back().get()));
+			if (clones.back()->clone(*domain, schema) < 0) {
+				clones.pop_back();
+				return -1;
+			}
+
+			if (clones.back()->start(schema) <= 0) {
+				return -1;
+			}
+		}
+
+		std::cout << name << ": started " << schema.clones << " clones in "
+				  << std::chrono::duration_cast<std::chrono::milliseconds>(
+						 std::chrono::steady_clock::now() - started).count()
+				  << " ms" << std::endl;
+
+		return 0;
+	}
+
+	define shutdown() -> void {
+		/* The template cannot go away while it has clones */
+		for (auto& clone : clones) {
+			clone->destroy();
 		}
-		domain.destroy();
+		clones.clear();
+		cloneSessions.clear();
 
-        return ret;
+		if (launched) {
+			domain->destroy();
+			launched = false;
+		}
+		domain.reset();
+		session.reset();
+	}
+
+	define getName() const -> const std::string& {
+		return name;
 	}
+
+private:
+	std::string name;
+	std::shared_ptr<Mainloop> mainloop;
+	std::unique_ptr<Session> session;
+	std::unique_ptr<Domain> domain;
+	std::vector<std::unique_ptr<Session>> cloneSessions;
+	std::vector<std::unique_ptr<Domain>> clones;
+	bool launched;
 };
 
-define main(int argc, char* argv[]) -> int {
-	OptionRegistry<Schema> options;
+define report(const Mainloop& mainloop) -> void {
+	auto stats = mainloop.getStatistics();
+	std::cout << "Dispatched " << stats.events << " events in " << stats.batches << " batches ("
+			  << static_cast<unsigned long>(stats.eventRate()) << " events/s, avg "
+			  << static_cast<unsigned long>(stats.averageDispatchTime()) << " ns, max "
+			  << stats.maxDispatchTime << " ns)" << std::endl;
+}
+
+define createOptions(OptionRegistry<Schema>& options) -> void {
     options.createOption<cli::Usage>('h', false, "Show usage")
 	       .createOption<cli::Vcpu>('v', true, "number of vcpus")
 	       .createOption<cli::Memory>('m', true, "memory size")
-	       .createOption<cli::Image>('i', true, "image to be loaded");
+	       .createOption<cli::Image>('i', true, "image to be loaded")
+	       .createOption<cli::SharedImage>('r', true, "read-only image to be mapped")
+	       .createOption<cli::Loaders>('j', true, "number of image loader threads")
+	       .createOption<cli::Lazy>('l', false, "lazy memory allocation")
+	       .createOption<cli::Affinity>('a', true, "host cpu of each vcpu")
+	       .createOption<cli::VcpuThreads>('t', false, "per-vcpu event threads")
+	       .createOption<cli::StatsInterval>('s', true, "vcpu statistics interval")
+	       .createOption<cli::Device>('d', true, "virtio device")
+	       .createOption<cli::Save>('S', true, "snapshot file to save to")
+	       .createOption<cli::Restore>('R', true, "snapshot file to restore from")
+	       .createOption<cli::Clones>('C', true, "number of clones")
+	       .createOption<cli::Config>('c', true, "supervise domains described in a directory");
+}
+
+/*
+ * Manages every domain described in a configuration directory from a
+ * single process. Each regular file holds the command line options of
+ * one domain and the file name is used as the domain name. All domains
+ * share one event loop.
+ */
+class Supervisor {
+public:
+	Supervisor() : mainloop(std::make_shared<Mainloop>()) {}
+
+	define load(const std::string& directory) -> int {
+		DirectoryIterator iter(directory), end;
+
+		for (; iter != end; ++iter) {
+			if (!iter->isFile()) {
+				continue;
+			}
+
+			OptionRegistry<Schema> options;
+			createOptions(options);
+
+			std::ifstream stream(iter->getPath());
+			std::vector<std::string> args{std::istream_iterator<std::string>(stream),
+										  std::istream_iterator<std::string>()};
+			std::vector<char *> argv;
+			for (auto& arg : args) {
+				argv.push_back(&arg[0]);
+			}
+
+			if (options.parse(argv.size(), argv.data()) != 0) {
+				std::cerr << iter->getPath() << ": invalid configuration" << std::endl;
+				return -1;
+			}
+
+			configs.emplace_back(iter->getName(), options.schema);
+		}
+
+		if (configs.empty()) {
+			std::cerr << "No domain found in " << directory << std::endl;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	define run(bool& stop) -> int {
+		for (auto& config : configs) {
+			std::unique_ptr<Instance> instance(new Instance(config.first, mainloop));
+			if (instance->launch(config.second) < 0) {
+				std::cerr << config.first << ": failed to launch domain" << std::endl;
+				continue;
+			}
+			std::cout << config.first << ": launched" << std::endl;
+			instances.push_back(std::move(instance));
+		}
+
+		if (instances.empty()) {
+			return -1;
+		}
+
+		mainloop->run(stop);
+		report(*mainloop);
+
+		instances.clear();
+
+		return 0;
+	}
+
+private:
+	std::shared_ptr<Mainloop> mainloop;
+	std::vector<std::pair<std::string, Schema>> configs;
+	std::vector<std::unique_ptr<Instance>> instances;
+};
+
+define run(const Schema& schema, bool& stop) -> int {
+	if (!schema.config.empty()) {
+		Supervisor supervisor;
+		if (supervisor.load(schema.config) < 0) {
+			return -1;
+		}
+		return supervisor.run(stop);
+	}
+
+	auto mainloop = std::make_shared<Mainloop>();
+	Instance instance("domain", mainloop);
+	if (instance.launch(schema) < 0) {
+		return -1;
+	}
+
+	mainloop->run(stop);
+	report(*mainloop);
+
+	return 0;
+}
+
+define main(int argc, char* argv[]) -> int {
+	OptionRegistry<Schema> options;
+	createOptions(options);
 
 	if (options.parse(--argc, &argv[1]) != 0) {
         usage(argv[0]);
@@ -215,7 +831,7 @@ define main(int argc, char* argv[]) -> int {
 	::signal(SIGINT, signalHandler);
 
     try {
-        if (Instance().run(options.schema, exitFlag) < 0) {
+        if (run(options.schema, exitFlag) < 0) {
 			std::cerr << "Failed to launch domain" << std::endl;
 			return EXIT_FAILURE;
 		}
@@ -9,10 +9,19 @@
 #include "exception.h"
 #include "mainloop.h"
 
-#define MAX_EPOLL_EVENTS	16
+#define MIN_EPOLL_EVENTS	16
+#define MAX_EPOLL_EVENTS	1024
 
 Mainloop::Mainloop() :
-	pollFd(::epoll_create1(EPOLL_CLOEXEC)) {
+	hasRetired(false),
+	events(MIN_EPOLL_EVENTS),
+	epoch(0),
+	pollFd(::epoll_create1(EPOLL_CLOEXEC)),
+	eventCount(0),
+	batchCount(0),
+	busyTime(0),
+	maxDispatchTime(0),
+	statisticsSince(Clock::now()) {
 	if (pollFd == -1) {
 		throw std::runtime_error(Error::message());
 	}
@@ -20,75 +29,129 @@ Mainloop::Mainloop() :
 
 Mainloop::~Mainloop()
 {
+	for (auto& source : sources) {
+		delete source.second;
+	}
+
+	for (auto& entry : retired) {
+		delete entry.source;
+	}
+
+	::close(pollFd);
 }
 
 auto Mainloop::addEventSource(int fd, const Event events, Callback&& cb) -> void {
 	epoll_event event;
-	std::lock_guard<std::recursive_mutex> lock(mutex);
+	std::lock_guard<std::mutex> lock(mutex);
 
-	if (callbacks.find(fd) != callbacks.end()) {
+	if (sources.find(fd) != sources.end()) {
 		throw std::runtime_error("event source already registered");
 	}
 
+	Source* source = new Source(fd, std::move(cb));
+
 	::memset(&event, 0, sizeof(epoll_event));
 
 	event.events = events;
-	event.data.fd = fd;
+	event.data.ptr = source;
 
 	if (::epoll_ctl(pollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		delete source;
 		throw std::runtime_error(Error::message());
 	}
 
-	callbacks.insert({fd, std::make_shared<Callback>(std::move(cb))});
+	sources.insert({fd, source});
 }
 
+/*
+ * The source may still be referenced by a batch returned from epoll_wait,
+ * so it is only deactivated here and freed once the dispatching thread has
+ * moved past the epoch in which it was retired.
+ */
 auto Mainloop::removeEventSource(int fd) -> void {
-	std::lock_guard<std::recursive_mutex> lock(mutex);
+	std::lock_guard<std::mutex> lock(mutex);
 
-	auto iter = callbacks.find(fd);
-	if (iter == callbacks.end()) {
+	auto iter = sources.find(fd);
+	if (iter == sources.end()) {
 		return;
 	}
 
-	callbacks.erase(iter);
+	Source* source = iter->second;
+	sources.erase(iter);
 
 	::epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, NULL);
+
+	source->active = false;
+	retired.push_back({source, epoch.load()});
+	hasRetired = true;
+}
+
+void Mainloop::reclaim(std::uint64_t current) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto iter = retired.begin();
+	while (iter != retired.end()) {
+		if (iter->epoch < current) {
+			delete iter->source;
+			iter = retired.erase(iter);
+		} else {
+			++iter;
+		}
+	}
+
+	hasRetired = !retired.empty();
 }
 
 auto Mainloop::dispatch(int timeout) -> bool {
-	int nfds = 0;
-	epoll_event event[MAX_EPOLL_EVENTS];
+	int nfds;
 
 	do {
-		nfds = ::epoll_wait(pollFd, event, MAX_EPOLL_EVENTS, timeout);
-        if (errno == EINTR)
-            return true;
+		nfds = ::epoll_wait(pollFd, events.data(), events.size(), timeout);
+		if (nfds == -1 && errno == EINTR)
+			return true;
 	} while (nfds == -1);
 
-	if (nfds <= 0) {
+	if (nfds == 0) {
 		return false;
 	}
 
-	for (int i = 0; i < nfds; i++) {
-		std::lock_guard<std::recursive_mutex> lock(mutex);
+	std::uint64_t current = ++epoch;
+	auto started = Clock::now();
 
-		auto iter = callbacks.find(event[i].data.fd);
-		if (iter == callbacks.end()) {
+	for (int i = 0; i < nfds; i++) {
+		Source* source = static_cast<Source*>(events[i].data.ptr);
+		if (!source->active) {
 			continue;
 		}
 
-		std::shared_ptr<Callback> callback(iter->second);
 		try {
-			if ((event[i].events & (EPOLLHUP | EPOLLRDHUP))) {
-				event[i].events &= ~EPOLLIN;
+			if ((events[i].events & (EPOLLHUP | EPOLLRDHUP))) {
+				events[i].events &= ~EPOLLIN;
 			}
 
-			(*callback)(event[i].data.fd, event[i].events);
+			source->callback(source->fd, events[i].events);
 		} catch (std::exception& e) {
 			std::cerr << e.what() << std::endl;
 		}
 	}
 
+	std::uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - started).count();
+	eventCount += nfds;
+	batchCount++;
+	busyTime += elapsed;
+	if (elapsed > maxDispatchTime) {
+		maxDispatchTime = elapsed;
+	}
+
+	if (hasRetired) {
+		reclaim(current);
+	}
+
+	/* A full batch means more events are likely pending, drain more next time */
+	if (static_cast<size_t>(nfds) == events.size() && events.size() < MAX_EPOLL_EVENTS) {
+		events.resize(events.size() * 2);
+	}
+
 	return true;
 }
 
@@ -99,3 +162,29 @@ auto Mainloop::run(bool& stopped, int timeout) -> void {
 		done = !dispatch(timeout);
 	}
 }
+
+auto Mainloop::run(const std::atomic<bool>& stopped, int timeout) -> void {
+	bool done = false;
+
+	while (!stopped.load() && !done) {
+		done = !dispatch(timeout);
+	}
+}
+
+auto Mainloop::getStatistics() const -> Statistics {
+	return {
+		eventCount.load(),
+		batchCount.load(),
+		busyTime.load(),
+		maxDispatchTime.load(),
+		Clock::now() - statisticsSince,
+	};
+}
+
+auto Mainloop::resetStatistics() -> void {
+	eventCount = 0;
+	batchCount = 0;
+	busyTime = 0;
+	maxDispatchTime = 0;
+	statisticsSince = Clock::now();
+}
@@ -5,16 +5,41 @@
 #include <string>
 #include <functional>
 #include <unordered_map>
+#include <vector>
 #include <memory>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 
 #include "eventfd.h"
 
+/*
+ * Each loop must be dispatched from a single thread. Event sources may be
+ * added and removed from any thread, including from within callbacks.
+ */
 class Mainloop {
 public:
 	typedef unsigned int Event;
 	typedef std::function<void(int fd, Event event)> Callback;
+	typedef std::chrono::steady_clock Clock;
+
+	struct Statistics {
+		std::uint64_t events;
+		std::uint64_t batches;
+		std::uint64_t busyTime;
+		std::uint64_t maxDispatchTime;
+		Clock::duration elapsed;
+
+		auto eventRate() const -> double {
+			double seconds = std::chrono::duration<double>(elapsed).count();
+			return seconds > 0 ? events / seconds : 0;
+		}
+
+		auto averageDispatchTime() const -> double {
+			return events ? static_cast<double>(busyTime) / events : 0;
+		}
+	};
 
 	Mainloop();
 	~Mainloop();
@@ -23,12 +48,43 @@ public:
 	auto removeEventSource(int fd) -> void;
 	auto dispatch(int timeout) -> bool;
 	auto run(bool& stopped, int timeout = -1) -> void;
+	/* Same, for a flag set from another thread */
+	auto run(const std::atomic<bool>& stopped, int timeout = -1) -> void;
+
+	auto getStatistics() const -> Statistics;
+	auto resetStatistics() -> void;
 
 private:
-	void prepare();
+	struct Source {
+		Source(int fd, Callback&& cb) :
+			fd(fd), callback(std::move(cb)), active(true)
+		{
+		}
+
+		int fd;
+		Callback callback;
+		std::atomic<bool> active;
+	};
+
+	struct Retired {
+		Source* source;
+		std::uint64_t epoch;
+	};
+
+	void reclaim(std::uint64_t epoch);
 
 private:
-	std::unordered_map<int, std::shared_ptr<Callback>> callbacks;
-	std::recursive_mutex mutex;
+	std::unordered_map<int, Source*> sources;
+	std::vector<Retired> retired;
+	std::atomic<bool> hasRetired;
+	std::vector<epoll_event> events;
+	std::mutex mutex;
+	std::atomic<std::uint64_t> epoch;
 	int pollFd;
+
+	std::atomic<std::uint64_t> eventCount;
+	std::atomic<std::uint64_t> batchCount;
+	std::atomic<std::uint64_t> busyTime;
+	std::atomic<std::uint64_t> maxDispatchTime;
+	Clock::time_point statisticsSince;
 };
@@ -0,0 +1,26 @@
+#include <sys/mman.h>
+
+#include "error.h"
+#include "exception.h"
+#include "memory.h"
+
+GuestMemory::GuestMemory(Session* session, std::uint64_t base, size_t size) :
+	session(session), base(base), size(size)
+{
+	map = session->map(base, size);
+	if (map == MAP_FAILED) {
+		throw std::runtime_error("Failed to map guest memory: " + Error::message());
+	}
+}
+
+GuestMemory::~GuestMemory() {
+	session->unmap(map, size);
+}
+
+auto GuestMemory::translate(std::uint64_t addr, size_t len) const -> void* {
+	if (addr < base || len > size || addr - base > size - len) {
+		return nullptr;
+	}
+
+	return static_cast<char *>(map) + (addr - base);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+
+#include "session.h"
+
+/*
+ * The guest RAM of a domain mapped into our address space, so that device
+ * backends can follow the guest physical addresses they are handed.
+ */
+class GuestMemory {
+public:
+	GuestMemory(Session* session, std::uint64_t base, size_t size);
+	~GuestMemory();
+
+	GuestMemory(const GuestMemory&) = delete;
+	GuestMemory& operator=(const GuestMemory&) = delete;
+
+	/* Returns nullptr unless [addr, addr + len) lies entirely in guest RAM */
+	auto translate(std::uint64_t addr, size_t len) const -> void*;
+
+	template<typename T>
+	auto translate(std::uint64_t addr, size_t count = 1) const -> T* {
+		return static_cast<T *>(translate(addr, sizeof(T) * count));
+	}
+
+	auto getBase() const -> std::uint64_t {
+		return base;
+	}
+
+	auto getSize() const -> size_t {
+		return size;
+	}
+
+private:
+	Session* session;
+	std::uint64_t base;
+	size_t size;
+	void *map;
+};
@@ -0,0 +1,400 @@
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "error.h"
+#include "session.h"
+#include "mock.h"
+
+namespace {
+
+struct MockDomain;
+
+struct MockVcpu {
+	int fd = -1;
+	int eventfd = -1;
+	void *map = nullptr;
+	size_t size = 0;
+	hvx_exit_ring *ring = nullptr;
+	hvx_vcpu_stats *stats = nullptr;
+	MockDomain *domain = nullptr;
+	std::atomic<bool> stopped{false};
+	std::thread thread;
+};
+
+struct MockDomain {
+	int fd = -1;
+	long id = 0;
+	std::atomic<bool> paused{false};
+	std::vector<MockVcpu *> vcpus;
+	/* Restored granules, sorted by base */
+	std::vector<hvx_memory_extent> extents;
+};
+
+std::mutex lock;
+std::unordered_map<int, MockDomain *> domains;
+std::unordered_map<int, MockVcpu *> vcpus;
+std::atomic<long> nextId{1};
+dev_t deviceDev;
+ino_t deviceIno;
+bool installed = false;
+
+auto sysIoctl(int fd, unsigned long cmd, void *arg) -> int {
+	return ::syscall(SYS_ioctl, fd, cmd, arg);
+}
+
+auto sysClose(int fd) -> int {
+	return ::syscall(SYS_close, fd);
+}
+
+auto fail(int error) -> int {
+	errno = error;
+	return -1;
+}
+
+auto now() -> __u64 {
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+auto isDevice(int fd) -> bool {
+	struct stat st;
+	return installed && ::fstat(fd, &st) == 0 && st.st_dev == deviceDev && st.st_ino == deviceIno;
+}
+
+/* Accounts handled records the way the driver does when the consumer catches up */
+auto account(MockVcpu *vcpu) -> void {
+	__u64 signalled = __atomic_load_n(&vcpu->ring->signalled, __ATOMIC_RELAXED);
+	__u64 acked = __atomic_load_n(&vcpu->ring->acked, __ATOMIC_RELAXED);
+
+	if (signalled != 0 && acked >= signalled) {
+		__u64 us = (acked - signalled) / 1000;
+		int bucket = 0;
+
+		while (us > 1 && bucket < HVX_LATENCY_BUCKETS - 1) {
+			us >>= 1;
+			bucket++;
+		}
+		vcpu->stats->latency[bucket]++;
+	}
+}
+
+auto guest(MockVcpu *vcpu) -> void {
+	std::uint32_t head = 0;
+	__u64 sequence = 0;
+	std::uint64_t one = 1;
+
+	while (!vcpu->stopped) {
+		if (vcpu->domain != nullptr && vcpu->domain->paused) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		hvx_exit& exit = vcpu->ring->entries[head % HVX_EXIT_RING_ENTRIES];
+		exit.reason = HVX_EXIT_MMIO;
+		exit.flags = HVX_EXIT_WRITE;
+		exit.addr = MockHvx::DOORBELL;
+		exit.data = sequence++;
+		exit.len = 4;
+		vcpu->stats->exits[HVX_EXIT_MMIO]++;
+
+		__atomic_store_n(&vcpu->ring->signalled, now(), __ATOMIC_RELAXED);
+		__atomic_store_n(&vcpu->ring->head, ++head, __ATOMIC_RELEASE);
+
+		/* The consumer has caught up with everything before, so it must be told */
+		vcpu->stats->signals++;
+		if (::write(vcpu->eventfd, &one, sizeof(one)) < 0) {
+			break;
+		}
+
+		while (__atomic_load_n(&vcpu->ring->tail, __ATOMIC_ACQUIRE) != head) {
+			if (vcpu->stopped) {
+				return;
+			}
+			std::this_thread::yield();
+		}
+		account(vcpu);
+	}
+}
+
+auto stopVcpu(MockVcpu *vcpu) -> void {
+	vcpu->stopped = true;
+	if (vcpu->thread.joinable()) {
+		vcpu->thread.join();
+	}
+}
+
+auto destroyVcpu(MockVcpu *vcpu) -> void {
+	stopVcpu(vcpu);
+	if (vcpu->map != nullptr) {
+		::munmap(vcpu->map, vcpu->size);
+	}
+	if (vcpu->eventfd >= 0) {
+		sysClose(vcpu->eventfd);
+	}
+	delete vcpu;
+}
+
+auto createDomain(hvx_proto_domain_create *op) -> int {
+	int fd = ::memfd_create("hvx-domain", MFD_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* Sparse, only what the guest or the loaders touch gets allocated */
+	if (::ftruncate(fd, HVX_GUEST_RAM_BASE + op->memory) < 0) {
+		sysClose(fd);
+		return -1;
+	}
+
+	MockDomain *domain = new MockDomain();
+	domain->fd = fd;
+	domain->id = nextId++;
+	op->id = domain->id;
+
+	std::lock_guard<std::mutex> guard(lock);
+	domains[fd] = domain;
+
+	return fd;
+}
+
+auto createVcpu(MockDomain *domain, hvx_proto_vcpu_context *op) -> int {
+	size_t page = ::sysconf(_SC_PAGESIZE);
+	std::unique_ptr<MockVcpu> vcpu(new MockVcpu());
+
+	vcpu->size = (HVX_VCPU_STATS_OFFSET + 1) * page;
+	vcpu->fd = ::memfd_create("hvx-vcpu", MFD_CLOEXEC);
+	if (vcpu->fd < 0) {
+		return -1;
+	}
+
+	if (::ftruncate(vcpu->fd, vcpu->size) < 0) {
+		sysClose(vcpu->fd);
+		return -1;
+	}
+
+	vcpu->map = ::mmap(nullptr, vcpu->size, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu->fd, 0);
+	if (vcpu->map == MAP_FAILED) {
+		vcpu->map = nullptr;
+		sysClose(vcpu->fd);
+		return -1;
+	}
+
+	/* Like the driver, keep the eventfd even if the caller closes its fd */
+	vcpu->eventfd = ::fcntl(op->eventfd, F_DUPFD_CLOEXEC, 0);
+	if (vcpu->eventfd < 0) {
+		int fd = vcpu->fd;
+		destroyVcpu(vcpu.release());
+		sysClose(fd);
+		return -1;
+	}
+
+	vcpu->ring = static_cast<hvx_exit_ring *>(vcpu->map);
+	vcpu->ring->size = HVX_EXIT_RING_ENTRIES;
+	vcpu->stats = reinterpret_cast<hvx_vcpu_stats *>(static_cast<char *>(vcpu->map) +
+													 HVX_VCPU_STATS_OFFSET * page);
+	vcpu->domain = domain;
+
+	MockVcpu *raw = vcpu.release();
+	int fd = raw->fd;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		vcpus[fd] = raw;
+		domain->vcpus.push_back(raw);
+	}
+	raw->thread = std::thread(guest, raw);
+
+	return fd;
+}
+
+/* Backs the granule with the given pages, like HVX_IOCTL_MEMORY_RESTORE */
+auto restore(MockDomain *domain, const hvx_proto_memory_restore *op) -> int {
+	static const char zero[4096] = {};
+	const __u64 *pages = reinterpret_cast<const __u64 *>(op->pages);
+	const __u64 size = HVX_RESTORE_PAGES * sizeof(zero);
+	const __u64 base = op->base & ~(size - 1);
+	hvx_memory_extent extent = { base, size, 0 };
+	auto it = std::lower_bound(domain->extents.begin(), domain->extents.end(), extent,
+							   [](const hvx_memory_extent& a, const hvx_memory_extent& b) {
+		return a.base < b.base;
+	});
+
+	/* Like the driver, leave a granule that is backed already alone */
+	if (it != domain->extents.end() && it->base == extent.base) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < HVX_RESTORE_PAGES; i++) {
+		const void *src = i < op->count && pages[i] != 0 ? reinterpret_cast<const void *>(pages[i]) : zero;
+		if (::pwrite(domain->fd, src, sizeof(zero), base + i * sizeof(zero)) < 0) {
+			return -1;
+		}
+	}
+
+	domain->extents.insert(it, extent);
+
+	return 0;
+}
+
+auto extents(MockDomain *domain, const hvx_proto_memory_extents *op) -> int {
+	std::copy_n(domain->extents.begin(), std::min<size_t>(op->count, domain->extents.size()),
+				reinterpret_cast<hvx_memory_extent *>(op->entries));
+	return domain->extents.size();
+}
+
+auto domainIoctl(MockDomain *domain, unsigned long cmd, void *arg) -> int {
+	switch (cmd) {
+	case HVX_IOCTL_VCPU_CONTEXT:
+		return createVcpu(domain, static_cast<hvx_proto_vcpu_context *>(arg));
+
+	case HVX_IOCTL_MEMORY:
+		/* The memfd is populated on first touch */
+		return 0;
+
+	case HVX_IOCTL_MEMORY_RESTORE:
+		return restore(domain, static_cast<hvx_proto_memory_restore *>(arg));
+
+	case HVX_IOCTL_MEMORY_EXTENTS:
+		return extents(domain, static_cast<hvx_proto_memory_extents *>(arg));
+
+	case HVX_IOCTL_DOMAIN_PAUSE:
+		domain->paused = static_cast<hvx_proto_domain_pause *>(arg)->pause != 0;
+		return 0;
+
+	case HVX_IOCTL_DOMAIN_DESTROY: {
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto vcpu : domain->vcpus) {
+			stopVcpu(vcpu);
+		}
+		return 0;
+	}
+
+	default:
+		return fail(ENOTTY);
+	}
+}
+
+auto vcpuIoctl(MockVcpu *vcpu, unsigned long cmd, void *arg) -> int {
+	switch (cmd) {
+	case HVX_IOCTL_VCPU_GET_STATE:
+		std::memset(arg, 0, sizeof(hvx_vcpu_state));
+		return 0;
+
+	case HVX_IOCTL_VCPU_SET_STATE:
+		return 0;
+
+	default:
+		return fail(ENOTTY);
+	}
+}
+
+} // namespace
+
+auto MockHvx::install() -> void {
+	struct stat st;
+
+	int fd = ::memfd_create("hvx", 0);
+	if (fd < 0 || ::fstat(fd, &st) < 0) {
+		throw std::runtime_error("Failed to create mock device: " + Error::message());
+	}
+
+	/* Every session reopens it, each open is a new fd on the same inode */
+	deviceDev = st.st_dev;
+	deviceIno = st.st_ino;
+	installed = true;
+
+	Session::setDevicePath("/proc/self/fd/" + std::to_string(fd));
+}
+
+extern "C" int ioctl(int fd, unsigned long cmd, ...) __THROW {
+	va_list args;
+	void *arg;
+
+	va_start(args, cmd);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if (!installed) {
+		return sysIoctl(fd, cmd, arg);
+	}
+
+	MockDomain *domain = nullptr;
+	MockVcpu *vcpu = nullptr;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto d = domains.find(fd);
+		if (d != domains.end()) {
+			domain = d->second;
+		}
+		auto v = vcpus.find(fd);
+		if (v != vcpus.end()) {
+			vcpu = v->second;
+		}
+	}
+
+	if (domain != nullptr) {
+		return domainIoctl(domain, cmd, arg);
+	}
+	if (vcpu != nullptr) {
+		return vcpuIoctl(vcpu, cmd, arg);
+	}
+
+	if (isDevice(fd)) {
+		if (cmd == HVX_IOCTL_DOMAIN_CREATE) {
+			return createDomain(static_cast<hvx_proto_domain_create *>(arg));
+		}
+		/* There is no hypervisor behind the mock to take hypercalls */
+		return fail(ENOTTY);
+	}
+
+	return sysIoctl(fd, cmd, arg);
+}
+
+extern "C" int close(int fd) {
+	if (installed) {
+		std::unique_lock<std::mutex> guard(lock);
+
+		auto d = domains.find(fd);
+		if (d != domains.end()) {
+			MockDomain *domain = d->second;
+			domains.erase(d);
+			for (auto vcpu : domain->vcpus) {
+				stopVcpu(vcpu);
+				vcpu->domain = nullptr;
+			}
+			delete domain;
+		}
+
+		auto v = vcpus.find(fd);
+		if (v != vcpus.end()) {
+			MockVcpu *vcpu = v->second;
+			vcpus.erase(v);
+			if (vcpu->domain != nullptr) {
+				auto& list = vcpu->domain->vcpus;
+				list.erase(std::remove(list.begin(), list.end(), vcpu), list.end());
+			}
+			guard.unlock();
+			destroyVcpu(vcpu);
+		}
+	}
+
+	return sysClose(fd);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+/*
+ * A userspace stand-in for /dev/hvx, so that everything above the driver
+ * can be exercised on any Linux box. Linking mock.o overrides ioctl() and
+ * close() for the whole program: the fds the mock hands out are served in
+ * process, everything else goes to the kernel.
+ *
+ * Domain and vcpu fds are memfds, so guest memory, exit rings and vcpu
+ * statistics are mapped exactly as they are from the driver. Every vcpu
+ * runs a guest thread that writes to DOORBELL in a loop: it publishes one
+ * MMIO exit, signals the vcpu eventfd and waits for the record to be
+ * consumed, like a guest blocked on a trapping store would.
+ */
+class MockHvx {
+public:
+	static constexpr unsigned long DOORBELL = 0x0a000000;
+
+	/* Points new sessions at the mock device. Throws on failure. */
+	static auto install() -> void;
+};
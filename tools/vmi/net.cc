@@ -0,0 +1,153 @@
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <algorithm>
+
+#include "error.h"
+#include "exception.h"
+#include "device.h"
+
+#define VIRTIO_ID_NET			1
+
+#define VIRTIO_NET_F_MAC		(1ULL << 5)
+
+/* struct virtio_net_hdr_v1, which the tap device handles for us */
+#define VIRTIO_NET_HDR_SIZE		12
+
+/*
+ * virtio network device on a tap interface, "net:name" to pick the
+ * interface name. No offloads are negotiated, so frames go to and from
+ * the tap device as they are.
+ */
+class NetDevice : public VirtioDevice {
+public:
+	enum { RX_QUEUE, TX_QUEUE, QUEUES };
+
+	NetDevice(const std::string& args) :
+		VirtioDevice(VIRTIO_ID_NET, QUEUES, VIRTIO_NET_F_MAC), watching(false)
+	{
+		struct ifreq ifr;
+		int size = VIRTIO_NET_HDR_SIZE;
+
+		tap = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (tap < 0) {
+			throw std::runtime_error("Failed to open /dev/net/tun: " + Error::message());
+		}
+
+		std::memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+		std::strncpy(ifr.ifr_name, args.empty() ? "hvx%d" : args.c_str(), IFNAMSIZ - 1);
+
+		if (::ioctl(tap, TUNSETIFF, &ifr) < 0 || ::ioctl(tap, TUNSETVNETHDRSZ, &size) < 0) {
+			std::string error = Error::message();
+			::close(tap);
+			throw std::runtime_error("Failed to set up tap device: " + error);
+		}
+		name = ifr.ifr_name;
+
+		/* Locally administered address in the range QEMU uses */
+		std::random_device random;
+		mac[0] = 0x52;
+		mac[1] = 0x54;
+		mac[2] = 0x00;
+		for (int i = 3; i < 6; i++) {
+			mac[i] = random() & 0xff;
+		}
+	}
+
+	~NetDevice() {
+		if (watching) {
+			getMainloop().removeEventSource(tap);
+		}
+		::close(tap);
+	}
+
+	auto getName() const -> std::string override {
+		return "net (" + name + ")";
+	}
+
+protected:
+	auto readConfig(std::uint64_t offset, void *data, unsigned int len) -> void override {
+		std::memset(data, 0, len);
+		if (offset < sizeof(mac)) {
+			std::memcpy(data, mac + offset, std::min<size_t>(len, sizeof(mac) - offset));
+		}
+	}
+
+	auto activate() -> void override {
+		if (watching) {
+			return;
+		}
+
+		getMainloop().addEventSource(tap, EPOLLIN | EPOLLET, [this](int fd, Mainloop::Event) {
+			std::lock_guard<std::mutex> guard(lock);
+			receive();
+		});
+		watching = true;
+	}
+
+	auto notify(unsigned int index) -> void override {
+		if (index == TX_QUEUE) {
+			transmit();
+		} else {
+			receive();
+		}
+	}
+
+private:
+	auto transmit() -> void {
+		VirtqChain chain;
+		bool used = false;
+
+		while (queue(TX_QUEUE).pop(getMemory(), chain)) {
+			/* Frames the tap device cannot take are dropped, as on a real link */
+			while (::writev(tap, chain.out.data(), chain.out.size()) < 0 && errno == EINTR) {
+			}
+			queue(TX_QUEUE).push(getMemory(), chain, 0);
+			used = true;
+		}
+
+		if (used) {
+			interrupt();
+		}
+	}
+
+	/* The tap fd is edge triggered, so read until it is empty or the guest has no buffers left */
+	auto receive() -> void {
+		VirtqChain chain;
+		bool used = false;
+
+		while (queue(RX_QUEUE).pop(getMemory(), chain)) {
+			ssize_t n = ::readv(tap, chain.in.data(), chain.in.size());
+			if (n < 0 && errno == EINTR) {
+				queue(RX_QUEUE).unpop();
+				continue;
+			}
+			if (n <= 0) {
+				queue(RX_QUEUE).unpop();
+				break;
+			}
+			queue(RX_QUEUE).push(getMemory(), chain, n);
+			used = true;
+		}
+
+		if (used) {
+			interrupt();
+		}
+	}
+
+private:
+	int tap;
+	std::string name;
+	std::uint8_t mac[6];
+	bool watching;
+};
+
+static DeviceRegistry::Registrar<NetDevice> registrar("net");
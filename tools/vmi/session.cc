@@ -9,12 +9,20 @@
 #include <unistd.h>
 
 #include <iostream>
+#include <algorithm>
 
 #include "vmi.h"
 #include "session.h"
 #include "fs.h"
 
-Session::Session() : device("/dev/hvx") {
+namespace {
+
+std::string devicePath = "/dev/hvx";
+
+} // namespace
+
+Session::Session(const std::shared_ptr<Mainloop>& loop) :
+	device(devicePath), domain(-1), domainId(-1), guest(nullptr), guestSize(0), mainloop(loop) {
 }
 
 Session::~Session() {
@@ -31,12 +39,61 @@ auto Session::hypercall(struct hvx_proto_hypercall *hc) -> int {
 	return ret;
 }
 
+/*
+ * Issues the hypercalls in batches of HVX_HYPERCALL_BATCH_MAX, one ioctl
+ * per batch. Returns the number of hypercalls executed.
+ */
+auto Session::hypercall(const std::vector<hvx_proto_hypercall>& calls,
+						std::vector<long>& results, bool stopOnError) -> int {
+	size_t done = 0;
+
+	results.assign(calls.size(), 0);
+
+	while (done < calls.size()) {
+		std::vector<__s64> batchResults(std::min<size_t>(calls.size() - done, HVX_HYPERCALL_BATCH_MAX));
+		struct hvx_proto_hypercall_batch batch = {
+			.count = batchResults.size(),
+			.entries = reinterpret_cast<__u64>(&calls[done]),
+			.results = reinterpret_cast<__u64>(batchResults.data()),
+			.flags = stopOnError ? HVX_BATCH_STOP_ON_ERROR : 0,
+		};
+
+		int ret = device.ioctl(HVX_IOCTL_HYPERCALL_BATCH, &batch);
+		if (ret < 0) {
+			std::cerr << "Hypercall batch failed " << std::endl;
+			return done ? done : ret;
+		}
+
+		for (int i = 0; i < ret; i++) {
+			results[done + i] = batchResults[i];
+		}
+		done += ret;
+
+		if (static_cast<size_t>(ret) < batchResults.size()) {
+			break;
+		}
+	}
+
+	return done;
+}
+
 auto Session::create() -> Session* {
-	Session* session = new Session();
-	session->create(true);
+	return create(std::make_shared<Mainloop>());
+}
+
+auto Session::create(const std::shared_ptr<Mainloop>& loop) -> Session* {
+	Session* session = new Session(loop);
+	if (session->create(true) < 0) {
+		delete session;
+		return nullptr;
+	}
 	return session;
 }
 
+auto Session::setDevicePath(const std::string& path) -> void {
+	devicePath = path;
+}
+
 auto Session::create(bool closeOnExit) -> int {
 	int flags;
 
@@ -56,13 +113,185 @@ auto Session::create(bool closeOnExit) -> int {
 }
 
 auto Session::dispose() -> void {
+	unmapGuest();
+	if (domain >= 0) {
+		::close(domain);
+		domain = -1;
+	}
 	device.close();
 }
 
+auto Session::createDomain(hvx_proto_domain_create& op) -> int {
+	if (domain >= 0) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	domain = device.ioctl(HVX_IOCTL_DOMAIN_CREATE, &op);
+	if (domain < 0) {
+		return -1;
+	}
+
+	domainId = op.id;
+
+	/* Without the persistent mapping every map() falls back to an mmap of its own */
+	void *map = ::mmap(NULL, op.memory, PROT_READ | PROT_WRITE, MAP_SHARED, domain, HVX_GUEST_RAM_BASE);
+	if (map != MAP_FAILED) {
+		guest = static_cast<char *>(map);
+		guestSize = op.memory;
+	}
+
+	return 0;
+}
+
+auto Session::cloneDomain(Session& parent, hvx_proto_domain_clone& op) -> int {
+	if (domain >= 0) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	domain = ::ioctl(parent.domain, HVX_IOCTL_DOMAIN_CLONE, &op);
+	if (domain < 0) {
+		return -1;
+	}
+
+	domainId = op.id;
+
+	/* A clone has as much memory as its template */
+	void *map = ::mmap(NULL, parent.guestSize, PROT_READ | PROT_WRITE, MAP_SHARED, domain, HVX_GUEST_RAM_BASE);
+	if (map != MAP_FAILED) {
+		guest = static_cast<char *>(map);
+		guestSize = parent.guestSize;
+	}
+
+	return 0;
+}
+
+auto Session::destroyDomain() -> int {
+	hvx_proto_domain_destroy op = {
+		.id = static_cast<__u64>(domainId),
+		.force = 0,
+	};
+
+	unmapGuest();
+
+	int ret = ::ioctl(domain, HVX_IOCTL_DOMAIN_DESTROY, &op);
+
+	::close(domain);
+	domain = -1;
+	domainId = -1;
+
+	return ret;
+}
+
+auto Session::populate(off_t addr, size_t len) -> int {
+	struct hvx_proto_memory op = {
+		.type = HVX_MEMORY_POPULATE,
+		.base = static_cast<__u64>(addr),
+		.size = len,
+	};
+
+	return ::ioctl(domain, HVX_IOCTL_MEMORY, &op);
+}
+
+auto Session::release(off_t addr, size_t len) -> long {
+	struct hvx_proto_memory op = {
+		.type = HVX_MEMORY_RELEASE,
+		.base = static_cast<__u64>(addr),
+		.size = len,
+	};
+
+	return ::ioctl(domain, HVX_IOCTL_MEMORY, &op);
+}
+
+auto Session::restore(off_t addr, const std::vector<__u64>& pages) -> int {
+	struct hvx_proto_memory_restore op = {
+		.base = static_cast<__u64>(addr),
+		.pages = reinterpret_cast<__u64>(pages.data()),
+		.count = pages.size(),
+		.flags = 0,
+	};
+
+	return ::ioctl(domain, HVX_IOCTL_MEMORY_RESTORE, &op);
+}
+
+auto Session::extents(std::vector<hvx_memory_extent>& ranges) -> int {
+	int ret;
+
+	/* The domain may gain extents between the calls, so ask until they fit */
+	do {
+		struct hvx_proto_memory_extents op = {
+			.count = ranges.size(),
+			.entries = reinterpret_cast<__u64>(ranges.data()),
+		};
+
+		ret = ::ioctl(domain, HVX_IOCTL_MEMORY_EXTENTS, &op);
+		if (ret < 0) {
+			return ret;
+		}
+
+		if (static_cast<size_t>(ret) <= ranges.size()) {
+			break;
+		}
+		ranges.resize(ret);
+	} while (true);
+
+	ranges.resize(ret);
+	return ret;
+}
+
+auto Session::pause(bool pause) -> int {
+	struct hvx_proto_domain_pause op = {
+		.pause = pause,
+	};
+
+	return ::ioctl(domain, HVX_IOCTL_DOMAIN_PAUSE, &op);
+}
+
+auto Session::dirtyLog(bool enable) -> int {
+	struct hvx_proto_dirty_log op = {
+		.op = static_cast<__u64>(enable ? HVX_DIRTY_LOG_ENABLE : HVX_DIRTY_LOG_DISABLE),
+	};
+
+	return ::ioctl(domain, HVX_IOCTL_DIRTY_LOG, &op);
+}
+
+auto Session::fetchDirty(off_t addr, size_t pages, std::vector<__u64>& bitmap) -> int {
+	bitmap.assign((pages + 63) / 64, 0);
+
+	struct hvx_proto_dirty_log op = {
+		.op = HVX_DIRTY_LOG_FETCH,
+		.base = static_cast<__u64>(addr),
+		.pages = pages,
+		.bitmap = reinterpret_cast<__u64>(bitmap.data()),
+	};
+
+	return ::ioctl(domain, HVX_IOCTL_DIRTY_LOG, &op);
+}
+
+auto Session::unmapGuest() -> void {
+	if (guest != nullptr) {
+		::munmap(guest, guestSize);
+		guest = nullptr;
+		guestSize = 0;
+	}
+}
+
 auto Session::map(off_t addr, size_t len) -> void* {
-	return device.mmap<void>(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED);
+	if (guest != nullptr && static_cast<unsigned long>(addr) >= HVX_GUEST_RAM_BASE &&
+		len <= guestSize && addr - HVX_GUEST_RAM_BASE <= guestSize - len) {
+		return guest + (addr - HVX_GUEST_RAM_BASE);
+	}
+
+	return ::mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, domain, addr);
 }
 
 auto Session::unmap(void *addr, size_t len) -> void {
-	device.munmap(addr, len);
+	char *ptr = static_cast<char *>(addr);
+
+	if (guest != nullptr && ptr >= guest && ptr < guest + guestSize) {
+		return;
+	}
+
+	::munmap(addr, len);
 }
@@ -2,6 +2,8 @@
 #include <iostream>
 #include <functional>
 #include <utility>
+#include <memory>
+#include <vector>
 
 #include "fs.h"
 #include "mainloop.h"
@@ -16,18 +18,38 @@ public:
     auto dispose() -> void;
 
 	static auto create() -> Session*;
+	static auto create(const std::shared_ptr<Mainloop>& loop) -> Session*;
+
+	/* Sessions created from now on open path instead of /dev/hvx */
+	static auto setDevicePath(const std::string& path) -> void;
 
 	auto create(bool closeOnExit) -> int;
 
     template<typename T>
     auto hypercall(int id, const T* param) -> int;
 
+	auto hypercall(const std::vector<hvx_proto_hypercall>& calls,
+				   std::vector<long>& results, bool stopOnError = false) -> int;
+
 	template<typename T>
 	auto ioctl(unsigned long cmd, T* param) -> int;
 
+	/* Domain scoped requests go to the fd returned by createDomain() */
+	template<typename T>
+	auto domainIoctl(unsigned long cmd, T* param) -> int;
+
+	auto createDomain(hvx_proto_domain_create& op) -> int;
+	/* Clone the domain of parent, which stays paused from now on */
+	auto cloneDomain(Session& parent, hvx_proto_domain_clone& op) -> int;
+	auto destroyDomain() -> int;
+
+	long getDomainId() const {
+		return domainId;
+	}
+
 	int addCallback(int fd, Callback&& callback) {
 		try {
-			mainloop.addEventSource(fd, EPOLLIN | EPOLLRDHUP,
+			mainloop->addEventSource(fd, EPOLLIN | EPOLLRDHUP,
 									[callback](int fd, Mainloop::Event) {
 				callback(fd);
 			});
@@ -38,21 +60,49 @@ public:
 		return 0;
 	}
 
+	void removeCallback(int fd) {
+		mainloop->removeEventSource(fd);
+	}
+
+	Mainloop& getMainloop() {
+		return *mainloop;
+	}
+
 	int eventloop(bool& stopped) {
-		mainloop.run(stopped);
+		mainloop->run(stopped);
 		return 0;
 	}
 
+	auto populate(off_t addr, size_t len) -> int;
+	auto release(off_t addr, size_t len) -> long;
+	/* Backs the granule at addr with the given pages, see HVX_IOCTL_MEMORY_RESTORE */
+	auto restore(off_t addr, const std::vector<__u64>& pages) -> int;
+	auto extents(std::vector<hvx_memory_extent>& ranges) -> int;
+	auto pause(bool pause) -> int;
+	/* See HVX_IOCTL_DIRTY_LOG; bitmap gets one bit per page from addr on */
+	auto dirtyLog(bool enable) -> int;
+	auto fetchDirty(off_t addr, size_t pages, std::vector<__u64>& bitmap) -> int;
+
+	/*
+	 * Guest RAM is mapped once when the domain is created, so map() of a
+	 * range inside it is a pointer add and unmap() of it does nothing.
+	 * Anything else gets a mapping of its own.
+	 */
 	void *map(off_t addr, size_t len);
 	void unmap(void *map, size_t len);
 
 protected:
-	Session();
+	Session(const std::shared_ptr<Mainloop>& loop);
 	auto hypercall(struct hvx_proto_hypercall *hc) -> int;
+	auto unmapGuest() -> void;
 
 private:
     File device;
-	Mainloop mainloop;
+	int domain;
+	long domainId;
+	char *guest;
+	size_t guestSize;
+	std::shared_ptr<Mainloop> mainloop;
 };
 
 template<typename T>
@@ -60,6 +110,11 @@ auto Session::ioctl(unsigned long cmd, T* param) -> int {
 	return device.ioctl(cmd, param);
 }
 
+template<typename T>
+auto Session::domainIoctl(unsigned long cmd, T* param) -> int {
+	return ::ioctl(domain, cmd, param);
+}
+
 template<typename T>
 auto Session::hypercall(int op, const T* param) -> int {
     struct hvx_proto_hypercall hc;
@@ -0,0 +1,239 @@
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include "error.h"
+#include "exception.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC		"HVXSNAP"
+#define SNAPSHOT_VERSION	1
+
+namespace {
+
+auto isZero(const char *page) -> bool {
+	const std::uint64_t *words = reinterpret_cast<const std::uint64_t *>(page);
+
+	for (size_t i = 0; i < Snapshot::PAGE / sizeof(*words); i++) {
+		if (words[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Pauses the domain for as long as it is in scope */
+class PauseGuard {
+public:
+	PauseGuard(Session* session) : session(session) {
+		if (session->pause(true) < 0) {
+			throw std::runtime_error("Failed to pause domain: " + Error::message());
+		}
+	}
+
+	~PauseGuard() {
+		session->pause(false);
+	}
+
+private:
+	Session* session;
+};
+
+} // namespace
+
+auto Snapshot::save(Session* session, const std::vector<std::unique_ptr<Vcpu>>& vcpus,
+					size_t memory, const std::string& path, const Snapshot* source) -> void {
+	PauseGuard pause(session);
+	std::vector<hvx_vcpu_state> states(vcpus.size());
+	std::vector<hvx_memory_extent> ranges;
+	std::vector<std::pair<void *, size_t>> maps;
+	size_t pageCount = (memory + PAGE - 1) / PAGE;
+	std::vector<std::uint32_t> pageMap(pageCount, 0);
+	std::vector<const char *> pages(pageCount, nullptr);
+	std::vector<const char *> data;
+
+	if (source && source->getMemory() != memory) {
+		throw std::runtime_error("Domain does not match the snapshot it was restored from");
+	}
+
+	for (size_t i = 0; i < vcpus.size(); i++) {
+		if (vcpus[i]->getState(states[i]) < 0) {
+			throw std::runtime_error("Failed to get the state of vcpu" + std::to_string(i) + ": " + Error::message());
+		}
+	}
+
+	if (session->extents(ranges) < 0) {
+		throw std::runtime_error("Failed to get guest memory extents: " + Error::message());
+	}
+
+	/* Granules that were never restored are still what the source has */
+	if (source) {
+		for (size_t index = 0; index < pageCount; index++) {
+			pages[index] = source->page(index);
+		}
+	}
+
+	/* Only backed memory is looked at, so lazy domains stay small */
+	for (auto& range : ranges) {
+		if (range.flags & HVX_EXTENT_ADOPTED) {
+			for (auto& m : maps) {
+				session->unmap(m.first, m.second);
+			}
+			throw std::runtime_error("Domains with shared images cannot be saved");
+		}
+
+		void *ptr = session->map(range.base, range.size);
+		if (ptr == MAP_FAILED) {
+			for (auto& m : maps) {
+				session->unmap(m.first, m.second);
+			}
+			throw std::runtime_error("Failed to map guest memory: " + Error::message());
+		}
+		maps.emplace_back(ptr, range.size);
+
+		for (size_t offset = 0; offset < range.size; offset += PAGE) {
+			size_t index = (range.base - HVX_GUEST_RAM_BASE + offset) / PAGE;
+
+			if (index >= pageCount) {
+				break;
+			}
+			pages[index] = static_cast<const char *>(ptr) + offset;
+		}
+	}
+
+	for (size_t index = 0; index < pageCount; index++) {
+		if (pages[index] != nullptr && !isZero(pages[index])) {
+			data.push_back(pages[index]);
+			pageMap[index] = data.size();
+		}
+	}
+
+	SnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.vcpus = vcpus.size();
+	header.memory = memory;
+	header.pages = data.size();
+
+	size_t metadata = sizeof(header) + states.size() * sizeof(hvx_vcpu_state) + pageMap.size() * sizeof(std::uint32_t);
+	header.dataOffset = (metadata + PAGE - 1) & ~(PAGE - 1);
+
+	/* Written aside and renamed over path, which source may still map */
+	std::string temporary = path + ".tmp";
+
+	try {
+		File out(temporary);
+		std::vector<char> padding(header.dataOffset - metadata, 0);
+
+		out.create(0644);
+		out.write(&header, sizeof(header));
+		out.write(states.data(), states.size() * sizeof(hvx_vcpu_state));
+		out.write(pageMap.data(), pageMap.size() * sizeof(std::uint32_t));
+		out.write(padding.data(), padding.size());
+
+		/* Pages that follow each other in guest memory go out in one write */
+		for (size_t i = 0, run; i < data.size(); i += run) {
+			for (run = 1; i + run < data.size() && data[i + run] == data[i] + run * PAGE; run++) {
+			}
+			out.write(data[i], run * PAGE);
+		}
+
+		if (::rename(temporary.c_str(), path.c_str()) < 0) {
+			throw std::runtime_error(Error::message());
+		}
+	} catch (std::exception& e) {
+		::unlink(temporary.c_str());
+		for (auto& m : maps) {
+			session->unmap(m.first, m.second);
+		}
+		throw std::runtime_error("Failed to write " + path + ": " + e.what());
+	}
+
+	for (auto& m : maps) {
+		session->unmap(m.first, m.second);
+	}
+}
+
+Snapshot::Snapshot(const std::string& path) :
+	file(path), size(0), map(nullptr), header(nullptr), states(nullptr), pageMap(nullptr), pageCount(0)
+{
+	file.open(O_RDONLY | O_CLOEXEC);
+	size = file.size();
+
+	if (size < sizeof(SnapshotHeader)) {
+		throw std::runtime_error(path + ": not a snapshot");
+	}
+
+	void *ptr = file.mmap<void>(0, size, PROT_READ, MAP_SHARED);
+	if (ptr == MAP_FAILED) {
+		throw std::runtime_error("Failed to map " + path + ": " + Error::message());
+	}
+	map = static_cast<const char *>(ptr);
+	header = reinterpret_cast<const SnapshotHeader *>(map);
+
+	pageCount = (header->memory + PAGE - 1) / PAGE;
+	size_t metadata = sizeof(SnapshotHeader) + header->vcpus * sizeof(hvx_vcpu_state) +
+					  pageCount * sizeof(std::uint32_t);
+
+	if (std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+		header->version != SNAPSHOT_VERSION || header->vcpus == 0 ||
+		header->dataOffset < metadata || header->dataOffset % PAGE != 0 ||
+		header->dataOffset + header->pages * PAGE > size) {
+		file.munmap(const_cast<char *>(map), size);
+		throw std::runtime_error(path + ": not a snapshot or corrupted");
+	}
+
+	states = reinterpret_cast<const hvx_vcpu_state *>(map + sizeof(SnapshotHeader));
+	pageMap = reinterpret_cast<const std::uint32_t *>(states + header->vcpus);
+}
+
+Snapshot::~Snapshot() {
+	file.munmap(const_cast<char *>(map), size);
+}
+
+auto Snapshot::page(size_t index) const -> const char * {
+	std::uint32_t n = index < pageCount ? pageMap[index] : 0;
+
+	if (n == 0 || n > header->pages) {
+		return nullptr;
+	}
+	return map + header->dataOffset + (n - 1) * PAGE;
+}
+
+auto Snapshot::restore(Session* session, std::uint64_t addr) const -> int {
+	if (addr < HVX_GUEST_RAM_BASE || addr - HVX_GUEST_RAM_BASE >= header->memory) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	size_t first = (addr - HVX_GUEST_RAM_BASE) / GRANULE * (GRANULE / PAGE);
+	std::vector<__u64> pages(std::min(GRANULE / PAGE, pageCount - first), 0);
+
+	for (size_t i = 0; i < pages.size(); i++) {
+		pages[i] = reinterpret_cast<__u64>(page(first + i));
+	}
+
+	return session->restore(addr, pages);
+}
+
+auto Snapshot::restoreAll(Session* session) const -> int {
+	for (size_t first = 0; first < pageCount; first += GRANULE / PAGE) {
+		size_t last = std::min(first + GRANULE / PAGE, pageCount);
+
+		if (std::all_of(pageMap + first, pageMap + last, [](std::uint32_t n) { return n == 0; })) {
+			continue;
+		}
+
+		if (restore(session, HVX_GUEST_RAM_BASE + first * PAGE) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "fs.h"
+#include "session.h"
+#include "vcpu.h"
+
+/*
+ * A snapshot file holds, in this order:
+ *  - the header
+ *  - a struct hvx_vcpu_state for every vcpu
+ *  - one std::uint32_t per guest page: 0 if the page is not backed or
+ *    only holds zeroes, n if it is the nth page of the data section
+ *  - the data section, page aligned so that the file can be mapped and
+ *    handed to the driver as is
+ */
+struct SnapshotHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t vcpus;
+	std::uint64_t memory;
+	std::uint64_t pages;
+	std::uint64_t dataOffset;
+};
+
+class Snapshot {
+public:
+	static constexpr size_t PAGE = 4096;
+	/* What the driver populates at once on a stage-2 fault */
+	static constexpr size_t GRANULE = HVX_RESTORE_PAGES * PAGE;
+
+	/*
+	 * Pauses the domain, writes its memory and vcpu state to path and
+	 * lets it run again. Throws on failure. A domain restored lazily from
+	 * source takes the granules it never touched from there; path may be
+	 * the file source was opened from.
+	 */
+	static auto save(Session* session, const std::vector<std::unique_ptr<Vcpu>>& vcpus,
+					 size_t memory, const std::string& path, const Snapshot* source = nullptr) -> void;
+
+	Snapshot(const std::string& path);
+	~Snapshot();
+
+	Snapshot(const Snapshot&) = delete;
+	Snapshot& operator=(const Snapshot&) = delete;
+
+	auto getVcpus() const -> unsigned int {
+		return header->vcpus;
+	}
+
+	auto getMemory() const -> size_t {
+		return header->memory;
+	}
+
+	auto getState(unsigned int vcpu) const -> const hvx_vcpu_state& {
+		return states[vcpu];
+	}
+
+	/*
+	 * Backs the granule holding addr with what the snapshot has for it.
+	 * addr is the faulting address, the only page that counts as dirty.
+	 */
+	auto restore(Session* session, std::uint64_t addr) const -> int;
+	/* Restores every granule that holds data, zero granules stay unbacked */
+	auto restoreAll(Session* session) const -> int;
+
+private:
+	/* The data of a guest page, nullptr if the snapshot has none */
+	auto page(size_t index) const -> const char *;
+
+private:
+	File file;
+	size_t size;
+	const char *map;
+	const SnapshotHeader *header;
+	const hvx_vcpu_state *states;
+	const std::uint32_t *pageMap;
+	size_t pageCount;
+};
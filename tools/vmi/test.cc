@@ -0,0 +1,204 @@
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+#include "types.h"
+#include "session.h"
+#include "error.h"
+#include "mainloop.h"
+#include "vcpu.h"
+#include "snapshot.h"
+#include "mock.h"
+
+/*
+ * Functional tests of the userspace half of vmi, run against the mock
+ * device. Every test returns 0 on success and prints what went wrong
+ * otherwise.
+ */
+
+namespace {
+
+constexpr size_t GRANULES = 4;
+constexpr size_t MEMORY = GRANULES * Snapshot::GRANULE;
+
+define granule(size_t n) -> std::uint64_t {
+	return HVX_GUEST_RAM_BASE + n * Snapshot::GRANULE;
+}
+
+/* A domain with one vcpu, whose memory the test fills in through restore() */
+class Domain {
+public:
+	Domain() : mainloop(std::make_shared<Mainloop>()) {}
+
+	~Domain() {
+		vcpus.clear();
+		if (session) {
+			session->destroyDomain();
+		}
+	}
+
+	define create() -> int {
+		hvx_proto_domain_create op = {
+			.vcpus = 1,
+			.memory = MEMORY,
+			.flags = HVX_DOMAIN_LAZY,
+		};
+
+		session.reset(Session::create(mainloop));
+		if (!session || session->createDomain(op) < 0) {
+			std::cerr << "Failed to create domain: " << Error::message() << std::endl;
+			return -1;
+		}
+
+		vcpus.emplace_back(new Vcpu(session.get(), 0, 0));
+		return vcpus.back()->start(0, *mainloop) < 0 ? -1 : 0;
+	}
+
+	define memory(std::uint64_t addr) -> char * {
+		return static_cast<char *>(session->map(addr, Snapshot::PAGE));
+	}
+
+	std::shared_ptr<Mainloop> mainloop;
+	std::unique_ptr<Session> session;
+	std::vector<std::unique_ptr<Vcpu>> vcpus;
+};
+
+define check(bool condition, const std::string& what) -> bool {
+	if (!condition) {
+		std::cerr << "  " << what << std::endl;
+	}
+	return condition;
+}
+
+/*
+ * Granules a lazily restored domain never touched must survive a save,
+ * they are only in the snapshot it was restored from.
+ */
+define testRestoreSaveRestore(const std::string& dir) -> int {
+	std::string first = dir + "/first", second = dir + "/second";
+	std::vector<char> pattern(Snapshot::GRANULE);
+	bool ok = true;
+
+	for (size_t i = 0; i < pattern.size(); i++) {
+		pattern[i] = static_cast<char>(i / Snapshot::PAGE + 1);
+	}
+
+	{
+		Domain domain;
+		std::vector<__u64> pages(HVX_RESTORE_PAGES);
+
+		if (domain.create() < 0) {
+			return -1;
+		}
+		for (size_t i = 0; i < pages.size(); i++) {
+			pages[i] = reinterpret_cast<__u64>(pattern.data() + i * Snapshot::PAGE);
+		}
+		if (domain.session->restore(granule(0), pages) < 0 ||
+			domain.session->restore(granule(2), pages) < 0) {
+			std::cerr << "Failed to fill in domain: " << Error::message() << std::endl;
+			return -1;
+		}
+		Snapshot::save(domain.session.get(), domain.vcpus, MEMORY, first);
+	}
+
+	{
+		Domain domain;
+		Snapshot source(first);
+
+		/* Only granule 0 is touched, granule 2 stays in the source */
+		if (domain.create() < 0 || source.restore(domain.session.get(), granule(0) + 3 * Snapshot::PAGE) < 0) {
+			return -1;
+		}
+		domain.memory(granule(0))[0] = 'x';
+		Snapshot::save(domain.session.get(), domain.vcpus, MEMORY, second, &source);
+	}
+
+	/* Saved over the file it was restored from, which must still be readable */
+	{
+		Domain domain;
+		Snapshot source(second);
+
+		if (domain.create() < 0 || source.restore(domain.session.get(), granule(2)) < 0) {
+			return -1;
+		}
+		Snapshot::save(domain.session.get(), domain.vcpus, MEMORY, second, &source);
+	}
+
+	{
+		Domain domain;
+		Snapshot snapshot(second);
+
+		if (domain.create() < 0 || snapshot.restoreAll(domain.session.get()) < 0) {
+			return -1;
+		}
+
+		ok &= check(domain.memory(granule(0))[0] == 'x', "write to granule 0 lost");
+		ok &= check(std::memcmp(domain.memory(granule(0)) + 1, pattern.data() + 1, Snapshot::PAGE - 1) == 0,
+					"granule 0 corrupted");
+		for (size_t page = 0; page < HVX_RESTORE_PAGES; page++) {
+			if (std::memcmp(domain.memory(granule(2) + page * Snapshot::PAGE),
+							pattern.data() + page * Snapshot::PAGE, Snapshot::PAGE) != 0) {
+				ok &= check(false, "untouched granule 2 lost, page " + std::to_string(page));
+				break;
+			}
+		}
+		ok &= check(domain.memory(granule(1))[0] == 0 && domain.memory(granule(3))[0] == 0,
+					"unbacked granules not zero");
+	}
+
+	::unlink(first.c_str());
+	::unlink(second.c_str());
+
+	return ok ? 0 : -1;
+}
+
+struct Test {
+	const char *name;
+	int (*run)(const std::string& dir);
+};
+
+const Test tests[] = {
+	{ "restore-save-restore", testRestoreSaveRestore },
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+	char dir[] = "/tmp/vmi-test.XXXXXX";
+	int failed = 0;
+
+	try {
+		MockHvx::install();
+	} catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (::mkdtemp(dir) == nullptr) {
+		std::cerr << "Failed to create " << dir << ": " << Error::message() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	for (auto& test : tests) {
+		int ret;
+
+		try {
+			ret = test.run(dir);
+		} catch (std::exception& e) {
+			std::cerr << "  " << e.what() << std::endl;
+			ret = -1;
+		}
+
+		std::cout << (ret < 0 ? "FAIL " : "PASS ") << test.name << std::endl;
+		failed += ret < 0;
+	}
+
+	::rmdir(dir);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "error.h"
+#include "timer.h"
+#include "exception.h"
+
+Timer::Timer(int flags) {
+	fd = ::timerfd_create(CLOCK_MONOTONIC, flags);
+	if (fd == -1) {
+		throw std::runtime_error(Error::message());
+	}
+}
+
+Timer::~Timer() {
+	if (fd != -1) {
+		::close(fd);
+	}
+}
+
+auto Timer::start(std::chrono::milliseconds interval) -> void {
+	struct itimerspec spec;
+
+	spec.it_interval.tv_sec = interval.count() / 1000;
+	spec.it_interval.tv_nsec = (interval.count() % 1000) * 1000000;
+	spec.it_value = spec.it_interval;
+
+	if (::timerfd_settime(fd, 0, &spec, nullptr) == -1) {
+		throw std::runtime_error(Error::message());
+	}
+}
+
+auto Timer::stop() -> void {
+	struct itimerspec spec = {};
+
+	if (::timerfd_settime(fd, 0, &spec, nullptr) == -1) {
+		throw std::runtime_error(Error::message());
+	}
+}
+
+/* Returns the number of expirations since the last call */
+auto Timer::receive() -> std::uint64_t {
+	std::uint64_t val = 0;
+	if (::read(fd, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+		throw std::runtime_error(Error::message());
+	}
+	return val;
+}
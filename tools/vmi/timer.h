@@ -0,0 +1,26 @@
+#pragma once
+
+#include <sys/timerfd.h>
+
+#include <chrono>
+#include <cstdint>
+
+class Timer {
+public:
+	Timer(int flags = TFD_NONBLOCK | TFD_CLOEXEC);
+	~Timer();
+
+	Timer(const Timer&) = delete;
+	Timer& operator=(const Timer&) = delete;
+
+	auto start(std::chrono::milliseconds interval) -> void;
+	auto stop() -> void;
+	auto receive() -> std::uint64_t;
+
+	auto getFd() const -> int {
+		return fd;
+	}
+
+private:
+	int fd;
+};
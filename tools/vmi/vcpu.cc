@@ -0,0 +1,143 @@
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include "error.h"
+#include "vcpu.h"
+
+Vcpu::Vcpu(Session* session, unsigned int id, unsigned int affinity) :
+	session(session), id(id), affinity(affinity),
+	event(0, EFD_NONBLOCK | EFD_CLOEXEC), handle(-1), mainloop(nullptr), ring(nullptr), stats(nullptr)
+{
+}
+
+Vcpu::~Vcpu()
+{
+	stop();
+}
+
+auto Vcpu::start(unsigned long entry, Mainloop& loop) -> int {
+	hvx_proto_vcpu_context ioc_vcpu = {
+		.entry = entry,
+		.affinity = affinity,
+		.contextid = id,
+		.eventfd = static_cast<__u64>(event.getFd()),
+	};
+
+	handle = session->domainIoctl(HVX_IOCTL_VCPU_CONTEXT, &ioc_vcpu);
+	if (handle < 0) {
+		std::cerr << "Failed to start vcpu" << id << ": " << Error::message() << std::endl;
+		return -1;
+	}
+
+	void *map = ::mmap(nullptr, sizeof(hvx_exit_ring), PROT_READ | PROT_WRITE, MAP_SHARED,
+					   handle, HVX_VCPU_RING_OFFSET);
+	if (map == MAP_FAILED) {
+		std::cerr << "Failed to map exit ring of vcpu" << id << ": " << Error::message() << std::endl;
+		stop();
+		return -1;
+	}
+	ring = static_cast<hvx_exit_ring *>(map);
+
+	map = ::mmap(nullptr, sizeof(hvx_vcpu_stats), PROT_READ, MAP_SHARED,
+				 handle, HVX_VCPU_STATS_OFFSET * ::sysconf(_SC_PAGESIZE));
+	if (map == MAP_FAILED) {
+		std::cerr << "Failed to map statistics of vcpu" << id << ": " << Error::message() << std::endl;
+		stop();
+		return -1;
+	}
+	stats = static_cast<const hvx_vcpu_stats *>(map);
+
+	loop.addEventSource(event.getFd(), EPOLLIN, [this](int fd, Mainloop::Event) {
+		handleEvent();
+	});
+	mainloop = &loop;
+
+	return handle;
+}
+
+auto Vcpu::stop() -> void {
+	if (mainloop != nullptr) {
+		mainloop->removeEventSource(event.getFd());
+		mainloop = nullptr;
+	}
+
+	if (ring != nullptr) {
+		::munmap(ring, sizeof(hvx_exit_ring));
+		ring = nullptr;
+	}
+
+	if (stats != nullptr) {
+		::munmap(const_cast<hvx_vcpu_stats *>(stats), sizeof(hvx_vcpu_stats));
+		stats = nullptr;
+	}
+
+	if (handle >= 0) {
+		::close(handle);
+		handle = -1;
+	}
+}
+
+auto Vcpu::handleEvent() -> void {
+	event.receive();
+	drain();
+}
+
+/*
+ * The driver only signals the eventfd once we have caught up with the
+ * records it told us about, so keep draining until head stays put after
+ * tail has been published.
+ */
+auto Vcpu::drain() -> void {
+	std::uint32_t tail = ring->tail;
+
+	while (true) {
+		std::uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		while (tail != head) {
+			hvx_exit& exit = ring->entries[tail % HVX_EXIT_RING_ENTRIES];
+			if (exitHandler) {
+				exitHandler(*this, exit);
+			}
+			tail++;
+		}
+
+		/* Tells the driver how long this batch took to handle */
+		struct timespec now;
+		::clock_gettime(CLOCK_MONOTONIC, &now);
+		__atomic_store_n(&ring->acked, now.tv_sec * 1000000000ULL + now.tv_nsec, __ATOMIC_RELAXED);
+
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+			break;
+		}
+	}
+}
+
+auto Vcpu::getStatistics() const -> hvx_vcpu_stats {
+	hvx_vcpu_stats snapshot;
+
+	if (stats == nullptr) {
+		std::memset(&snapshot, 0, sizeof(snapshot));
+		return snapshot;
+	}
+
+	/* The driver updates the counters behind our back; tearing between them is fine */
+	std::memcpy(&snapshot, stats, sizeof(snapshot));
+	return snapshot;
+}
+
+auto Vcpu::getState(hvx_vcpu_state& state) const -> int {
+	return ::ioctl(handle, HVX_IOCTL_VCPU_GET_STATE, &state);
+}
+
+auto Vcpu::setState(const hvx_vcpu_state& state) -> int {
+	return ::ioctl(handle, HVX_IOCTL_VCPU_SET_STATE, &state);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <functional>
+
+#include "eventfd.h"
+#include "mainloop.h"
+#include "session.h"
+
+class Vcpu {
+public:
+	typedef std::function<void(Vcpu& vcpu, hvx_exit& exit)> ExitHandler;
+
+	Vcpu(Session* session, unsigned int id, unsigned int affinity);
+	~Vcpu();
+
+	Vcpu(const Vcpu&) = delete;
+	Vcpu& operator=(const Vcpu&) = delete;
+
+	auto start(unsigned long entry, Mainloop& loop) -> int;
+	auto stop() -> void;
+
+	auto setExitHandler(ExitHandler&& handler) -> void {
+		exitHandler = std::move(handler);
+	}
+
+	auto getId() const -> unsigned int {
+		return id;
+	}
+
+	auto getAffinity() const -> unsigned int {
+		return affinity;
+	}
+
+	/* CLOCK_MONOTONIC time in ns at which the driver last signalled us */
+	auto getSignalled() const -> __u64 {
+		return ring ? __atomic_load_n(&ring->signalled, __ATOMIC_RELAXED) : 0;
+	}
+
+	/* Snapshot of the counters the driver keeps for this vcpu */
+	auto getStatistics() const -> hvx_vcpu_stats;
+
+	/* Architectural state, only while the domain is paused */
+	auto getState(hvx_vcpu_state& state) const -> int;
+	auto setState(const hvx_vcpu_state& state) -> int;
+
+private:
+	auto handleEvent() -> void;
+	auto drain() -> void;
+
+private:
+	Session* session;
+	unsigned int id;
+	unsigned int affinity;
+	IoEvent event;
+	int handle;
+	Mainloop* mainloop;
+	hvx_exit_ring* ring;
+	const hvx_vcpu_stats* stats;
+	ExitHandler exitHandler;
+};
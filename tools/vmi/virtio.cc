@@ -0,0 +1,417 @@
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+#include "error.h"
+#include "exception.h"
+#include "virtio.h"
+
+/* virtio-mmio registers */
+#define VIRTIO_MMIO_MAGIC_VALUE			0x000
+#define VIRTIO_MMIO_VERSION				0x004
+#define VIRTIO_MMIO_DEVICE_ID			0x008
+#define VIRTIO_MMIO_VENDOR_ID			0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES		0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL	0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES		0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL	0x024
+#define VIRTIO_MMIO_QUEUE_SEL			0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX		0x034
+#define VIRTIO_MMIO_QUEUE_NUM			0x038
+#define VIRTIO_MMIO_QUEUE_READY			0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY		0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS	0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK		0x064
+#define VIRTIO_MMIO_STATUS				0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW		0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH		0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW	0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH	0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW	0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION	0x0fc
+#define VIRTIO_MMIO_CONFIG				0x100
+
+#define VIRTIO_MMIO_MAGIC				0x74726976
+#define VIRTIO_MMIO_VENDOR				0x00585648	/* "HVX" */
+
+static auto setLow(std::uint64_t& reg, std::uint64_t value) -> void {
+	reg = (reg & ~0xffffffffULL) | (value & 0xffffffffULL);
+}
+
+static auto setHigh(std::uint64_t& reg, std::uint64_t value) -> void {
+	reg = (reg & 0xffffffffULL) | (value << 32);
+}
+
+auto VirtqChain::length(const std::vector<iovec>& iov) -> size_t {
+	size_t total = 0;
+	for (auto& v : iov) {
+		total += v.iov_len;
+	}
+	return total;
+}
+
+auto VirtqChain::slice(const std::vector<iovec>& iov, size_t offset, size_t len) -> std::vector<iovec> {
+	std::vector<iovec> result;
+
+	for (auto& v : iov) {
+		if (len == 0) {
+			break;
+		}
+		if (offset >= v.iov_len) {
+			offset -= v.iov_len;
+			continue;
+		}
+
+		size_t part = std::min(v.iov_len - offset, len);
+		result.push_back({static_cast<char *>(v.iov_base) + offset, part});
+		len -= part;
+		offset = 0;
+	}
+
+	return result;
+}
+
+auto VirtqChain::copyFrom(const std::vector<iovec>& iov, size_t offset, void *buffer, size_t len) -> size_t {
+	size_t copied = 0;
+
+	for (auto& v : slice(iov, offset, len)) {
+		std::memcpy(static_cast<char *>(buffer) + copied, v.iov_base, v.iov_len);
+		copied += v.iov_len;
+	}
+
+	return copied;
+}
+
+auto VirtqChain::copyTo(const std::vector<iovec>& iov, size_t offset, const void *buffer, size_t len) -> size_t {
+	size_t copied = 0;
+
+	for (auto& v : slice(iov, offset, len)) {
+		std::memcpy(v.iov_base, static_cast<const char *>(buffer) + copied, v.iov_len);
+		copied += v.iov_len;
+	}
+
+	return copied;
+}
+
+Virtqueue::Virtqueue() {
+	reset();
+}
+
+auto Virtqueue::reset() -> void {
+	size = MAX_SIZE;
+	ready = false;
+	desc = driver = device = 0;
+	lastAvail = 0;
+}
+
+/*
+ * Chains with a descriptor outside guest RAM are consumed and returned
+ * empty, so that a broken driver cannot make us spin on them.
+ */
+auto Virtqueue::pop(const GuestMemory& memory, VirtqChain& chain) -> bool {
+	if (!ready || size == 0) {
+		return false;
+	}
+
+	auto avail = memory.translate<std::uint16_t>(driver, 2 + size);
+	auto table = memory.translate<VirtqDesc>(desc, size);
+	if (avail == nullptr || table == nullptr) {
+		return false;
+	}
+
+	while (__atomic_load_n(&avail[1], __ATOMIC_ACQUIRE) != lastAvail) {
+		chain.head = avail[2 + lastAvail % size];
+		chain.out.clear();
+		chain.in.clear();
+		lastAvail++;
+
+		std::uint16_t i = chain.head;
+		for (unsigned int n = 0; n < size && i < size; n++) {
+			const VirtqDesc& d = table[i];
+			void *ptr = memory.translate(d.addr, d.len);
+			if (ptr == nullptr) {
+				break;
+			}
+
+			(d.flags & VIRTQ_DESC_F_WRITE ? chain.in : chain.out).push_back({ptr, d.len});
+			if (!(d.flags & VIRTQ_DESC_F_NEXT)) {
+				return true;
+			}
+			i = d.next;
+		}
+
+		std::cerr << "virtqueue: invalid descriptor chain " << chain.head << std::endl;
+		push(memory, chain, 0);
+	}
+
+	return false;
+}
+
+auto Virtqueue::unpop() -> void {
+	lastAvail--;
+}
+
+auto Virtqueue::push(const GuestMemory& memory, const VirtqChain& chain, std::uint32_t len) -> void {
+	auto used = memory.translate<std::uint16_t>(device, 2);
+	auto ring = memory.translate<VirtqUsedElem>(device + 4, size);
+	if (used == nullptr || ring == nullptr) {
+		return;
+	}
+
+	std::uint16_t idx = used[1];
+	ring[idx % size].id = chain.head;
+	ring[idx % size].len = len;
+	__atomic_store_n(&used[1], static_cast<std::uint16_t>(idx + 1), __ATOMIC_RELEASE);
+}
+
+VirtioDevice::VirtioDevice(std::uint32_t deviceId, unsigned int queues, std::uint64_t features) :
+	deviceId(deviceId), features(features | VIRTIO_F_VERSION_1), driverFeatures(0),
+	deviceFeaturesSel(0), driverFeaturesSel(0), queueSel(0), interruptStatus(0), status(0),
+	queues(queues), session(nullptr), memory(nullptr), mainloop(nullptr), base(0), irq(0)
+{
+}
+
+VirtioDevice::~VirtioDevice() {
+	detach();
+}
+
+auto VirtioDevice::attach(Session* session, const GuestMemory* memory, Mainloop& loop,
+						  std::uint64_t base, unsigned int irq) -> void {
+	this->session = session;
+	this->memory = memory;
+	this->mainloop = &loop;
+	this->base = base;
+	this->irq = irq;
+
+	irqfd.reset(new IoEvent(0, EFD_NONBLOCK | EFD_CLOEXEC));
+	hvx_proto_irqfd ioc_irqfd = {
+		.fd = irqfd->getFd(),
+		.irq = irq,
+		.flags = 0,
+	};
+	if (session->domainIoctl(HVX_IOCTL_IRQFD, &ioc_irqfd) < 0) {
+		irqfd.reset();
+		throw std::runtime_error("Failed to attach irq of " + getName() + ": " + Error::message());
+	}
+
+	/* Without an ioeventfd the notification still arrives as an MMIO exit */
+	for (unsigned int q = 0; q < queues.size(); q++) {
+		std::unique_ptr<IoEvent> notifier(new IoEvent(0, EFD_NONBLOCK | EFD_CLOEXEC));
+		hvx_proto_ioeventfd ioc_ioeventfd = {
+			.addr = base + VIRTIO_MMIO_QUEUE_NOTIFY,
+			.len = 4,
+			.fd = notifier->getFd(),
+			.datamatch = q,
+			.flags = HVX_IOEVENTFD_DATAMATCH,
+		};
+		if (session->domainIoctl(HVX_IOCTL_IOEVENTFD, &ioc_ioeventfd) < 0) {
+			std::cerr << getName() << ": no ioeventfd for queue " << q << ": " << Error::message() << std::endl;
+			notifiers.emplace_back(nullptr);
+			continue;
+		}
+
+		loop.addEventSource(notifier->getFd(), EPOLLIN, [this, q](int fd, Mainloop::Event) {
+			notifiers[q]->receive();
+			kick(q);
+		});
+		notifiers.push_back(std::move(notifier));
+	}
+}
+
+auto VirtioDevice::detach() -> void {
+	if (session == nullptr) {
+		return;
+	}
+
+	for (unsigned int q = 0; q < notifiers.size(); q++) {
+		if (!notifiers[q]) {
+			continue;
+		}
+
+		mainloop->removeEventSource(notifiers[q]->getFd());
+		hvx_proto_ioeventfd ioc_ioeventfd = {
+			.addr = base + VIRTIO_MMIO_QUEUE_NOTIFY,
+			.len = 4,
+			.fd = notifiers[q]->getFd(),
+			.datamatch = q,
+			.flags = HVX_IOEVENTFD_DATAMATCH | HVX_IOEVENTFD_DEASSIGN,
+		};
+		session->domainIoctl(HVX_IOCTL_IOEVENTFD, &ioc_ioeventfd);
+	}
+	notifiers.clear();
+
+	if (irqfd) {
+		hvx_proto_irqfd ioc_irqfd = {
+			.fd = irqfd->getFd(),
+			.irq = irq,
+			.flags = HVX_IRQFD_DEASSIGN,
+		};
+		session->domainIoctl(HVX_IOCTL_IRQFD, &ioc_irqfd);
+		irqfd.reset();
+	}
+
+	session = nullptr;
+}
+
+auto VirtioDevice::interrupt(std::uint32_t reason) -> void {
+	interruptStatus |= reason;
+	if (irqfd) {
+		irqfd->send();
+	}
+}
+
+auto VirtioDevice::kick(unsigned int index) -> void {
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (index < queues.size() && queues[index].ready && isActive()) {
+		notify(index);
+	}
+}
+
+auto VirtioDevice::resetDevice() -> void {
+	reset();
+
+	status = 0;
+	interruptStatus = 0;
+	driverFeatures = 0;
+	deviceFeaturesSel = driverFeaturesSel = queueSel = 0;
+	for (auto& q : queues) {
+		q.reset();
+	}
+}
+
+auto VirtioDevice::readConfig(std::uint64_t offset, void *data, unsigned int len) -> void {
+	std::memset(data, 0, len);
+}
+
+auto VirtioDevice::writeConfig(std::uint64_t offset, const void *data, unsigned int len) -> void {
+}
+
+auto VirtioDevice::read(std::uint64_t offset, unsigned int len) -> std::uint64_t {
+	std::lock_guard<std::mutex> guard(lock);
+	std::uint64_t value = 0;
+
+	if (offset >= VIRTIO_MMIO_CONFIG) {
+		readConfig(offset - VIRTIO_MMIO_CONFIG, &value, std::min<unsigned int>(len, sizeof(value)));
+		return value;
+	}
+
+	if (len != 4) {
+		return 0;
+	}
+
+	Virtqueue* q = queueSel < queues.size() ? &queues[queueSel] : nullptr;
+
+	switch (offset) {
+	case VIRTIO_MMIO_MAGIC_VALUE:
+		return VIRTIO_MMIO_MAGIC;
+	case VIRTIO_MMIO_VERSION:
+		return 2;
+	case VIRTIO_MMIO_DEVICE_ID:
+		return deviceId;
+	case VIRTIO_MMIO_VENDOR_ID:
+		return VIRTIO_MMIO_VENDOR;
+	case VIRTIO_MMIO_DEVICE_FEATURES:
+		return deviceFeaturesSel < 2 ? (features >> (32 * deviceFeaturesSel)) & 0xffffffff : 0;
+	case VIRTIO_MMIO_QUEUE_NUM_MAX:
+		return q ? Virtqueue::MAX_SIZE : 0;
+	case VIRTIO_MMIO_QUEUE_READY:
+		return q ? q->ready : 0;
+	case VIRTIO_MMIO_INTERRUPT_STATUS:
+		return interruptStatus;
+	case VIRTIO_MMIO_STATUS:
+		return status;
+	case VIRTIO_MMIO_CONFIG_GENERATION:
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+auto VirtioDevice::write(std::uint64_t offset, std::uint64_t value, unsigned int len) -> void {
+	std::unique_lock<std::mutex> guard(lock);
+
+	if (offset >= VIRTIO_MMIO_CONFIG) {
+		writeConfig(offset - VIRTIO_MMIO_CONFIG, &value, std::min<unsigned int>(len, sizeof(value)));
+		return;
+	}
+
+	if (len != 4) {
+		return;
+	}
+
+	Virtqueue* q = queueSel < queues.size() ? &queues[queueSel] : nullptr;
+
+	switch (offset) {
+	case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+		deviceFeaturesSel = value;
+		break;
+	case VIRTIO_MMIO_DRIVER_FEATURES:
+		if (driverFeaturesSel == 0) {
+			setLow(driverFeatures, value);
+		} else if (driverFeaturesSel == 1) {
+			setHigh(driverFeatures, value);
+		}
+		driverFeatures &= features;
+		break;
+	case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+		driverFeaturesSel = value;
+		break;
+	case VIRTIO_MMIO_QUEUE_SEL:
+		queueSel = value;
+		break;
+	case VIRTIO_MMIO_QUEUE_NUM:
+		if (q && value > 0 && value <= Virtqueue::MAX_SIZE) {
+			q->size = value;
+		}
+		break;
+	case VIRTIO_MMIO_QUEUE_READY:
+		if (q) {
+			q->ready = value & 1;
+		}
+		break;
+	case VIRTIO_MMIO_QUEUE_NOTIFY:
+		guard.unlock();
+		kick(value);
+		break;
+	case VIRTIO_MMIO_INTERRUPT_ACK:
+		interruptStatus &= ~value;
+		break;
+	case VIRTIO_MMIO_STATUS:
+		if (value == 0) {
+			resetDevice();
+		} else {
+			bool active = isActive();
+			status = value;
+			/* The guest must accept VIRTIO_F_VERSION_1 to drive a version 2 device */
+			if ((status & VIRTIO_STATUS_FEATURES_OK) && !(driverFeatures & VIRTIO_F_VERSION_1)) {
+				status &= ~VIRTIO_STATUS_FEATURES_OK;
+			}
+			if (!active && isActive()) {
+				activate();
+			}
+		}
+		break;
+	case VIRTIO_MMIO_QUEUE_DESC_LOW:
+		if (q) setLow(q->desc, value);
+		break;
+	case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+		if (q) setHigh(q->desc, value);
+		break;
+	case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+		if (q) setLow(q->driver, value);
+		break;
+	case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+		if (q) setHigh(q->driver, value);
+		break;
+	case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+		if (q) setLow(q->device, value);
+		break;
+	case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+		if (q) setHigh(q->device, value);
+		break;
+	default:
+		break;
+	}
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include "eventfd.h"
+#include "mainloop.h"
+#include "memory.h"
+#include "session.h"
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE	1
+#define VIRTIO_STATUS_DRIVER		2
+#define VIRTIO_STATUS_DRIVER_OK		4
+#define VIRTIO_STATUS_FEATURES_OK	8
+#define VIRTIO_STATUS_FAILED		128
+
+#define VIRTIO_F_VERSION_1			(1ULL << 32)
+
+#define VIRTIO_INTERRUPT_VRING		(1U << 0)
+#define VIRTIO_INTERRUPT_CONFIG		(1U << 1)
+
+/* Split virtqueue layout */
+struct VirtqDesc {
+	std::uint64_t addr;
+	std::uint32_t len;
+	std::uint16_t flags;
+	std::uint16_t next;
+} __attribute__((packed));
+
+#define VIRTQ_DESC_F_NEXT			1
+#define VIRTQ_DESC_F_WRITE			2
+
+struct VirtqUsedElem {
+	std::uint32_t id;
+	std::uint32_t len;
+} __attribute__((packed));
+
+/* A descriptor chain popped from the available ring */
+struct VirtqChain {
+	std::uint16_t head;
+	/* Buffers the device reads from */
+	std::vector<iovec> out;
+	/* Buffers the device writes to */
+	std::vector<iovec> in;
+
+	static auto length(const std::vector<iovec>& iov) -> size_t;
+	/* The part of iov starting at offset, at most len bytes long */
+	static auto slice(const std::vector<iovec>& iov, size_t offset, size_t len) -> std::vector<iovec>;
+	static auto copyFrom(const std::vector<iovec>& iov, size_t offset, void *buffer, size_t len) -> size_t;
+	static auto copyTo(const std::vector<iovec>& iov, size_t offset, const void *buffer, size_t len) -> size_t;
+};
+
+class Virtqueue {
+public:
+	static constexpr unsigned int MAX_SIZE = 256;
+
+	Virtqueue();
+
+	auto reset() -> void;
+	auto pop(const GuestMemory& memory, VirtqChain& chain) -> bool;
+	/* Gives back the last chain popped, e.g. when there was nothing to put in it */
+	auto unpop() -> void;
+	auto push(const GuestMemory& memory, const VirtqChain& chain, std::uint32_t len) -> void;
+
+	std::uint32_t size;
+	bool ready;
+	std::uint64_t desc;
+	std::uint64_t driver;
+	std::uint64_t device;
+
+private:
+	std::uint16_t lastAvail;
+};
+
+/*
+ * A virtio device behind a virtio-mmio (version 2) register window. The
+ * backends implement the device specific configuration space and queue
+ * processing. Queue notifications come in through an ioeventfd per queue
+ * and the interrupt goes out through an irqfd, so neither goes through a
+ * vcpu exit handler. Register accesses may come from any vcpu thread and
+ * queue notifications from the domain main loop, so all of them are
+ * serialized by a per-device lock.
+ */
+class VirtioDevice {
+public:
+	static constexpr std::uint64_t WINDOW_SIZE = 0x200;
+
+	VirtioDevice(std::uint32_t deviceId, unsigned int queues, std::uint64_t features);
+	virtual ~VirtioDevice();
+
+	VirtioDevice(const VirtioDevice&) = delete;
+	VirtioDevice& operator=(const VirtioDevice&) = delete;
+
+	auto attach(Session* session, const GuestMemory* memory, Mainloop& loop,
+				std::uint64_t base, unsigned int irq) -> void;
+	auto detach() -> void;
+
+	auto read(std::uint64_t offset, unsigned int len) -> std::uint64_t;
+	auto write(std::uint64_t offset, std::uint64_t value, unsigned int len) -> void;
+
+	auto getBase() const -> std::uint64_t {
+		return base;
+	}
+
+	auto getIrq() const -> unsigned int {
+		return irq;
+	}
+
+	virtual auto getName() const -> std::string = 0;
+
+protected:
+	virtual auto readConfig(std::uint64_t offset, void *data, unsigned int len) -> void;
+	virtual auto writeConfig(std::uint64_t offset, const void *data, unsigned int len) -> void;
+	/* Called with the device lock held */
+	virtual auto notify(unsigned int queue) -> void = 0;
+	virtual auto activate() -> void {}
+	virtual auto reset() -> void {}
+
+	auto queue(unsigned int index) -> Virtqueue& {
+		return queues[index];
+	}
+
+	auto getMemory() const -> const GuestMemory& {
+		return *memory;
+	}
+
+	auto getMainloop() -> Mainloop& {
+		return *mainloop;
+	}
+
+	auto isActive() const -> bool {
+		return (status & VIRTIO_STATUS_DRIVER_OK) != 0;
+	}
+
+	/* Tell the guest that used buffers are available */
+	auto interrupt(std::uint32_t reason = VIRTIO_INTERRUPT_VRING) -> void;
+
+	std::mutex lock;
+
+private:
+	auto resetDevice() -> void;
+	auto kick(unsigned int queue) -> void;
+
+private:
+	std::uint32_t deviceId;
+	std::uint64_t features;
+	std::uint64_t driverFeatures;
+	std::uint32_t deviceFeaturesSel;
+	std::uint32_t driverFeaturesSel;
+	std::uint32_t queueSel;
+	std::uint32_t interruptStatus;
+	std::uint32_t status;
+	std::vector<Virtqueue> queues;
+
+	Session* session;
+	const GuestMemory* memory;
+	Mainloop* mainloop;
+	std::uint64_t base;
+	unsigned int irq;
+	std::vector<std::unique_ptr<IoEvent>> notifiers;
+	std::unique_ptr<IoEvent> irqfd;
+};
@@ -25,6 +25,7 @@
 #include <asm/current.h>
 #include <asm/event.h>
 #include <asm/gic.h>
+#include <asm/gic_v4.h>
 #include <asm/guest_access.h>
 #include <asm/guest_atomics.h>
 #include <asm/irq.h>
@@ -298,14 +299,22 @@ static void update_runstate_area(struct vcpu *v)
 
 static void schedule_tail(struct vcpu *prev)
 {
+    bool vlpis_pending;
+
     ctxt_switch_from(prev);
 
     ctxt_switch_to(current);
 
     local_irq_enable();
 
+    /* prev's vPE is off the redistributor now, see if it needs a kick. */
+    vlpis_pending = gicv4_vcpu_pending_last(prev);
+
     context_saved(prev);
 
+    if ( vlpis_pending )
+        gicv4_vcpu_saved(prev);
+
     if ( prev != current )
         update_runstate_area(current);
 
@@ -336,6 +345,9 @@ void context_switch(struct vcpu *prev, struct vcpu *next)
     if ( prev != next )
         update_runstate_area(prev);
 
+    /* ITS commands may take a while, send them with interrupts still on. */
+    gicv4_vcpu_prepare(next);
+
     local_irq_disable();
 
     /*
@@ -581,7 +593,7 @@ void vcpu_switch_to_aarch64_mode(struct vcpu *v)
 int arch_domain_create(struct domain *d, unsigned int domcr_flags,
                        struct xen_arch_domainconfig *config)
 {
-    int rc, count = 0;
+    int rc;
 
     BUILD_BUG_ON(GUEST_MAX_VCPUS < MAX_VIRT_CPUS);
     d->arch.relmem = RELMEM_not_started;
@@ -643,10 +655,10 @@ int arch_domain_create(struct domain *d, unsigned int domcr_flags,
         goto fail;
     }
 
-    if ( (rc = domain_vgic_register(d, &count)) != 0 )
+    if ( (rc = domain_vgic_register(d)) != 0 )
         goto fail;
 
-    if ( (rc = domain_io_init(d, count + MAX_IO_HANDLER)) != 0 )
+    if ( (rc = domain_io_init(d)) != 0 )
         goto fail;
 
     if ( (rc = domain_vgic_init(d, config->nr_spis)) != 0 )
@@ -30,6 +30,7 @@
 #include <asm/gic.h>
 #include <asm/gic_v3_defs.h>
 #include <asm/gic_v3_its.h>
+#include <asm/gic_v4.h>
 #include <asm/io.h>
 #include <asm/page.h>
 
@@ -67,7 +68,100 @@ bool gicv3_its_host_has_its(void)
 }
 
 #define BUFPTR_MASK                     GENMASK(19, 5)
-static int its_send_command(struct host_its *hw_its, const void *its_cmd)
+
+/*
+ * Commands are written straight into the command queue, but the ITS only
+ * gets to see them when CWRITER is updated. Batching them this way saves
+ * on register accesses, cache maintenance and locking for each command,
+ * which adds up when mapping devices with many events.
+ * Only a limited number of commands is written in one go, to not keep
+ * interrupts disabled for too long: 256 commands are 8KB of queue, so one
+ * go is an 8KB copy plus the cache maintenance for it. That is also the
+ * MAPTI and INV for 128 events, or four LPI blocks of a device.
+ */
+#define ITS_CMD_BATCH_MAX               256
+
+struct its_cmd_batch {
+    struct host_its *its;
+    unsigned long flags;
+    uint64_t start;                     /* First command not yet published */
+    uint64_t writep;                    /* Where the next command goes */
+    unsigned int nr;                    /* Commands since taking the lock */
+    int ret;
+};
+
+static void its_batch_start(struct its_cmd_batch *batch, struct host_its *its)
+{
+    /* No ITS commands from an interrupt handler (at the moment). */
+    ASSERT(!in_irq());
+
+    batch->its = its;
+    batch->nr = 0;
+    batch->ret = 0;
+
+    /*
+     * Interrupts stay disabled while commands are written, so that others
+     * spin on the lock for at most ITS_CMD_BATCH_MAX commands.
+     */
+    spin_lock_irqsave(&its->cmd_lock, batch->flags);
+
+    batch->writep = readq_relaxed(its->its_base + GITS_CWRITER) & BUFPTR_MASK;
+    batch->start = batch->writep;
+}
+
+/* Hand the commands written so far over to the ITS. */
+static void its_batch_publish(struct its_cmd_batch *batch)
+{
+    struct host_its *its = batch->its;
+
+    if ( batch->writep == batch->start )
+        return;
+
+    if ( its->flags & HOST_ITS_FLUSH_CMD_QUEUE )
+    {
+        /* The batch may wrap around the end of the queue. */
+        if ( batch->writep < batch->start )
+        {
+            clean_and_invalidate_dcache_va_range(its->cmd_buf + batch->start,
+                                                 ITS_CMD_QUEUE_SZ -
+                                                 batch->start);
+            batch->start = 0;
+        }
+        clean_and_invalidate_dcache_va_range(its->cmd_buf + batch->start,
+                                             batch->writep - batch->start);
+    }
+    else
+        dsb(ishst);
+
+    writeq_relaxed(batch->writep & BUFPTR_MASK, its->its_base + GITS_CWRITER);
+    batch->start = batch->writep;
+}
+
+/*
+ * Publish what we have and drop the lock for a moment, to let the ITS make
+ * progress or others get their turn. Someone else may add commands in the
+ * meantime, so we start over from their CWRITER.
+ */
+static void its_batch_relax(struct its_cmd_batch *batch)
+{
+    struct host_its *its = batch->its;
+
+    its_batch_publish(batch);
+    spin_unlock_irqrestore(&its->cmd_lock, batch->flags);
+    cpu_relax();
+    udelay(1);
+    spin_lock_irqsave(&its->cmd_lock, batch->flags);
+
+    batch->writep = readq_relaxed(its->its_base + GITS_CWRITER) & BUFPTR_MASK;
+    batch->start = batch->writep;
+    batch->nr = 0;
+}
+
+/*
+ * Append a command to the batch. Errors are sticky, so callers can add
+ * all their commands and check the outcome of its_batch_finish() only.
+ */
+static void its_batch_add(struct its_cmd_batch *batch, const void *its_cmd)
 {
     /*
      * The command queue should actually never become full, if it does anyway
@@ -81,55 +175,57 @@ static int its_send_command(struct host_its *hw_its, const void *its_cmd)
      * considerations.
      */
     s_time_t deadline = NOW() + MILLISECS(1);
-    uint64_t readp, writep;
-    int ret = -EBUSY;
+    struct host_its *its = batch->its;
+    uint64_t readp;
 
-    /* No ITS commands from an interrupt handler (at the moment). */
-    ASSERT(!in_irq());
+    if ( batch->ret )
+        return;
 
-    spin_lock(&hw_its->cmd_lock);
+    if ( batch->nr >= ITS_CMD_BATCH_MAX )
+        its_batch_relax(batch);
 
-    do {
-        readp = readq_relaxed(hw_its->its_base + GITS_CREADR) & BUFPTR_MASK;
-        writep = readq_relaxed(hw_its->its_base + GITS_CWRITER) & BUFPTR_MASK;
+    for ( ; ; )
+    {
+        readp = readq_relaxed(its->its_base + GITS_CREADR) & BUFPTR_MASK;
+        if ( ((batch->writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ) != readp )
+            break;
 
-        if ( ((writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ) != readp )
+        if ( NOW() > deadline )
         {
-            ret = 0;
-            break;
+            if ( printk_ratelimit() )
+                printk(XENLOG_WARNING "host ITS: command queue full.\n");
+            batch->ret = -EBUSY;
+            return;
         }
 
         /*
          * If the command queue is full, wait for a bit in the hope it drains
          * before giving up.
          */
-        spin_unlock(&hw_its->cmd_lock);
-        cpu_relax();
-        udelay(1);
-        spin_lock(&hw_its->cmd_lock);
-    } while ( NOW() <= deadline );
-
-    if ( ret )
-    {
-        spin_unlock(&hw_its->cmd_lock);
-        if ( printk_ratelimit() )
-            printk(XENLOG_WARNING "host ITS: command queue full.\n");
-        return ret;
+        its_batch_relax(batch);
     }
 
-    memcpy(hw_its->cmd_buf + writep, its_cmd, ITS_CMD_SIZE);
-    if ( hw_its->flags & HOST_ITS_FLUSH_CMD_QUEUE )
-        clean_and_invalidate_dcache_va_range(hw_its->cmd_buf + writep,
-                                             ITS_CMD_SIZE);
-    else
-        dsb(ishst);
+    memcpy(its->cmd_buf + batch->writep, its_cmd, ITS_CMD_SIZE);
+    batch->writep = (batch->writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ;
+    batch->nr++;
+}
 
-    writep = (writep + ITS_CMD_SIZE) % ITS_CMD_QUEUE_SZ;
-    writeq_relaxed(writep & BUFPTR_MASK, hw_its->its_base + GITS_CWRITER);
+static int its_batch_finish(struct its_cmd_batch *batch)
+{
+    its_batch_publish(batch);
+    spin_unlock_irqrestore(&batch->its->cmd_lock, batch->flags);
 
-    spin_unlock(&hw_its->cmd_lock);
+    return batch->ret;
+}
 
-    return 0;
+static int its_send_command(struct host_its *hw_its, const void *its_cmd)
+{
+    struct its_cmd_batch batch;
+
+    its_batch_start(&batch, hw_its);
+    its_batch_add(&batch, its_cmd);
+
+    return its_batch_finish(&batch);
 }
 
 /* Wait for an ITS to finish processing all commands. */
@@ -143,12 +239,13 @@ static int gicv3_its_wait_commands(struct host_its *hw_its)
      */
     s_time_t deadline = NOW() + MILLISECS(100);
     uint64_t readp, writep;
+    unsigned long flags;
 
     do {
-        spin_lock(&hw_its->cmd_lock);
+        spin_lock_irqsave(&hw_its->cmd_lock, flags);
         readp = readq_relaxed(hw_its->its_base + GITS_CREADR) & BUFPTR_MASK;
         writep = readq_relaxed(hw_its->its_base + GITS_CWRITER) & BUFPTR_MASK;
-        spin_unlock(&hw_its->cmd_lock);
+        spin_unlock_irqrestore(&hw_its->cmd_lock, flags);
 
         if ( readp == writep )
             return 0;
@@ -170,30 +267,32 @@ static uint64_t encode_rdbase(struct host_its *hw_its, unsigned int cpu,
     return reg;
 }
 
-static int its_send_cmd_sync(struct host_its *its, unsigned int cpu)
+static void its_encode_sync(struct host_its *its, uint64_t *cmd,
+                            unsigned int cpu)
 {
-    uint64_t cmd[4];
-
     cmd[0] = GITS_CMD_SYNC;
     cmd[1] = 0x00;
     cmd[2] = encode_rdbase(its, cpu, 0x0);
     cmd[3] = 0x00;
-
-    return its_send_command(its, cmd);
 }
 
-static int its_send_cmd_mapti(struct host_its *its,
-                              uint32_t deviceid, uint32_t eventid,
-                              uint32_t pintid, uint16_t icid)
+static int its_send_cmd_sync(struct host_its *its, unsigned int cpu)
 {
     uint64_t cmd[4];
 
+    its_encode_sync(its, cmd, cpu);
+
+    return its_send_command(its, cmd);
+}
+
+static void its_encode_mapti(uint64_t *cmd,
+                             uint32_t deviceid, uint32_t eventid,
+                             uint32_t pintid, uint16_t icid)
+{
     cmd[0] = GITS_CMD_MAPTI | ((uint64_t)deviceid << 32);
     cmd[1] = eventid | ((uint64_t)pintid << 32);
     cmd[2] = icid;
     cmd[3] = 0x00;
-
-    return its_send_command(its, cmd);
 }
 
 static int its_send_cmd_mapc(struct host_its *its, uint32_t collection_id,
@@ -234,12 +333,31 @@ static int its_send_cmd_mapd(struct host_its *its, uint32_t deviceid,
     return its_send_command(its, cmd);
 }
 
+static void its_encode_inv(uint64_t *cmd, uint32_t deviceid, uint32_t eventid)
+{
+    cmd[0] = GITS_CMD_INV | ((uint64_t)deviceid << 32);
+    cmd[1] = eventid;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+}
+
 static int its_send_cmd_inv(struct host_its *its,
                             uint32_t deviceid, uint32_t eventid)
 {
     uint64_t cmd[4];
 
-    cmd[0] = GITS_CMD_INV | ((uint64_t)deviceid << 32);
+    its_encode_inv(cmd, deviceid, eventid);
+
+    return its_send_command(its, cmd);
+}
+
+/* INT, CLEAR, INV and DISCARD only take a device ID and event ID. */
+static int its_send_cmd_event(struct host_its *its, uint8_t command,
+                              uint32_t deviceid, uint32_t eventid)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = command | ((uint64_t)deviceid << 32);
     cmd[1] = eventid;
     cmd[2] = 0x00;
     cmd[3] = 0x00;
@@ -247,6 +365,107 @@ static int its_send_cmd_inv(struct host_its *its,
     return its_send_command(its, cmd);
 }
 
+static int its_send_cmd_vsync(struct host_its *its, uint16_t vpeid)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VSYNC;
+    cmd[1] = (uint64_t)vpeid << 32;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vmapp(struct host_its *its, uint16_t vpeid,
+                              unsigned int cpu, paddr_t vpt_addr,
+                              unsigned int vpt_bits, bool valid)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VMAPP;
+    cmd[1] = (uint64_t)vpeid << 32;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+    if ( valid )
+    {
+        ASSERT(!(vpt_addr & ~GENMASK(51, 16)));
+
+        cmd[2] = encode_rdbase(its, cpu, GITS_VALID_BIT);
+        /* The size of the VPT is encoded as "number of bits minus one". */
+        cmd[3] = vpt_addr | (vpt_bits - 1);
+    }
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vmovp(struct host_its *its, uint16_t vpeid,
+                              unsigned int cpu)
+{
+    static uint16_t vmovp_seq;
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VMOVP;
+    cmd[1] = (uint64_t)vpeid << 32;
+    cmd[2] = encode_rdbase(its, cpu, 0x0);
+    cmd[3] = 0x00;
+
+    /*
+     * An ITS without GITS_TYPER.VMOVP wants the list of ITSes the command
+     * is sent to, and a sequence number identifying this move. We only
+     * use GICv4 with a single ITS of that kind, see gicv4_its_init().
+     */
+    if ( !(its->flags & HOST_ITS_VMOVP) )
+    {
+        cmd[0] |= (uint64_t)vmovp_seq++ << 32;
+        cmd[1] |= BIT(its->its_number);
+    }
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vmapti(struct host_its *its,
+                               uint32_t deviceid, uint32_t eventid,
+                               uint16_t vpeid, uint32_t vintid,
+                               uint32_t doorbell)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VMAPTI | ((uint64_t)deviceid << 32);
+    cmd[1] = eventid | ((uint64_t)vpeid << 32);
+    cmd[2] = vintid | ((uint64_t)doorbell << 32);
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vmovi(struct host_its *its,
+                              uint32_t deviceid, uint32_t eventid,
+                              uint16_t vpeid, uint32_t doorbell)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VMOVI | ((uint64_t)deviceid << 32);
+    cmd[1] = eventid | ((uint64_t)vpeid << 32);
+    /* Bit 0 says the doorbell is valid. */
+    cmd[2] = 0x01 | ((uint64_t)doorbell << 32);
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
+static int its_send_cmd_vinvall(struct host_its *its, uint16_t vpeid)
+{
+    uint64_t cmd[4];
+
+    cmd[0] = GITS_CMD_VINVALL;
+    cmd[1] = (uint64_t)vpeid << 32;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+
+    return its_send_command(its, cmd);
+}
+
 /* Set up the (1:1) collection mapping for the given host CPU. */
 int gicv3_its_setup_collection(unsigned int cpu)
 {
@@ -469,6 +688,12 @@ static int gicv3_its_init_single_its(struct host_its *hw_its)
     hw_its->itte_size = GITS_TYPER_ITT_SIZE(reg);
     if ( reg & GITS_TYPER_PTA )
         hw_its->flags |= HOST_ITS_USES_PTA;
+    if ( reg & GITS_TYPER_VIRTUAL )
+        hw_its->flags |= HOST_ITS_VIRTUAL;
+    if ( reg & GITS_TYPER_VMOVP )
+        hw_its->flags |= HOST_ITS_VMOVP;
+    hw_its->its_number = (readl_relaxed(hw_its->its_base + GITS_CTLR) &
+                          GITS_CTLR_ITS_NUMBER_MASK) >> GITS_CTLR_ITS_NUMBER_SHIFT;
     spin_lock_init(&hw_its->cmd_lock);
 
     for ( i = 0; i < GITS_BASER_NR_REGS; i++ )
@@ -492,9 +717,12 @@ static int gicv3_its_init_single_its(struct host_its *hw_its)
             if ( ret )
                 return ret;
             break;
-        /* In case this is a GICv4, provide a (dummy) vPE table as well. */
+        /*
+         * In case this is a GICv4, provide a vPE table as well. It is only
+         * used if direct vLPI injection gets enabled, see gic-v4.c.
+         */
         case GITS_BASER_TYPE_VCPU:
-            ret = its_map_baser(basereg, reg, 1);
+            ret = its_map_baser(basereg, reg, GICV4_NR_VPES);
             if ( ret )
                 return ret;
             break;
@@ -527,6 +755,8 @@ int gicv3_its_init(void)
             return ret;
     }
 
+    gicv4_its_init();
+
     return 0;
 }
 
@@ -595,38 +825,60 @@ static int compare_its_guest_devices(struct its_device *dev,
 }
 
 /*
- * On the host ITS @its, map @nr_events consecutive LPIs.
+ * Add the commands to map @nr_events consecutive LPIs to a batch.
  * The mapping connects a device @devid and event @eventid pair to LPI @lpi,
  * increasing both @eventid and @lpi to cover the number of requested LPIs.
  */
-static int gicv3_its_map_host_events(struct host_its *its,
-                                     uint32_t devid, uint32_t eventid,
-                                     uint32_t lpi, uint32_t nr_events)
+static void its_batch_map_events(struct its_cmd_batch *batch,
+                                 uint32_t devid, uint32_t eventid,
+                                 uint32_t lpi, uint32_t nr_events)
 {
+    uint64_t cmd[4];
     uint32_t i;
-    int ret;
 
     for ( i = 0; i < nr_events; i++ )
     {
         /* For now we map every host LPI to host CPU 0 */
-        ret = its_send_cmd_mapti(its, devid, eventid + i, lpi + i, 0);
-        if ( ret )
-            return ret;
+        its_encode_mapti(cmd, devid, eventid + i, lpi + i, 0);
+        its_batch_add(batch, cmd);
 
-        ret = its_send_cmd_inv(its, devid, eventid + i);
-        if ( ret )
-            return ret;
+        its_encode_inv(cmd, devid, eventid + i);
+        its_batch_add(batch, cmd);
     }
+}
 
-    /* TODO: Consider using INVALL here. Didn't work on the model, though. */
+/* Finish a batch with a SYNC, and wait for the ITS to execute all of it. */
+static int its_batch_sync(struct its_cmd_batch *batch)
+{
+    struct host_its *its = batch->its;
+    uint64_t cmd[4];
+    int ret;
+
+    its_encode_sync(its, cmd, 0);
+    its_batch_add(batch, cmd);
 
-    ret = its_send_cmd_sync(its, 0);
+    ret = its_batch_finish(batch);
     if ( ret )
         return ret;
 
     return gicv3_its_wait_commands(its);
 }
 
+/* On the host ITS @its, map @nr_events consecutive LPIs. */
+static int gicv3_its_map_host_events(struct host_its *its,
+                                     uint32_t devid, uint32_t eventid,
+                                     uint32_t lpi, uint32_t nr_events)
+{
+    struct its_cmd_batch batch;
+
+    its_batch_start(&batch, its);
+    its_batch_map_events(&batch, devid, eventid, lpi, nr_events);
+
+    /* TODO: Consider using INVALL here. Didn't work on the model, though. */
+
+    return its_batch_sync(&batch);
+}
+
 /*
  * Map a hardware device, identified by a certain host ITS and its device ID
  * to domain d, a guest ITS (identified by its doorbell address) and device ID.
@@ -754,17 +1006,26 @@ int gicv3_its_map_guest_device(struct domain *d,
     /*
      * Map all host LPIs within this device already. We can't afford to queue
      * any host ITS commands later on during the guest's runtime.
+     * Allocating the LPIs can't happen while building the batch, as this
+     * holds the command queue lock.
      */
     for ( i = 0; i < nr_events / LPI_BLOCK; i++ )
     {
         ret = gicv3_allocate_host_lpi_block(d, &dev->host_lpi_blocks[i]);
         if ( ret < 0 )
             break;
+    }
 
-        ret = gicv3_its_map_host_events(hw_its, host_devid, i * LPI_BLOCK,
-                                        dev->host_lpi_blocks[i], LPI_BLOCK);
-        if ( ret < 0 )
-            break;
+    if ( !ret )
+    {
+        struct its_cmd_batch batch;
+        unsigned int blk;
+
+        its_batch_start(&batch, hw_its);
+        for ( blk = 0; blk < nr_events / LPI_BLOCK; blk++ )
+            its_batch_map_events(&batch, host_devid, blk * LPI_BLOCK,
+                                 dev->host_lpi_blocks[blk], LPI_BLOCK);
+        ret = its_batch_sync(&batch);
     }
 
     if ( ret )
@@ -831,10 +1092,17 @@ static struct its_device *get_its_device(struct domain *d, paddr_t vdoorbell,
     return NULL;
 }
 
+/*
+ * Looks up the pending_irq of an event of a device that has been mapped to
+ * domain d. Optionally also returns the host ITS, the host device ID and
+ * the host LPI backing that event.
+ */
 static struct pending_irq *get_event_pending_irq(struct domain *d,
                                                  paddr_t vdoorbell_address,
                                                  uint32_t vdevid,
                                                  uint32_t eventid,
+                                                 struct host_its **hw_its,
+                                                 uint32_t *host_devid,
                                                  uint32_t *host_lpi)
 {
     struct its_device *dev;
@@ -845,6 +1113,10 @@ static struct pending_irq *get_event_pending_irq(struct domain *d,
     if ( dev && eventid < dev->eventids )
     {
         pirq = &dev->pend_irqs[eventid];
+        if ( hw_its )
+            *hw_its = dev->hw_its;
+        if ( host_devid )
+            *host_devid = dev->host_devid;
         if ( host_lpi )
             *host_lpi = dev->host_lpi_blocks[eventid / LPI_BLOCK] +
                         (eventid % LPI_BLOCK);
@@ -859,7 +1131,8 @@ struct pending_irq *gicv3_its_get_event_pending_irq(struct domain *d,
                                                     uint32_t vdevid,
                                                     uint32_t eventid)
 {
-    return get_event_pending_irq(d, vdoorbell_address, vdevid, eventid, NULL);
+    return get_event_pending_irq(d, vdoorbell_address, vdevid, eventid,
+                                 NULL, NULL, NULL);
 }
 
 int gicv3_remove_guest_event(struct domain *d, paddr_t vdoorbell_address,
@@ -868,7 +1141,7 @@ int gicv3_remove_guest_event(struct domain *d, paddr_t vdoorbell_address,
     uint32_t host_lpi = INVALID_LPI;
 
     if ( !get_event_pending_irq(d, vdoorbell_address, vdevid, eventid,
-                                &host_lpi) )
+                                NULL, NULL, &host_lpi) )
         return -EINVAL;
 
     if ( host_lpi == INVALID_LPI )
@@ -896,7 +1169,7 @@ struct pending_irq *gicv3_assign_guest_event(struct domain *d,
     uint32_t host_lpi = INVALID_LPI;
 
     pirq = get_event_pending_irq(d, vdoorbell_address, vdevid, eventid,
-                                 &host_lpi);
+                                 NULL, NULL, &host_lpi);
 
     if ( !pirq )
         return NULL;
@@ -906,6 +1179,178 @@ struct pending_irq *gicv3_assign_guest_event(struct domain *d,
     return pirq;
 }
 
+/*
+ * GICv4: replace the host translation of an event with a direct one to
+ * the given vPE and vLPI. The host LPI the event used so far becomes the
+ * doorbell, which fires if the vPE is not resident when the vLPI arrives.
+ */
+int gicv3_its_map_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                       uint32_t vdevid, uint32_t eventid,
+                       uint16_t vpeid, uint32_t virt_lpi)
+{
+    struct host_its *hw_its;
+    uint32_t host_devid, host_lpi;
+    int ret;
+
+    if ( !get_event_pending_irq(d, vdoorbell_address, vdevid, eventid,
+                                &hw_its, &host_devid, &host_lpi) )
+        return -ENOENT;
+
+    /* From now on the host LPI only has to wake up the vCPU. */
+    gicv3_lpi_update_host_doorbell(host_lpi, d->domain_id, virt_lpi);
+
+    ret = its_send_cmd_event(hw_its, GITS_CMD_DISCARD, host_devid, eventid);
+    if ( !ret )
+        ret = its_send_cmd_vmapti(hw_its, host_devid, eventid, vpeid,
+                                  virt_lpi, host_lpi);
+    /* Don't let the redistributor use a stale configuration for the vLPI. */
+    if ( !ret )
+        ret = its_send_cmd_inv(hw_its, host_devid, eventid);
+    if ( !ret )
+        ret = its_send_cmd_vsync(hw_its, vpeid);
+    if ( !ret )
+        ret = gicv3_its_wait_commands(hw_its);
+
+    if ( ret )
+    {
+        /* Go back to the host translation, the caller will inject as before. */
+        gicv3_its_unmap_vlpi(d, vdoorbell_address, vdevid, eventid);
+        gicv3_lpi_update_host_entry(host_lpi, d->domain_id, virt_lpi);
+    }
+
+    return ret;
+}
+
+/* GICv4: map an event back to its host LPI, as done upon MAPD. */
+int gicv3_its_unmap_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                         uint32_t vdevid, uint32_t eventid)
+{
+    struct host_its *hw_its;
+    uint32_t host_devid, host_lpi;
+    int ret;
+
+    if ( !get_event_pending_irq(d, vdoorbell_address, vdevid, eventid,
+                                &hw_its, &host_devid, &host_lpi) )
+        return -ENOENT;
+
+    ret = its_send_cmd_event(hw_its, GITS_CMD_DISCARD, host_devid, eventid);
+    if ( ret )
+        return ret;
+
+    return gicv3_its_map_host_events(hw_its, host_devid, eventid, host_lpi, 1);
+}
+
+/* GICv4: retarget a direct vLPI to another vPE of the same VM. */
+int gicv3_its_move_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                        uint32_t vdevid, uint32_t eventid, uint16_t vpeid)
+{
+    struct host_its *hw_its;
+    uint32_t host_devid, host_lpi;
+    int ret;
+
+    if ( !get_event_pending_irq(d, vdoorbell_address, vdevid, eventid,
+                                &hw_its, &host_devid, &host_lpi) )
+        return -ENOENT;
+
+    ret = its_send_cmd_vmovi(hw_its, host_devid, eventid, vpeid, host_lpi);
+    if ( ret )
+        return ret;
+
+    ret = its_send_cmd_vsync(hw_its, vpeid);
+    if ( ret )
+        return ret;
+
+    return gicv3_its_wait_commands(hw_its);
+}
+
+/*
+ * GICv4: forward an INT, CLEAR or INV command for a direct vLPI to the
+ * host ITS, which knows about its pending state and configuration.
+ */
+int gicv3_its_vlpi_command(struct domain *d, paddr_t vdoorbell_address,
+                           uint32_t vdevid, uint32_t eventid,
+                           uint16_t vpeid, uint8_t command)
+{
+    struct host_its *hw_its;
+    uint32_t host_devid, host_lpi;
+    int ret;
+
+    ASSERT(command == GITS_CMD_INT || command == GITS_CMD_CLEAR ||
+           command == GITS_CMD_INV);
+
+    if ( !get_event_pending_irq(d, vdoorbell_address, vdevid, eventid,
+                                &hw_its, &host_devid, &host_lpi) )
+        return -ENOENT;
+
+    ret = its_send_cmd_event(hw_its, command, host_devid, eventid);
+    if ( ret )
+        return ret;
+
+    ret = its_send_cmd_vsync(hw_its, vpeid);
+    if ( ret )
+        return ret;
+
+    return gicv3_its_wait_commands(hw_its);
+}
+
+/* GICv4: tell every host ITS where the vPE's pending table lives. */
+int gicv3_its_map_vpe(uint16_t vpeid, unsigned int cpu, paddr_t vpt_addr,
+                      unsigned int vpt_bits, bool valid)
+{
+    struct host_its *hw_its;
+    int ret;
+
+    list_for_each_entry(hw_its, &host_its_list, entry)
+    {
+        ret = its_send_cmd_vmapp(hw_its, vpeid, cpu, vpt_addr, vpt_bits,
+                                 valid);
+        if ( !ret && valid )
+            ret = its_send_cmd_vinvall(hw_its, vpeid);
+        if ( !ret )
+            ret = gicv3_its_wait_commands(hw_its);
+        if ( ret )
+            return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * GICv4: route a vPE's vLPIs and doorbells to the redistributor of @cpu.
+ * gicv4_its_init() made sure that one ITS is enough to reach them all.
+ */
+int gicv3_its_move_vpe(uint16_t vpeid, unsigned int cpu)
+{
+    struct host_its *hw_its = list_first_entry(&host_its_list,
+                                               struct host_its, entry);
+    int ret;
+
+    ret = its_send_cmd_vmovp(hw_its, vpeid, cpu);
+    if ( ret )
+        return ret;
+
+    ret = its_send_cmd_vsync(hw_its, vpeid);
+    if ( ret )
+        return ret;
+
+    return gicv3_its_wait_commands(hw_its);
+}
+
+/* GICv4: have the redistributors reload the configuration of all vLPIs. */
+int gicv3_its_invall_vpe(uint16_t vpeid)
+{
+    struct host_its *hw_its = list_first_entry(&host_its_list,
+                                               struct host_its, entry);
+    int ret;
+
+    /* Reaching the redistributors through any ITS is enough. */
+    ret = its_send_cmd_vinvall(hw_its, vpeid);
+    if ( ret )
+        return ret;
+
+    return gicv3_its_wait_commands(hw_its);
+}
+
 int gicv3_its_deny_access(const struct domain *d)
 {
     int rc = 0;
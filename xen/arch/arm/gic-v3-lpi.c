@@ -28,6 +28,7 @@
 #include <asm/gic.h>
 #include <asm/gic_v3_defs.h>
 #include <asm/gic_v3_its.h>
+#include <asm/gic_v4.h>
 #include <asm/io.h>
 #include <asm/page.h>
 
@@ -47,10 +48,13 @@ union host_lpi {
     struct {
         uint32_t virt_lpi;
         uint16_t dom_id;
-        uint16_t pad;
+        uint16_t flags;
     };
 };
 
+/* The LPI is a GICv4 doorbell, the vLPI itself is delivered by the ITS. */
+#define HOST_LPI_DOORBELL               (1U << 0)
+
 #define LPI_PROPTABLE_NEEDS_FLUSHING    (1U << 0)
 
 /* Global state */
@@ -207,7 +211,14 @@ void gicv3_do_LPI(unsigned int lpi)
      * See the thread around here for some background:
      * https://lists.xen.org/archives/html/xen-devel/2016-12/msg00003.html
      */
-    vgic_vcpu_inject_lpi(d, hlpi.virt_lpi);
+    if ( hlpi.flags & HOST_LPI_DOORBELL )
+        /*
+         * With GICv4 the vLPI itself is already pending in the vPE's
+         * pending table, all we have to do is to get the vCPU running.
+         */
+        gicv4_doorbell(d, hlpi.virt_lpi);
+    else
+        vgic_vcpu_inject_lpi(d, hlpi.virt_lpi);
 
     rcu_unlock_domain(d);
 
@@ -215,8 +226,8 @@ out:
     irq_exit();
 }
 
-void gicv3_lpi_update_host_entry(uint32_t host_lpi, int domain_id,
-                                 uint32_t virt_lpi)
+static void update_host_entry(uint32_t host_lpi, int domain_id,
+                              uint32_t virt_lpi, unsigned int flags)
 {
     union host_lpi *hlpip, hlpi;
 
@@ -228,10 +239,23 @@ void gicv3_lpi_update_host_entry(uint32_t host_lpi, int domain_id,
 
     hlpi.virt_lpi = virt_lpi;
     hlpi.dom_id = domain_id;
+    hlpi.flags = flags;
 
     write_u64_atomic(&hlpip->data, hlpi.data);
 }
 
+void gicv3_lpi_update_host_entry(uint32_t host_lpi, int domain_id,
+                                 uint32_t virt_lpi)
+{
+    update_host_entry(host_lpi, domain_id, virt_lpi, 0);
+}
+
+void gicv3_lpi_update_host_doorbell(uint32_t host_lpi, int domain_id,
+                                    uint32_t virt_lpi)
+{
+    update_host_entry(host_lpi, domain_id, virt_lpi, HOST_LPI_DOORBELL);
+}
+
 static int gicv3_lpi_allocate_pendtable(uint64_t *reg)
 {
     uint64_t val;
@@ -512,6 +536,7 @@ int gicv3_allocate_host_lpi_block(struct domain *d, uint32_t *first_lpi)
          */
         hlpi.virt_lpi = INVALID_LPI;
         hlpi.dom_id = d->domain_id;
+        hlpi.flags = 0;
         write_u64_atomic(&lpi_data.host_lpis[chunk][lpi_idx + i].data,
                          hlpi.data);
 
@@ -43,6 +43,7 @@
 #include <asm/gic.h>
 #include <asm/gic_v3_defs.h>
 #include <asm/gic_v3_its.h>
+#include <asm/gic_v4.h>
 #include <asm/cpufeature.h>
 #include <asm/acpi.h>
 
@@ -375,6 +376,7 @@ static void gicv3_save_state(struct vcpu *v)
     save_aprn_regs(&v->arch.gic);
     v->arch.gic.v3.vmcr = READ_SYSREG32(ICH_VMCR_EL2);
     v->arch.gic.v3.sre_el1 = READ_SYSREG32(ICC_SRE_EL1);
+    gicv4_vcpu_save(v);
 }
 
 static void gicv3_restore_state(const struct vcpu *v)
@@ -405,6 +407,7 @@ static void gicv3_restore_state(const struct vcpu *v)
     WRITE_SYSREG32(v->arch.gic.v3.vmcr, ICH_VMCR_EL2);
     restore_aprn_regs(&v->arch.gic);
     gicv3_restore_lrs(v);
+    gicv4_vcpu_restore(v);
 
     /*
      * Make sure all stores are visible the GIC
@@ -722,6 +725,8 @@ static int __init gicv3_populate_rdist(void)
                                smp_processor_id(), ret);
                         break;
                     }
+
+                    gicv4_init_rdist(ptr, typer);
                 }
 
                 printk("GICv3: CPU%d: Found redistributor in region %d @%p\n",
@@ -0,0 +1,554 @@
+/*
+ * xen/arch/arm/gic-v4.c
+ *
+ * ARM GICv4 direct injection of virtual LPIs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With GICv4 the host ITS can translate an event of a passed-through device
+ * straight into a virtual LPI, which the redistributor then signals to the
+ * vCPU without Xen being involved. For this each vCPU is backed by a
+ * "virtual PE" (vPE), which owns a virtual pending table (VPT). The vPE is
+ * made resident on the redistributor of the physical CPU the vCPU runs on
+ * when the vCPU gets scheduled in, and taken off again when it gets
+ * scheduled out.
+ * If a vLPI arrives while its vPE is not resident, the ITS records it in
+ * the VPT and raises a "doorbell" physical LPI instead. We use the host
+ * LPI the event was using before for that, so when it fires, Xen just has
+ * to wake up the vCPU, which will find the vLPI pending once it runs.
+ *
+ * The configuration of vLPIs lives in a per-domain property table owned by
+ * Xen, which mirrors the guest's one whenever the vITS reads from it.
+ * This allows a vPE to be resident from the start, without having to wait
+ * for the guest to enable LPIs on its redistributors.
+ *
+ * At the moment this only covers the hardware domain, and is off by
+ * default (use "gicv4" on the Xen command line). Everything the host GIC
+ * can't do directly keeps using the emulated injection through the LRs.
+ */
+
+#include <xen/bitmap.h>
+#include <xen/delay.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/mm.h>
+#include <xen/perfc.h>
+#include <xen/sched.h>
+#include <xen/sizes.h>
+#include <xen/softirq.h>
+#include <asm/gic.h>
+#include <asm/gic_v3_defs.h>
+#include <asm/gic_v3_its.h>
+#include <asm/gic_v4.h>
+#include <asm/io.h>
+#include <asm/vgic.h>
+
+/*
+ * Number of vLPI ID bits we provide. This limits the size of the VPTs and
+ * the property table, vLPIs above that are injected through the LRs.
+ */
+#define GICV4_VLPI_ID_BITS              16
+
+/* How often to send VMOVP before giving up on moving a vPE. */
+#define GICV4_VPE_MOVE_TRIES            3
+
+/*
+ * How long to wait for a redistributor to write back the pending state of
+ * a vPE, with interrupts disabled. This normally takes a few microseconds.
+ */
+#define GICV4_DIRTY_TIMEOUT             MICROSECS(50)
+
+struct gicv4_vpe {
+    uint16_t id;
+    unsigned int cpu;                   /* Where the ITSes send vLPIs to */
+    void *pendtable;                    /* The VPT */
+    bool resident;
+    bool pending_last;                  /* vLPIs were pending on descheduling */
+};
+
+static bool __initdata opt_gicv4;
+boolean_param("gicv4", opt_gicv4);
+
+static bool __read_mostly gicv4_enabled;
+
+/* The VLPI_base frame of this CPU's redistributor. */
+static DEFINE_PER_CPU(void __iomem *, vlpi_base);
+/* The vPE last descheduled on this CPU, until its pending state is back. */
+static DEFINE_PER_CPU(struct gicv4_vpe *, vpe_saving);
+
+/* Protects the allocation of vPE IDs. */
+static DEFINE_SPINLOCK(vpe_lock);
+static DECLARE_BITMAP(vpe_ids, GICV4_NR_VPES);
+
+static unsigned int vlpi_id_bits(const struct domain *d)
+{
+    return min_t(unsigned int, GICV4_VLPI_ID_BITS, d->arch.vgic.intid_bits);
+}
+
+void __init gicv4_its_init(void)
+{
+    struct host_its *hw_its;
+    unsigned int nr_its = 0;
+    bool vmovp = true;
+
+    if ( !opt_gicv4 )
+        return;
+
+    list_for_each_entry(hw_its, &host_its_list, entry)
+    {
+        if ( !(hw_its->flags & HOST_ITS_VIRTUAL) )
+        {
+            printk(XENLOG_WARNING
+                   "GICv4: ITS @%"PRIpaddr" can't handle vLPIs, disabling\n",
+                   hw_its->addr);
+            return;
+        }
+
+        if ( !(hw_its->flags & HOST_ITS_VMOVP) )
+            vmovp = false;
+        nr_its++;
+    }
+
+    /*
+     * Without GITS_TYPER.VMOVP a VMOVP has to be sent to every ITS, with a
+     * synchronisation protocol between them. We don't implement that, as
+     * this is done on every context switch to another physical CPU.
+     */
+    if ( !nr_its || (nr_its > 1 && !vmovp) )
+    {
+        printk(XENLOG_WARNING
+               "GICv4: multiple ITSes without single VMOVP, disabling\n");
+        return;
+    }
+
+    gicv4_enabled = true;
+    printk("GICv4: Using direct injection of vLPIs\n");
+}
+
+void gicv4_init_rdist(void __iomem *rdist_base, uint64_t typer)
+{
+    void __iomem *vlpi_base = rdist_base + GICR_VLPI_BASE_OFFSET;
+    uint64_t reg;
+
+    if ( !gicv4_enabled )
+        return;
+
+    if ( !(typer & GICR_TYPER_VLPIS) )
+    {
+        printk(XENLOG_WARNING
+               "GICv4: CPU%d: redistributor can't handle vLPIs, disabling\n",
+               smp_processor_id());
+        gicv4_enabled = false;
+        return;
+    }
+
+    /* Don't inherit a resident vPE from before Xen. */
+    reg = readq_relaxed(vlpi_base + GICR_VPENDBASER);
+    if ( reg & GICR_VPENDBASER_VALID )
+        writeq_relaxed(reg & ~GICR_VPENDBASER_VALID,
+                       vlpi_base + GICR_VPENDBASER);
+
+    this_cpu(vlpi_base) = vlpi_base;
+}
+
+int gicv4_domain_init(struct domain *d)
+{
+    unsigned int bits = vlpi_id_bits(d);
+    size_t size;
+
+    /*
+     * vPE IDs are not sized for more than one domain, also the vITS walks
+     * over all LPIs for some commands, which is only fine for Dom0.
+     */
+    if ( !gicv4_enabled || !is_hardware_domain(d) || !d->arch.vgic.has_its )
+        return 0;
+
+    if ( BIT(bits) <= LPI_OFFSET )
+        return 0;
+
+    /* Like the host's one, the table starts with the first LPI. */
+    size = BIT(bits) - LPI_OFFSET;
+    d->arch.vgic.vlpi_prop = _xzalloc(size, SZ_4K);
+    if ( !d->arch.vgic.vlpi_prop )
+        return -ENOMEM;
+
+    clean_and_invalidate_dcache_va_range(d->arch.vgic.vlpi_prop, size);
+
+    return 0;
+}
+
+void gicv4_domain_free(struct domain *d)
+{
+    xfree(d->arch.vgic.vlpi_prop);
+    d->arch.vgic.vlpi_prop = NULL;
+}
+
+int gicv4_vcpu_init(struct vcpu *v)
+{
+    struct domain *d = v->domain;
+    unsigned int bits = vlpi_id_bits(d);
+    struct gicv4_vpe *vpe;
+    unsigned int id;
+    int ret;
+
+    if ( !d->arch.vgic.vlpi_prop )
+        return 0;
+
+    vpe = xzalloc(struct gicv4_vpe);
+    if ( !vpe )
+        return -ENOMEM;
+
+    /* Same as for the host, one bit per (v)LPI, including the ones < 8192. */
+    vpe->pendtable = _xzalloc(BIT(bits) / 8, SZ_64K);
+    if ( !vpe->pendtable )
+    {
+        ret = -ENOMEM;
+        goto out_free_vpe;
+    }
+
+    if ( virt_to_maddr(vpe->pendtable) & ~GENMASK(51, 16) )
+    {
+        ret = -ERANGE;
+        goto out_free_vpe;
+    }
+    clean_and_invalidate_dcache_va_range(vpe->pendtable, BIT(bits) / 8);
+
+    spin_lock(&vpe_lock);
+    id = find_first_zero_bit(vpe_ids, GICV4_NR_VPES);
+    if ( id < GICV4_NR_VPES )
+        __set_bit(id, vpe_ids);
+    spin_unlock(&vpe_lock);
+
+    if ( id >= GICV4_NR_VPES )
+    {
+        ret = -ENOSPC;
+        goto out_free_vpe;
+    }
+
+    vpe->id = id;
+    vpe->cpu = v->processor;
+
+    ret = gicv3_its_map_vpe(vpe->id, vpe->cpu,
+                            virt_to_maddr(vpe->pendtable), bits, true);
+    if ( ret )
+        goto out_free_id;
+
+    v->arch.vgic.vpe = vpe;
+
+    return 0;
+
+out_free_id:
+    spin_lock(&vpe_lock);
+    __clear_bit(vpe->id, vpe_ids);
+    spin_unlock(&vpe_lock);
+
+out_free_vpe:
+    xfree(vpe->pendtable);
+    xfree(vpe);
+
+    return ret;
+}
+
+void gicv4_vcpu_free(struct vcpu *v)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+
+    if ( !vpe )
+        return;
+
+    v->arch.vgic.vpe = NULL;
+
+    /* The ITSes must not touch the VPT anymore once it's gone. */
+    if ( gicv3_its_map_vpe(vpe->id, 0, 0, 0, false) )
+    {
+        printk(XENLOG_ERR "GICv4: %pv: failed to unmap vPE %u, leaking it\n",
+               v, vpe->id);
+        return;
+    }
+
+    spin_lock(&vpe_lock);
+    __clear_bit(vpe->id, vpe_ids);
+    spin_unlock(&vpe_lock);
+
+    xfree(vpe->pendtable);
+    xfree(vpe);
+}
+
+/*
+ * Called with interrupts enabled, before v is switched in on this CPU.
+ * Have doorbells and vLPIs follow v here, so that gicv4_vcpu_restore()
+ * only needs to touch the redistributor. A failed VMOVP may still have
+ * been carried out, so retrying it is safe.
+ */
+void gicv4_vcpu_prepare(struct vcpu *v)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+    unsigned int cpu = smp_processor_id();
+    unsigned int tries = GICV4_VPE_MOVE_TRIES;
+    int ret;
+
+    if ( is_idle_vcpu(v) || !vpe || !this_cpu(vlpi_base) || vpe->cpu == cpu )
+        return;
+
+    do {
+        ret = gicv3_its_move_vpe(vpe->id, cpu);
+    } while ( ret && --tries );
+
+    if ( ret )
+    {
+        /*
+         * The ITS still sends the vLPIs to the old redistributor, so
+         * gicv4_vcpu_restore() won't make the vPE resident here. They stay
+         * in the VPT, with the doorbell ringing on the old CPU, until the
+         * move succeeds. Have the scheduler look again soon, the move is
+         * retried the next time v is switched in.
+         */
+        printk(XENLOG_WARNING "GICv4: %pv: failed to move vPE %u: %d\n",
+               v, vpe->id, ret);
+        raise_softirq(SCHEDULE_SOFTIRQ);
+        return;
+    }
+
+    vpe->cpu = cpu;
+    perfc_incr(vgic_vpe_moves);
+}
+
+/*
+ * Wait for the redistributor to have written back the pending state of the
+ * vPE last descheduled on this CPU. This is left until the redistributor is
+ * needed again, so that it overlaps with the rest of the context switch.
+ */
+static void gicv4_vpe_settle(void)
+{
+    struct gicv4_vpe *vpe = this_cpu(vpe_saving);
+    void __iomem *vlpi_base = this_cpu(vlpi_base);
+    s_time_t deadline = NOW() + GICV4_DIRTY_TIMEOUT;
+    uint64_t reg;
+
+    if ( !vpe )
+        return;
+
+    do {
+        reg = readq_relaxed(vlpi_base + GICR_VPENDBASER);
+        if ( !(reg & GICR_VPENDBASER_DIRTY) )
+            break;
+
+        cpu_relax();
+        udelay(1);
+    } while ( NOW() <= deadline );
+
+    if ( reg & GICR_VPENDBASER_DIRTY )
+    {
+        printk(XENLOG_WARNING "GICv4: vPE %u still dirty\n", vpe->id);
+        /* Assume the worst, so that the vCPU gets to look. */
+        reg |= GICR_VPENDBASER_PENDINGLAST;
+    }
+
+    vpe->pending_last = reg & GICR_VPENDBASER_PENDINGLAST;
+    this_cpu(vpe_saving) = NULL;
+}
+
+/* Called with interrupts disabled, on the way into v. */
+void gicv4_vcpu_restore(const struct vcpu *v)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+    void __iomem *vlpi_base = this_cpu(vlpi_base);
+    unsigned int bits = vlpi_id_bits(v->domain);
+    uint64_t reg;
+
+    if ( !vpe || !vlpi_base )
+        return;
+
+    /* gicv4_vcpu_prepare() failed to move the vPE here. */
+    if ( vpe->cpu != smp_processor_id() )
+        return;
+
+    gicv4_vpe_settle();
+
+    reg  = GIC_BASER_CACHE_RaWaWb << GICR_PROPBASER_INNER_CACHEABILITY_SHIFT;
+    reg |= GIC_BASER_CACHE_SameAsInner << GICR_PROPBASER_OUTER_CACHEABILITY_SHIFT;
+    reg |= GIC_BASER_InnerShareable << GICR_PROPBASER_SHAREABILITY_SHIFT;
+    reg |= virt_to_maddr(v->domain->arch.vgic.vlpi_prop);
+    reg |= bits - 1;
+    writeq_relaxed(reg, vlpi_base + GICR_VPROPBASER);
+
+    reg  = GIC_BASER_CACHE_RaWaWb << GICR_PENDBASER_INNER_CACHEABILITY_SHIFT;
+    reg |= GIC_BASER_CACHE_SameAsInner << GICR_PENDBASER_OUTER_CACHEABILITY_SHIFT;
+    reg |= GIC_BASER_InnerShareable << GICR_PENDBASER_SHAREABILITY_SHIFT;
+    reg |= virt_to_maddr(vpe->pendtable);
+    /*
+     * We can't tell cheaply whether the VPT is empty, as a vLPI may have
+     * arrived after we last looked. Let the redistributor scan it.
+     */
+    reg |= GICR_VPENDBASER_PENDINGLAST;
+    reg |= GICR_VPENDBASER_VALID;
+    writeq_relaxed(reg, vlpi_base + GICR_VPENDBASER);
+
+    vpe->resident = true;
+}
+
+/*
+ * Called with interrupts disabled, on the way out of v. The redistributor
+ * writes the pending state back in the background, see gicv4_vpe_settle().
+ */
+void gicv4_vcpu_save(struct vcpu *v)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+    void __iomem *vlpi_base = this_cpu(vlpi_base);
+    uint64_t reg;
+
+    if ( !vpe || !vpe->resident )
+        return;
+
+    reg = readq_relaxed(vlpi_base + GICR_VPENDBASER);
+    writeq_relaxed(reg & ~GICR_VPENDBASER_VALID, vlpi_base + GICR_VPENDBASER);
+
+    this_cpu(vpe_saving) = vpe;
+    vpe->resident = false;
+}
+
+/*
+ * Whether v's vPE had vLPIs pending when it was last saved. Must be called
+ * before context_saved(v), as v may be scheduled again right after it, and
+ * its VPT may only be used elsewhere once the redistributor is done.
+ */
+bool gicv4_vcpu_pending_last(struct vcpu *v)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+    bool pending;
+
+    if ( is_idle_vcpu(v) || !vpe )
+        return false;
+
+    /* Unless the next vCPU waited already, wait here with interrupts on. */
+    if ( this_cpu(vpe_saving) == vpe )
+        gicv4_vpe_settle();
+
+    pending = vpe->pending_last;
+    vpe->pending_last = false;
+
+    return pending;
+}
+
+/*
+ * A vCPU blocking on WFI gets descheduled with its vPE, so any vLPI still
+ * pending for it now sits in the VPT, without a doorbell having been rung.
+ * Wake the vCPU up again, it will get the vLPI once it runs.
+ */
+void gicv4_vcpu_saved(struct vcpu *v)
+{
+    if ( test_bit(_VPF_blocked, &v->pause_flags) )
+        vcpu_unblock(v);
+}
+
+void gicv4_doorbell(struct domain *d, uint32_t virt_lpi)
+{
+    /* See vgic_vcpu_inject_lpi() about the lifetime of the pending_irq. */
+    struct pending_irq *p = irq_to_pending(d->vcpu[0], virt_lpi);
+    unsigned int vcpu_id;
+
+    if ( !p )
+        return;
+
+    vcpu_id = ACCESS_ONCE(p->lpi_vcpu_id);
+    if ( vcpu_id >= d->max_vcpus )
+        return;
+
+    perfc_incr(vgic_vlpi_doorbells);
+    vcpu_unblock(d->vcpu[vcpu_id]);
+}
+
+void gicv4_update_property(struct domain *d, uint32_t virt_lpi,
+                           uint8_t property)
+{
+    uint8_t *prop = d->arch.vgic.vlpi_prop;
+
+    if ( !prop || virt_lpi >= BIT(vlpi_id_bits(d)) )
+        return;
+
+    prop += virt_lpi - LPI_OFFSET;
+    *prop = property & (LPI_PROP_PRIO_MASK | LPI_PROP_ENABLED);
+    *prop |= LPI_PROP_RES1;
+
+    /* The redistributors read the table without snooping our caches. */
+    clean_dcache_va_range(prop, sizeof(*prop));
+}
+
+int gicv4_map_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                   uint32_t vdevid, uint32_t eventid,
+                   struct pending_irq *p, struct vcpu *v)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+    int ret;
+
+    if ( !vpe )
+        return -ENODEV;
+
+    if ( p->irq >= BIT(vlpi_id_bits(d)) )
+        return -ERANGE;
+
+    ret = gicv3_its_map_vlpi(d, vdoorbell_address, vdevid, eventid,
+                             vpe->id, p->irq);
+    if ( ret )
+        return ret;
+
+    set_bit(GIC_IRQ_GUEST_DIRECT_LPI, &p->status);
+
+    return 0;
+}
+
+int gicv4_move_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                    uint32_t vdevid, uint32_t eventid, struct vcpu *v)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+
+    if ( !vpe )
+        return -ENODEV;
+
+    return gicv3_its_move_vlpi(d, vdoorbell_address, vdevid, eventid,
+                               vpe->id);
+}
+
+int gicv4_vlpi_command(struct domain *d, paddr_t vdoorbell_address,
+                       uint32_t vdevid, uint32_t eventid,
+                       struct vcpu *v, uint8_t command)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+
+    if ( !vpe )
+        return -ENODEV;
+
+    return gicv3_its_vlpi_command(d, vdoorbell_address, vdevid, eventid,
+                                  vpe->id, command);
+}
+
+int gicv4_invall(struct vcpu *v)
+{
+    struct gicv4_vpe *vpe = v->arch.vgic.vpe;
+
+    if ( !vpe )
+        return 0;
+
+    return gicv3_its_invall_vpe(vpe->id);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
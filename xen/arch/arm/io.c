@@ -17,12 +17,26 @@
  */
 
 #include <xen/lib.h>
+#include <xen/rcupdate.h>
 #include <xen/spinlock.h>
 #include <xen/sched.h>
 #include <xen/sort.h>
 #include <asm/current.h>
 #include <asm/mmio.h>
 
+/*
+ * The handlers of a domain, sorted by address. A published array is never
+ * modified: registering a handler replaces it with a copy, and the old one
+ * is freed once no reader can be using it.
+ */
+struct mmio_handlers {
+    struct rcu_head rcu;
+    unsigned int num_entries;
+    struct mmio_handler handlers[];
+};
+
+static DEFINE_RCU_READ_LOCK(vmmio_rcu_lock);
+
 static int handle_read(const struct mmio_handler *handler, struct vcpu *v,
                        mmio_info_t *info)
 {
@@ -85,19 +99,33 @@ static int cmp_mmio_handler(const void *key, const void *elem)
     return 0;
 }
 
-static const struct mmio_handler *find_mmio_handler(struct domain *d,
+/*
+ * Handlers are never removed nor moved, so the vCPU can keep a copy of the
+ * last one it found and skip the search for as long as it keeps accessing
+ * the same device.
+ */
+static const struct mmio_handler *find_mmio_handler(struct vcpu *v,
                                                     paddr_t gpa)
 {
-    struct vmmio *vmmio = &d->arch.vmmio;
+    struct mmio_handler *cache = &v->arch.mmio_cache;
     struct mmio_handler key = {.addr = gpa};
-    const struct mmio_handler *handler;
+    const struct mmio_handlers *table;
+    const struct mmio_handler *handler = NULL;
+
+    if ( cache->ops && gpa >= cache->addr &&
+         gpa < (cache->addr + cache->size) )
+        return cache;
 
-    read_lock(&vmmio->lock);
-    handler = bsearch(&key, vmmio->handlers, vmmio->num_entries,
-                      sizeof(*handler), cmp_mmio_handler);
-    read_unlock(&vmmio->lock);
+    rcu_read_lock(&vmmio_rcu_lock);
+    table = rcu_dereference(v->domain->arch.vmmio.handlers);
+    if ( table )
+        handler = bsearch(&key, table->handlers, table->num_entries,
+                          sizeof(*handler), cmp_mmio_handler);
+    if ( handler )
+        *cache = *handler;
+    rcu_read_unlock(&vmmio_rcu_lock);
 
-    return handler;
+    return handler ? cache : NULL;
 }
 
 int handle_mmio(mmio_info_t *info)
@@ -105,7 +133,7 @@ int handle_mmio(mmio_info_t *info)
     struct vcpu *v = current;
     const struct mmio_handler *handler = NULL;
 
-    handler = find_mmio_handler(v->domain, info->gpa);
+    handler = find_mmio_handler(v, info->gpa);
     if ( !handler )
         return 0;
 
@@ -115,48 +143,71 @@ int handle_mmio(mmio_info_t *info)
         return handle_read(handler, v, info);
 }
 
-void register_mmio_handler(struct domain *d,
-                           const struct mmio_handler_ops *ops,
-                           paddr_t addr, paddr_t size, void *priv)
+static void free_mmio_handlers(struct rcu_head *rcu)
+{
+    xfree(container_of(rcu, struct mmio_handlers, rcu));
+}
+
+int register_mmio_handler(struct domain *d,
+                          const struct mmio_handler_ops *ops,
+                          paddr_t addr, paddr_t size, void *priv)
 {
     struct vmmio *vmmio = &d->arch.vmmio;
+    struct mmio_handlers *old, *new;
     struct mmio_handler *handler;
+    unsigned int num_entries;
+
+    spin_lock(&vmmio->lock);
+
+    old = vmmio->handlers;
+    num_entries = old ? old->num_entries : 0;
 
-    BUG_ON(vmmio->num_entries >= vmmio->max_num_entries);
+    new = xmalloc_bytes(sizeof(*new) + (num_entries + 1) * sizeof(*handler));
+    if ( !new )
+    {
+        spin_unlock(&vmmio->lock);
+        return -ENOMEM;
+    }
 
-    write_lock(&vmmio->lock);
+    if ( num_entries )
+        memcpy(new->handlers, old->handlers, num_entries * sizeof(*handler));
 
-    handler = &vmmio->handlers[vmmio->num_entries];
+    handler = &new->handlers[num_entries];
 
     handler->ops = ops;
     handler->addr = addr;
     handler->size = size;
     handler->priv = priv;
 
-    vmmio->num_entries++;
+    new->num_entries = num_entries + 1;
 
     /* Sort mmio handlers in ascending order based on base address */
-    sort(vmmio->handlers, vmmio->num_entries, sizeof(struct mmio_handler),
+    sort(new->handlers, new->num_entries, sizeof(struct mmio_handler),
          cmp_mmio_handler, NULL);
 
-    write_unlock(&vmmio->lock);
+    rcu_assign_pointer(vmmio->handlers, new);
+
+    spin_unlock(&vmmio->lock);
+
+    if ( old )
+        call_rcu(&old->rcu, free_mmio_handlers);
+
+    return 0;
 }
 
-int domain_io_init(struct domain *d, int max_count)
+int domain_io_init(struct domain *d)
 {
-    rwlock_init(&d->arch.vmmio.lock);
-    d->arch.vmmio.num_entries = 0;
-    d->arch.vmmio.max_num_entries = max_count;
-    d->arch.vmmio.handlers = xzalloc_array(struct mmio_handler, max_count);
-    if ( !d->arch.vmmio.handlers )
-        return -ENOMEM;
+    spin_lock_init(&d->arch.vmmio.lock);
+    d->arch.vmmio.handlers = NULL;
 
     return 0;
 }
 
 void domain_io_free(struct domain *d)
 {
+    /* There is no reader left once the domain is destroyed */
     xfree(d->arch.vmmio.handlers);
+    d->arch.vmmio.handlers = NULL;
 }
 
 /*
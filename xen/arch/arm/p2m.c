@@ -38,6 +38,13 @@ static unsigned int __read_mostly max_vmid = MAX_VMID_8_BIT;
 
 #define P2M_ROOT_PAGES    (1<<P2M_ROOT_ORDER)
 
+/* Number of entries sharing a TLB entry when the contiguous hint is set */
+#define P2M_CONTIG_SHIFT    4
+#define P2M_CONTIG_ENTRIES  (1U << P2M_CONTIG_SHIFT)
+
+/* Above this number of pages, flushing the whole VMID is cheaper */
+#define P2M_FLUSH_MAX_PAGES 512
+
 /* Override macros from asm/mm.h to make them work with mfn_t */
 #undef mfn_to_page
 #define mfn_to_page(mfn) __mfn_to_page(mfn_x(mfn))
@@ -74,16 +81,31 @@ void p2m_write_unlock(struct p2m_domain *p2m)
 void p2m_dump_info(struct domain *d)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    unsigned long blocks, total;
 
     p2m_read_lock(p2m);
     printk("p2m mappings for domain %d (vmid %d):\n",
            d->domain_id, p2m->vmid);
     BUG_ON(p2m->stats.mappings[0] || p2m->stats.shattered[0]);
-    printk("  1G mappings: %ld (shattered %ld)\n",
-           p2m->stats.mappings[1], p2m->stats.shattered[1]);
-    printk("  2M mappings: %ld (shattered %ld)\n",
-           p2m->stats.mappings[2], p2m->stats.shattered[2]);
+    printk("  1G mappings: %ld (shattered %ld, coalesced %ld)\n",
+           p2m->stats.mappings[1], p2m->stats.shattered[1],
+           p2m->stats.coalesced[1]);
+    printk("  2M mappings: %ld (shattered %ld, coalesced %ld)\n",
+           p2m->stats.mappings[2], p2m->stats.shattered[2],
+           p2m->stats.coalesced[2]);
     printk("  4K mappings: %ld\n", p2m->stats.mappings[3]);
+    printk("  contiguous hint: 2M %ld (broken %ld), 4K %ld (broken %ld)\n",
+           p2m->stats.contig[2], p2m->stats.uncontig[2],
+           p2m->stats.contig[3], p2m->stats.uncontig[3]);
+
+    /* In units of 4K */
+    blocks = (p2m->stats.mappings[1] << FIRST_ORDER) +
+             (p2m->stats.mappings[2] << SECOND_ORDER);
+    total = blocks + p2m->stats.mappings[3];
+    if ( total )
+        printk("  block mapped: %luMB of %luMB (%lu%%)\n",
+               blocks >> (20 - PAGE_SHIFT), total >> (20 - PAGE_SHIFT),
+               blocks * 100 / total);
     p2m_read_unlock(p2m);
 }
 
@@ -138,11 +160,32 @@ void p2m_restore_state(struct vcpu *n)
     *last_vcpu_ran = n->vcpu_id;
 }
 
+/*
+ * Record that the translations of the 2^@order pages at @gfn have to be
+ * flushed with the next P2M TLB flush.
+ */
+static void p2m_flush_track(struct p2m_domain *p2m, gfn_t gfn,
+                            unsigned int order)
+{
+    gfn = _gfn(gfn_x(gfn) & ~((1UL << order) - 1));
+
+    p2m->flush_start = gfn_min(p2m->flush_start, gfn);
+    p2m->flush_end = gfn_max(p2m->flush_end, gfn_add(gfn, 1UL << order));
+}
+
+/*
+ * Flush the TLBs of the P2M. Only the range recorded with p2m_flush_track()
+ * is flushed if it is small enough, and the whole VMID if it is large or
+ * if nothing was recorded.
+ */
 static void p2m_flush_tlb(struct p2m_domain *p2m)
 {
-    unsigned long flags = 0;
+    unsigned long flags = 0, nr = 0;
     uint64_t ovttbr;
 
+    if ( gfn_x(p2m->flush_start) < gfn_x(p2m->flush_end) )
+        nr = gfn_x(p2m->flush_end) - gfn_x(p2m->flush_start);
+
     /*
      * ARM only provides an instruction to flush TLBs for the current
      * VMID. So switch to the VTTBR of a given P2M if different.
@@ -155,7 +198,18 @@ static void p2m_flush_tlb(struct p2m_domain *p2m)
         isb();
     }
 
-    flush_tlb();
+    if ( nr && nr <= P2M_FLUSH_MAX_PAGES )
+    {
+        flush_guest_tlb_range_ipa(gfn_to_gaddr(p2m->flush_start),
+                                  nr << PAGE_SHIFT);
+        perfc_incr(p2m_flush_range);
+        perfc_add(p2m_flush_range_pages, nr);
+    }
+    else
+    {
+        flush_tlb();
+        perfc_incr(p2m_flush_vmid);
+    }
 
     if ( ovttbr != READ_SYSREG64(VTTBR_EL2) )
     {
@@ -163,6 +217,9 @@ static void p2m_flush_tlb(struct p2m_domain *p2m)
         isb();
         local_irq_restore(flags);
     }
+
+    p2m->flush_start = _gfn(ULONG_MAX);
+    p2m->flush_end = _gfn(0);
 }
 
 /*
@@ -768,6 +825,229 @@ static bool p2m_split_superpage(struct p2m_domain *p2m, lpae_t *entry,
     return rv;
 }
 
+/* First entry of the group of P2M_CONTIG_ENTRIES holding @entry */
+static inline lpae_t *p2m_contig_group(lpae_t *entry)
+{
+    return (lpae_t *)((vaddr_t)entry &
+                      ~(P2M_CONTIG_ENTRIES * sizeof(lpae_t) - 1));
+}
+
+/*
+ * Set the contiguous hint on the group holding the level @level mapping
+ * @entry, which translates @gfn, if all of its entries map a suitably
+ * aligned contiguous range with the same type and attributes.
+ */
+static void p2m_make_contig(struct p2m_domain *p2m, lpae_t *entry,
+                            gfn_t gfn, unsigned int level)
+{
+    lpae_t *group = p2m_contig_group(entry);
+    lpae_t first = group[0], pte;
+    unsigned long nr = 1UL << level_orders[level];
+    unsigned int i;
+
+    /* Only pages and 2M blocks, a 16G group is of no use */
+    if ( level == 3 ? !lpae_is_page(first, level)
+                    : level != 2 || !lpae_is_superpage(first, level) )
+        return;
+
+    if ( first.p2m.contig )
+        return;
+
+    if ( first.p2m.base & (P2M_CONTIG_ENTRIES * nr - 1) )
+        return;
+
+    /* Mappings are mostly written in order, the last entry comes last */
+    for ( i = P2M_CONTIG_ENTRIES; i-- > 1; )
+    {
+        pte = first;
+        pte.p2m.base += i * nr;
+        if ( group[i].bits != pte.bits )
+            return;
+    }
+
+    /*
+     * The hint may only change on entries the TLBs cannot hold, follow
+     * the break-before-make sequence for the whole group (D4.7.1 in ARM
+     * DDI 0487A.j).
+     */
+    for ( i = 0; i < P2M_CONTIG_ENTRIES; i++ )
+        p2m_remove_pte(group + i, p2m->clean_pte);
+
+    p2m_flush_track(p2m, gfn, level_orders[level] + P2M_CONTIG_SHIFT);
+    p2m_flush_tlb_sync(p2m);
+
+    for ( i = 0; i < P2M_CONTIG_ENTRIES; i++ )
+    {
+        pte = first;
+        pte.p2m.base += i * nr;
+        pte.p2m.contig = 1;
+        p2m_write_pte(group + i, pte, p2m->clean_pte);
+    }
+
+    p2m->stats.contig[level]++;
+}
+
+/*
+ * Clear the contiguous hint on the group holding the level @level entry
+ * @entry, which translates @gfn. This must be done before any entry of the
+ * group is changed, the TLBs may otherwise keep translating the whole
+ * group with a stale entry.
+ */
+static void p2m_break_contig(struct p2m_domain *p2m, lpae_t *entry,
+                             gfn_t gfn, unsigned int level)
+{
+    lpae_t *group, orig[P2M_CONTIG_ENTRIES];
+    unsigned int i;
+
+    if ( !(lpae_is_page(*entry, level) || lpae_is_superpage(*entry, level)) ||
+         !entry->p2m.contig )
+        return;
+
+    group = p2m_contig_group(entry);
+
+    for ( i = 0; i < P2M_CONTIG_ENTRIES; i++ )
+    {
+        orig[i] = group[i];
+        p2m_remove_pte(group + i, p2m->clean_pte);
+    }
+
+    p2m_flush_track(p2m, gfn, level_orders[level] + P2M_CONTIG_SHIFT);
+    p2m_flush_tlb_sync(p2m);
+
+    for ( i = 0; i < P2M_CONTIG_ENTRIES; i++ )
+    {
+        orig[i].p2m.contig = 0;
+        p2m_write_pte(group + i, orig[i], p2m->clean_pte);
+    }
+
+    p2m->stats.uncontig[level]++;
+}
+
+/*
+ * Return the superpage entry mapping the same range as @table, the table
+ * behind a level @level entry, or an invalid entry if the table does not
+ * map a naturally aligned contiguous range with the same type and
+ * attributes everywhere.
+ */
+static lpae_t p2m_coalesce_pte(const lpae_t *table, unsigned int level)
+{
+    unsigned int next_level = level + 1;
+    unsigned long nr = 1UL << level_orders[next_level];
+    lpae_t first = table[0], pte, invalid = { .bits = 0 };
+    unsigned int i;
+
+    if ( next_level == 3 ? !lpae_is_page(first, next_level)
+                         : !lpae_is_superpage(first, next_level) )
+        return invalid;
+
+    /* Foreign pages hold a reference per 4K page, see p2m_put_l3_page() */
+    if ( p2m_is_foreign(first.p2m.type) )
+        return invalid;
+
+    if ( first.p2m.base & ((1UL << level_orders[level]) - 1) )
+        return invalid;
+
+    /* Tables are mostly filled in order, the last entry comes last */
+    for ( i = LPAE_ENTRIES; i-- > 1; )
+    {
+        pte = first;
+        pte.p2m.base += i * nr;
+        pte.p2m.contig = table[i].p2m.contig; /* The hint does not matter */
+        if ( table[i].bits != pte.bits )
+            return invalid;
+    }
+
+    pte = first;
+    pte.p2m.table = 0; /* Superpage entry */
+    pte.p2m.contig = 0;
+
+    return pte;
+}
+
+/*
+ * Fold the table behind the level @level entry translating @gfn back into
+ * a superpage if it has become uniform. Return whether it did.
+ */
+static bool p2m_coalesce_table(struct p2m_domain *p2m, gfn_t gfn,
+                               unsigned int level)
+{
+    paddr_t addr = gfn_to_gaddr(gfn);
+    unsigned int l;
+    lpae_t *table, *entry, *subtable, orig_pte, pte;
+    struct page_info *pg;
+    bool coalesced = false;
+
+    /* Convenience aliases */
+    const unsigned int offsets[4] = {
+        zeroeth_table_offset(addr),
+        first_table_offset(addr),
+        second_table_offset(addr),
+        third_table_offset(addr)
+    };
+
+    table = p2m_get_root_pointer(p2m, gfn);
+    if ( !table )
+        return false;
+
+    for ( l = P2M_ROOT_LEVEL; l < level; l++ )
+        if ( p2m_next_level(p2m, true, &table, offsets[l]) !=
+             GUEST_TABLE_NORMAL_PAGE )
+            goto out;
+
+    entry = table + offsets[level];
+    orig_pte = *entry;
+    if ( !lpae_table(orig_pte) )
+        goto out;
+
+    subtable = map_domain_page(_mfn(orig_pte.p2m.base));
+    pte = p2m_coalesce_pte(subtable, level);
+    unmap_domain_page(subtable);
+
+    if ( !lpae_valid(pte) )
+        goto out;
+
+    /*
+     * Follow the break-before-make sequence, no translation of the table
+     * may be left in the TLBs once the superpage is visible (D4.7.1 in
+     * ARM DDI 0487A.j).
+     */
+    p2m_remove_pte(entry, p2m->clean_pte);
+    p2m_flush_track(p2m, gfn, level_orders[level]);
+    p2m_flush_tlb_sync(p2m);
+    p2m_write_pte(entry, pte, p2m->clean_pte);
+    p2m_make_contig(p2m, entry, gfn, level);
+
+    pg = mfn_to_page(_mfn(orig_pte.p2m.base));
+    page_list_del(pg, &p2m->pages);
+    free_domheap_page(pg);
+
+    p2m->stats.mappings[level + 1] -= LPAE_ENTRIES;
+    p2m->stats.mappings[level]++;
+    p2m->stats.coalesced[level]++;
+    coalesced = true;
+
+out:
+    unmap_domain_page(table);
+
+    return coalesced;
+}
+
+/*
+ * A mapping was just written at @level for @gfn. Fold the tables above it
+ * back into superpages for as long as they are uniform, so that a range
+ * that was shattered goes back to block mappings once it has been made
+ * uniform again.
+ */
+static void p2m_coalesce(struct p2m_domain *p2m, gfn_t gfn, unsigned int level)
+{
+    /* There are no level 0 blocks */
+    while ( level > 1 && level - 1 >= P2M_ROOT_LEVEL )
+    {
+        if ( !p2m_coalesce_table(p2m, gfn, --level) )
+            break;
+    }
+}
+
 /*
  * Insert an entry in the p2m. This should be called with a mapping
  * equal to a page/superpage (4K, 2M, 1G).
@@ -783,6 +1063,7 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
     unsigned int level = 0;
     unsigned int target = 3 - (page_order / LPAE_SHIFT);
     lpae_t *entry, *table, orig_pte;
+    bool coalesce = false;
     int rc;
 
     /* Convenience aliases */
@@ -831,6 +1112,9 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
 
     entry = table + offsets[level];
 
+    /* The entry is about to change, its group cannot stay contiguous */
+    p2m_break_contig(p2m, entry, sgfn, level);
+
     /*
      * If we are here with level < target, we must be at a leaf node,
      * and we need to break up the superpage.
@@ -862,6 +1146,7 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
          * For more details see (D4.7.1 in ARM DDI 0487A.j).
          */
         p2m_remove_pte(entry, p2m->clean_pte);
+        p2m_flush_track(p2m, sgfn, level_orders[level]);
         p2m_flush_tlb_sync(p2m);
 
         p2m_write_pte(entry, split_pte, p2m->clean_pte);
@@ -915,7 +1200,10 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
      * 0487A.j).
      */
     if ( lpae_valid(orig_pte) )
+    {
         p2m_remove_pte(entry, p2m->clean_pte);
+        p2m_flush_track(p2m, sgfn, page_order);
+    }
 
     if ( mfn_eq(smfn, INVALID_MFN) )
         /* Flush can be deferred if the entry is removed */
@@ -947,6 +1235,16 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
 
         p2m_write_pte(entry, pte, p2m->clean_pte);
 
+        /*
+         * Memaccess settings are per 4K page and the IOMMU may share the
+         * tables, so only plain stage-2 mappings are folded back or given
+         * the contiguous hint.
+         */
+        coalesce = level > 1 && !p2m->mem_access_enabled &&
+                   !need_iommu(p2m->domain) && !p2m->domain->is_dying;
+        if ( coalesce )
+            p2m_make_contig(p2m, entry, sgfn, level);
+
         p2m->max_mapped_gfn = gfn_max(p2m->max_mapped_gfn,
                                       gfn_add(sgfn, (1UL << page_order) - 1));
         p2m->lowest_mapped_gfn = gfn_min(p2m->lowest_mapped_gfn, sgfn);
@@ -968,6 +1266,9 @@ static int __p2m_set_entry(struct p2m_domain *p2m,
 out:
     unmap_domain_page(table);
 
+    if ( !rc && coalesce )
+        p2m_coalesce(p2m, sgfn, level);
+
     return rc;
 }
 
@@ -1252,6 +1553,8 @@ int p2m_init(struct domain *d)
 
     p2m->max_mapped_gfn = _gfn(0);
     p2m->lowest_mapped_gfn = _gfn(ULONG_MAX);
+    p2m->flush_start = _gfn(ULONG_MAX);
+    p2m->flush_end = _gfn(0);
 
     p2m->default_access = p2m_access_rwx;
     p2m->mem_access_enabled = false;
@@ -1288,19 +1591,57 @@ int p2m_init(struct domain *d)
     return rc;
 }
 
+/* Number of entries unhooked by relinquish_p2m_mapping() per TLB flush */
+#define P2M_RELINQUISH_BATCH 64
+
+struct p2m_unhooked {
+    lpae_t pte;
+    unsigned int level;
+};
+
+/*
+ * Free the sub-trees behind entries that have been removed from the p2m,
+ * once no translation of them can be left in the TLBs.
+ */
+static int p2m_free_unhooked(struct p2m_domain *p2m,
+                             const struct p2m_unhooked *batch,
+                             unsigned int nr)
+{
+    unsigned int i;
+    int rc = 0;
+
+    if ( !nr )
+        return 0;
+
+    p2m_flush_tlb_sync(p2m);
+    if ( need_iommu(p2m->domain) )
+        rc = iommu_iotlb_flush_all(p2m->domain);
+
+    for ( i = 0; i < nr; i++ )
+        p2m_free_entry(p2m, batch[i].pte, batch[i].level);
+
+    return rc;
+}
+
 /*
  * The function will go through the p2m and remove page reference when it
  * is required. The mapping will be removed from the p2m.
  *
+ * Rather than removing mappings one by one, whole level 2 entries (and
+ * level 1 superpages) are unhooked, and a batch of them is freed behind a
+ * single TLB flush. The vCPUs are not running anymore, so nothing can
+ * walk the tables in between.
+ *
  * XXX: See whether the mapping can be left intact in the p2m.
  */
 int relinquish_p2m_mapping(struct domain *d)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct p2m_unhooked batch[P2M_RELINQUISH_BATCH];
     unsigned long count = 0;
-    p2m_type_t t;
+    unsigned int nr = 0, level;
     int rc = 0;
-    unsigned int order;
+    lpae_t *table, *entry;
     gfn_t start, end;
 
     p2m_write_lock(p2m);
@@ -1308,41 +1649,69 @@ int relinquish_p2m_mapping(struct domain *d)
     start = p2m->lowest_mapped_gfn;
     end = gfn_add(p2m->max_mapped_gfn, 1);
 
-    for ( ; gfn_x(start) < gfn_x(end);
-          start = gfn_next_boundary(start, order) )
+    while ( gfn_x(start) < gfn_x(end) )
     {
-        mfn_t mfn = p2m_get_entry(p2m, start, &t, NULL, &order);
+        paddr_t addr = gfn_to_gaddr(start);
 
-        count++;
-        /*
-         * Arbitrarily preempt every 512 iterations.
-         */
-        if ( !(count % 512) && hypercall_preempt_check() )
-        {
-            rc = -ERESTART;
-            break;
-        }
+        /* Convenience aliases */
+        const unsigned int offsets[4] = {
+            zeroeth_table_offset(addr),
+            first_table_offset(addr),
+            second_table_offset(addr),
+            third_table_offset(addr)
+        };
 
         /*
-         * p2m_set_entry will take care of removing reference on page
-         * when it is necessary and removing the mapping in the p2m.
+         * Arbitrarily preempt every 512 iterations, or when a batch is
+         * full, once the entries unhooked so far have been freed.
          */
-        if ( !mfn_eq(mfn, INVALID_MFN) )
+        if ( nr == P2M_RELINQUISH_BATCH || !(++count % 512) )
         {
-            /*
-             * For valid mapping, the start will always be aligned as
-             * entry will be removed whilst relinquishing.
-             */
-            rc = __p2m_set_entry(p2m, start, order, INVALID_MFN,
-                                 p2m_invalid, p2m_access_rwx);
+            rc = p2m_free_unhooked(p2m, batch, nr);
+            nr = 0;
             if ( unlikely(rc) )
+                break;
+
+            if ( hypercall_preempt_check() )
             {
-                printk(XENLOG_G_ERR "Unable to remove mapping gfn=%#"PRI_gfn" order=%u from the p2m of domain %d\n", gfn_x(start), order, d->domain_id);
+                rc = -ERESTART;
                 break;
             }
         }
+
+        table = p2m_get_root_pointer(p2m, start);
+        if ( !table )
+            break;
+
+        for ( level = P2M_ROOT_LEVEL; level < 2; level++ )
+            if ( p2m_next_level(p2m, true, &table, offsets[level]) !=
+                 GUEST_TABLE_NORMAL_PAGE )
+                break;
+
+        entry = table + offsets[level];
+        if ( lpae_valid(*entry) )
+        {
+            batch[nr].pte = *entry;
+            batch[nr].level = level;
+            nr++;
+
+            p2m_remove_pte(entry, p2m->clean_pte);
+            p2m_flush_track(p2m, start, level_orders[level]);
+        }
+
+        unmap_domain_page(table);
+
+        start = gfn_next_boundary(start, level_orders[level]);
     }
 
+    /* On any early exit, the last batch has already been freed */
+    if ( !rc )
+        rc = p2m_free_unhooked(p2m, batch, nr);
+
+    if ( unlikely(rc) && rc != -ERESTART )
+        printk(XENLOG_G_ERR "Unable to flush the IOMMU TLB of domain %d\n",
+               d->domain_id);
+
     /*
      * Update lowest_mapped_gfn so on the next call we still start where
      * we stopped.
@@ -694,10 +694,8 @@ static int vgic_v2_domain_init(struct domain *d)
     if ( ret )
         return ret;
 
-    register_mmio_handler(d, &vgic_v2_distr_mmio_handler, d->arch.vgic.dbase,
-                          PAGE_SIZE, NULL);
-
-    return 0;
+    return register_mmio_handler(d, &vgic_v2_distr_mmio_handler,
+                                 d->arch.vgic.dbase, PAGE_SIZE, NULL);
 }
 
 static void vgic_v2_domain_free(struct domain *d)
@@ -727,7 +725,7 @@ static const struct vgic_ops vgic_v2_ops = {
     .max_vcpus = 8,
 };
 
-int vgic_v2_init(struct domain *d, int *mmio_count)
+int vgic_v2_init(struct domain *d)
 {
     if ( !vgic_v2_hw.enabled )
     {
@@ -737,7 +735,6 @@ int vgic_v2_init(struct domain *d, int *mmio_count)
         return -ENODEV;
     }
 
-    *mmio_count = 1; /* Only GICD region */
     register_vgic_ops(d, &vgic_v2_ops);
 
     return 0;
@@ -27,6 +27,7 @@
  *         d->its_devices_lock           (protects the device RB tree)
  *             v->vgic.lock              (protects the struct pending_irq)
  *                 d->pend_lpi_tree_lock (protects the radix tree)
+ *         hw_its->cmd_lock              (host ITS command queue, for GICv4)
  */
 
 #include <xen/bitops.h>
@@ -43,6 +44,7 @@
 #include <asm/mmio.h>
 #include <asm/gic_v3_defs.h>
 #include <asm/gic_v3_its.h>
+#include <asm/gic_v4.h>
 #include <asm/vgic.h>
 #include <asm/vgic-emul.h>
 
@@ -300,6 +302,7 @@ static int its_handle_int(struct virt_its *its, uint64_t *cmdptr)
 {
     uint32_t devid = its_cmd_get_deviceid(cmdptr);
     uint32_t eventid = its_cmd_get_id(cmdptr);
+    struct pending_irq *p;
     struct vcpu *vcpu;
     uint32_t vlpi;
     bool ret;
@@ -313,6 +316,13 @@ static int its_handle_int(struct virt_its *its, uint64_t *cmdptr)
     if ( vlpi == INVALID_LPI )
         return -1;
 
+    /* A direct vLPI has to be made pending in the vPE's pending table. */
+    p = gicv3_its_get_event_pending_irq(its->d, its->doorbell_address,
+                                        devid, eventid);
+    if ( p && test_bit(GIC_IRQ_GUEST_DIRECT_LPI, &p->status) )
+        return gicv4_vlpi_command(its->d, its->doorbell_address, devid,
+                                  eventid, vcpu, GITS_CMD_INT) ? -1 : 0;
+
     vgic_vcpu_inject_lpi(its->d, vlpi);
 
     return 0;
@@ -365,6 +375,15 @@ static int its_handle_clear(struct virt_its *its, uint64_t *cmdptr)
     if ( unlikely(!p) )
         goto out_unlock;
 
+    /* Only the host ITS knows about the pending state of a direct vLPI. */
+    if ( test_bit(GIC_IRQ_GUEST_DIRECT_LPI, &p->status) )
+    {
+        if ( !gicv4_vlpi_command(its->d, its->doorbell_address, devid,
+                                 eventid, vcpu, GITS_CMD_CLEAR) )
+            ret = 0;
+        goto out_unlock;
+    }
+
     /*
      * TODO: This relies on the VCPU being correct in the ITS tables.
      * This can be fixed by either using a per-IRQ lock or by using
@@ -421,6 +440,7 @@ static int update_lpi_property(struct domain *d, struct pending_irq *p)
         return ret;
 
     write_atomic(&p->lpi_priority, property & LPI_PROP_PRIO_MASK);
+    gicv4_update_property(d, p->irq, property);
 
     if ( property & LPI_PROP_ENABLED )
         set_bit(GIC_IRQ_GUEST_ENABLED, &p->status);
@@ -461,6 +481,7 @@ static int its_handle_inv(struct virt_its *its, uint64_t *cmdptr)
     unsigned long flags;
     struct vcpu *vcpu;
     uint32_t vlpi;
+    bool direct = false;
     int ret = -1;
 
     /*
@@ -492,14 +513,23 @@ static int its_handle_inv(struct virt_its *its, uint64_t *cmdptr)
     if ( update_lpi_property(d, p) )
         goto out_unlock;
 
+    direct = test_bit(GIC_IRQ_GUEST_DIRECT_LPI, &p->status);
+
     /* Check whether the LPI needs to go on a VCPU. */
-    update_lpi_vgic_status(vcpu, p);
+    if ( !direct )
+        update_lpi_vgic_status(vcpu, p);
 
     ret = 0;
 
 out_unlock:
     spin_unlock_irqrestore(&vcpu->arch.vgic.lock, flags);
 
+    /* Have the redistributor pick up the new configuration of a vLPI. */
+    if ( !ret && direct &&
+         gicv4_vlpi_command(d, its->doorbell_address, devid, eventid,
+                            vcpu, GITS_CMD_INV) )
+        ret = -1;
+
 out_unlock_its:
     spin_unlock(&its->its_lock);
 
@@ -579,6 +609,10 @@ static int its_handle_invall(struct virt_its *its, uint64_t *cmdptr)
     read_unlock(&its->d->arch.vgic.pend_lpi_tree_lock);
     spin_unlock_irqrestore(&vcpu->arch.vgic.lock, flags);
 
+    /* The loop above updated the vLPI property table, if there is one. */
+    if ( gicv4_invall(vcpu) )
+        ret = -1;
+
     return ret;
 }
 
@@ -590,6 +624,7 @@ static int its_discard_event(struct virt_its *its,
     unsigned long flags;
     struct vcpu *vcpu;
     uint32_t vlpi;
+    bool direct;
 
     ASSERT(spin_is_locked(&its->its_lock));
 
@@ -619,11 +654,16 @@ static int its_discard_event(struct virt_its *its,
     }
 
     /* Cleanup the pending_irq and disconnect it from the LPI. */
+    direct = test_bit(GIC_IRQ_GUEST_DIRECT_LPI, &p->status);
     gic_remove_irq_from_queues(vcpu, p);
     vgic_init_pending_irq(p, INVALID_LPI);
 
     spin_unlock_irqrestore(&vcpu->arch.vgic.lock, flags);
 
+    /* Have the host ITS stop delivering the event to the vPE. */
+    if ( direct )
+        gicv3_its_unmap_vlpi(its->d, its->doorbell_address, vdevid, vevid);
+
     /* Remove the corresponding host LPI entry */
     return gicv3_remove_guest_event(its->d, its->doorbell_address,
                                     vdevid, vevid);
@@ -777,6 +817,12 @@ static int its_handle_mapti(struct virt_its *its, uint64_t *cmdptr)
      */
     set_bit(GIC_IRQ_GUEST_PRISTINE_LPI, &pirq->status);
 
+    /*
+     * With GICv4, try to have the host ITS deliver this event straight to
+     * the vCPU. If that doesn't work out, we inject it through the LRs.
+     */
+    gicv4_map_vlpi(its->d, its->doorbell_address, devid, eventid, pirq, vcpu);
+
     /*
      * Now insert the pending_irq into the domain's LPI tree, so that
      * it becomes live.
@@ -794,6 +840,9 @@ static int its_handle_mapti(struct virt_its *its, uint64_t *cmdptr)
      * existed in the tree. We don't support the latter case, so we always
      * cleanup and return an error here in any case.
      */
+    if ( test_and_clear_bit(GIC_IRQ_GUEST_DIRECT_LPI, &pirq->status) )
+        gicv3_its_unmap_vlpi(its->d, its->doorbell_address, devid, eventid);
+
 out_remove_host_entry:
     gicv3_remove_guest_event(its->d, its->doorbell_address, devid, eventid);
 
@@ -846,6 +895,12 @@ static int its_handle_movi(struct virt_its *its, uint64_t *cmdptr)
 
     spin_unlock_irqrestore(&ovcpu->arch.vgic.lock, flags);
 
+    /* A direct vLPI has to follow to the new vCPU's vPE. */
+    if ( test_bit(GIC_IRQ_GUEST_DIRECT_LPI, &p->status) &&
+         gicv4_move_vlpi(its->d, its->doorbell_address, devid, eventid,
+                         nvcpu) )
+        goto out_unlock;
+
     /*
      * TODO: Investigate if and how to migrate an already pending LPI. This
      * is not really critical, as these benign races happen in hardware too
@@ -1462,6 +1517,7 @@ static int vgic_v3_its_init_virtual(struct domain *d, paddr_t guest_addr,
 {
     struct virt_its *its;
     uint64_t base_attr;
+    int ret;
 
     its = xzalloc(struct virt_its);
     if ( !its )
@@ -1488,7 +1544,13 @@ static int vgic_v3_its_init_virtual(struct domain *d, paddr_t guest_addr,
     spin_lock_init(&its->vcmd_lock);
     spin_lock_init(&its->its_lock);
 
-    register_mmio_handler(d, &vgic_its_mmio_handler, guest_addr, SZ_64K, its);
+    ret = register_mmio_handler(d, &vgic_its_mmio_handler, guest_addr, SZ_64K,
+                                its);
+    if ( ret )
+    {
+        xfree(its);
+        return ret;
+    }
 
     /* Register the virtual ITS to be able to clean it up later. */
     list_add_tail(&its->vits_list, &d->arch.vgic.vits_list);
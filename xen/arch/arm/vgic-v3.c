@@ -30,6 +30,7 @@
 #include <asm/current.h>
 #include <asm/gic_v3_defs.h>
 #include <asm/gic_v3_its.h>
+#include <asm/gic_v4.h>
 #include <asm/mmio.h>
 #include <asm/vgic.h>
 #include <asm/vgic-emul.h>
@@ -1650,6 +1651,12 @@ static int vgic_v3_vcpu_init(struct vcpu *v)
     if ( v->vcpu_id == last_cpu || (v->vcpu_id == (d->max_vcpus - 1)) )
         v->arch.vgic.flags |= VGIC_V3_RDIST_LAST;
 
+    /* Without a vPE, all LPIs of this vCPU just go through the LRs. */
+    if ( gicv4_vcpu_init(v) )
+        dprintk(XENLOG_WARNING,
+                "d%u: Unable to set up a GICv4 vPE for VCPU %u\n",
+                d->domain_id, v->vcpu_id);
+
     return 0;
 }
 
@@ -1755,9 +1762,15 @@ static int vgic_v3_real_domain_init(struct domain *d)
     if ( ret )
         return ret;
 
+    ret = gicv4_domain_init(d);
+    if ( ret )
+        return ret;
+
     /* Register mmio handle for the Distributor */
-    register_mmio_handler(d, &vgic_distr_mmio_handler, d->arch.vgic.dbase,
-                          SZ_64K, NULL);
+    ret = register_mmio_handler(d, &vgic_distr_mmio_handler,
+                                d->arch.vgic.dbase, SZ_64K, NULL);
+    if ( ret )
+        return ret;
 
     /*
      * Register mmio handler per contiguous region occupied by the
@@ -1768,8 +1781,10 @@ static int vgic_v3_real_domain_init(struct domain *d)
     {
         struct vgic_rdist_region *region = &d->arch.vgic.rdist_regions[i];
 
-        register_mmio_handler(d, &vgic_rdistr_mmio_handler,
-                              region->base, region->size, region);
+        ret = register_mmio_handler(d, &vgic_rdistr_mmio_handler,
+                                    region->base, region->size, region);
+        if ( ret )
+            return ret;
     }
 
     d->arch.vgic.ctlr = VGICD_CTLR_DEFAULT;
@@ -1790,6 +1805,7 @@ static int vgic_v3_domain_init(struct domain *d)
 static void vgic_v3_domain_free(struct domain *d)
 {
     vgic_v3_its_free_domain(d);
+    gicv4_domain_free(d);
     /*
      * It is expected that at this point all actual ITS devices have been
      * cleaned up already. The struct pending_irq's, for which the pointers
@@ -1843,7 +1859,7 @@ static const struct vgic_ops v3_ops = {
     .max_vcpus = 4096,
 };
 
-int vgic_v3_init(struct domain *d, int *mmio_count)
+int vgic_v3_init(struct domain *d)
 {
     if ( !vgic_v3_hw.enabled )
     {
@@ -1853,12 +1869,6 @@ int vgic_v3_init(struct domain *d, int *mmio_count)
         return -ENODEV;
     }
 
-    /* GICD region + number of Redistributors */
-    *mmio_count = vgic_v3_max_rdist_count(d) + 1;
-
-    /* one region per ITS */
-    *mmio_count += vgic_v3_its_count(d);
-
     register_vgic_ops(d, &v3_ops);
 
     return 0;
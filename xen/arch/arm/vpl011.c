@@ -484,11 +484,16 @@ int domain_vpl011_init(struct domain *d, struct vpl011_init_info *info)
 
     spin_lock_init(&vpl011->lock);
 
-    register_mmio_handler(d, &vpl011_mmio_handler,
-                          GUEST_PL011_BASE, GUEST_PL011_SIZE, NULL);
+    rc = register_mmio_handler(d, &vpl011_mmio_handler,
+                               GUEST_PL011_BASE, GUEST_PL011_SIZE, NULL);
+    if ( rc )
+        goto out3;
 
     return 0;
 
+out3:
+    free_xen_event_channel(d, vpl011->evtchn);
+
 out2:
     vgic_free_virq(d, GUEST_VPL011_SPI);
 
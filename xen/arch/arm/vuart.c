@@ -67,12 +67,10 @@ int domain_vuart_init(struct domain *d)
     if ( !d->arch.vuart.buf )
         return -ENOMEM;
 
-    register_mmio_handler(d, &vuart_mmio_handler,
-                          d->arch.vuart.info->base_addr,
-                          d->arch.vuart.info->size,
-                          NULL);
-
-    return 0;
+    return register_mmio_handler(d, &vuart_mmio_handler,
+                                 d->arch.vuart.info->base_addr,
+                                 d->arch.vuart.info->size,
+                                 NULL);
 }
 
 void domain_vuart_free(struct domain *d)
@@ -23,6 +23,16 @@ static inline void flush_tlb(void)
     isb();
 }
 
+/*
+ * Flush a range of IPA from the inner shareable TLBs, current VMID only.
+ * ARMv7 cannot remove the combined stage 1 and 2 entries without the
+ * stage 2 ones, so the whole VMID goes.
+ */
+static inline void flush_guest_tlb_range_ipa(paddr_t ipa, unsigned long size)
+{
+    flush_tlb();
+}
+
 /* Flush local TLBs, all VMIDs, non-hypervisor mode */
 static inline void flush_tlb_all_local(void)
 {
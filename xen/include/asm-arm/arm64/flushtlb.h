@@ -23,6 +23,29 @@ static inline void flush_tlb(void)
         : : : "memory");
 }
 
+/*
+ * Flush a range of IPA from the innershareable TLBs, current VMID only.
+ * TLBI IPAS2E1IS only removes the stage 2 entries, the combined stage 1
+ * and 2 entries go with the final TLBI VMALLE1IS.
+ */
+static inline void flush_guest_tlb_range_ipa(paddr_t ipa, unsigned long size)
+{
+    paddr_t end = ipa + size;
+
+    asm volatile("dsb sy;" : : : "memory");
+
+    for ( ; ipa < end; ipa += PAGE_SIZE )
+        asm volatile("tlbi ipas2e1is, %0;"
+                     : : "r" (ipa >> PAGE_SHIFT) : "memory");
+
+    asm volatile(
+        "dsb sy;"
+        "tlbi vmalle1is;"
+        "dsb sy;"
+        "isb;"
+        : : : "memory");
+}
+
 /* Flush local TLBs, all VMIDs, non-hypervisor mode */
 static inline void flush_tlb_all_local(void)
 {
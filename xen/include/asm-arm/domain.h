@@ -33,6 +33,8 @@ enum domain_type {
 extern int dom0_11_mapping;
 #define is_domain_direct_mapped(d) ((d) == hardware_domain && dom0_11_mapping)
 
+struct gicv4_vpe;
+
 struct vtimer {
         struct vcpu *v;
         int irq;
@@ -116,6 +118,7 @@ struct arch_domain
         struct radix_tree_root pend_lpi_tree; /* Stores struct pending_irq's */
         rwlock_t pend_lpi_tree_lock;        /* Protects the pend_lpi_tree */
         struct list_head vits_list;         /* List of virtual ITSes */
+        uint8_t *vlpi_prop;                 /* GICv4 vLPI property table */
         unsigned int intid_bits;
         /*
          * TODO: if there are more bool's being added below, consider
@@ -278,8 +281,14 @@ struct arch_vcpu
 #define VGIC_V3_RDIST_LAST      (1 << 0)        /* last vCPU of the rdist */
 #define VGIC_V3_LPIS_ENABLED    (1 << 1)
         uint8_t flags;
+
+        /* GICv4: the vPE receiving this vCPU's direct vLPIs, if any */
+        struct gicv4_vpe *vpe;
     } vgic;
 
+    /* Copy of the last MMIO handler found, see find_mmio_handler() */
+    struct mmio_handler mmio_cache;
+
     /* Timer registers  */
     uint32_t cntkctl;
 
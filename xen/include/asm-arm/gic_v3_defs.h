@@ -82,6 +82,11 @@
 #define GICR_SYNCR                   (0x00C0)
 #define GICR_PIDR2                   GICD_PIDR2
 
+/* GICv4 VLPI_base frame, following RD_base and SGI_base */
+#define GICR_VLPI_BASE_OFFSET        SZ_128K
+#define GICR_VPROPBASER              (0x0070)
+#define GICR_VPENDBASER              (0x0078)
+
 /* GICR for SGI's & PPI's */
 
 #define GICR_IGROUPR0                (0x0080)
@@ -149,6 +154,12 @@
         (BIT(63) | GENMASK(61, 59) | GENMASK(55, 52) |       \
          GENMASK(15, 12) | GENMASK(6, 0))
 
+/* GICR_VPROPBASER uses the GICR_PROPBASER layout, GICR_VPENDBASER adds: */
+#define GICR_VPENDBASER_VALID                           BIT(63)
+#define GICR_VPENDBASER_IDAI                            BIT(62)
+#define GICR_VPENDBASER_PENDINGLAST                     BIT(61)
+#define GICR_VPENDBASER_DIRTY                           BIT(60)
+
 #define DEFAULT_PMR_VALUE            0xff
 
 #define LPI_PROP_PRIO_MASK           0xfc
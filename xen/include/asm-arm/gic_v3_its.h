@@ -41,8 +41,12 @@
 #define GITS_VALID_BIT                  BIT(63)
 
 #define GITS_CTLR_QUIESCENT             BIT(31)
+#define GITS_CTLR_ITS_NUMBER_SHIFT      4
+#define GITS_CTLR_ITS_NUMBER_MASK       (0xfUL << GITS_CTLR_ITS_NUMBER_SHIFT)
 #define GITS_CTLR_ENABLE                BIT(0)
 
+#define GITS_TYPER_VMOVP                BIT(37)
+
 #define GITS_TYPER_PTA                  BIT(19)
 #define GITS_TYPER_DEVIDS_SHIFT         13
 #define GITS_TYPER_DEVIDS_MASK          (0x1fUL << GITS_TYPER_DEVIDS_SHIFT)
@@ -58,6 +62,7 @@
 #define GITS_TYPER_ITT_SIZE_MASK        (0xfUL << GITS_TYPER_ITT_SIZE_SHIFT)
 #define GITS_TYPER_ITT_SIZE(r)          ((((r) & GITS_TYPER_ITT_SIZE_MASK) >> \
                                                  GITS_TYPER_ITT_SIZE_SHIFT) + 1)
+#define GITS_TYPER_VIRTUAL              (1U << 1)
 #define GITS_TYPER_PHYSICAL             (1U << 0)
 
 #define GITS_BASER_INDIRECT             BIT(62)
@@ -100,6 +105,12 @@
 #define GITS_CMD_INVALL                 0x0d
 #define GITS_CMD_MOVALL                 0x0e
 #define GITS_CMD_DISCARD                0x0f
+#define GITS_CMD_VMOVI                  0x21
+#define GITS_CMD_VMOVP                  0x22
+#define GITS_CMD_VSYNC                  0x25
+#define GITS_CMD_VMAPP                  0x29
+#define GITS_CMD_VMAPTI                 0x2a
+#define GITS_CMD_VINVALL                0x2d
 
 #define ITS_DOORBELL_OFFSET             0x10040
 #define GICV3_ITS_SIZE                  SZ_128K
@@ -109,6 +120,8 @@
 
 #define HOST_ITS_FLUSH_CMD_QUEUE        (1U << 0)
 #define HOST_ITS_USES_PTA               (1U << 1)
+#define HOST_ITS_VIRTUAL                (1U << 2)
+#define HOST_ITS_VMOVP                  (1U << 3)
 
 /* We allocate LPIs on the hosts in chunks of 32 to reduce handling overhead. */
 #define LPI_BLOCK                       32U
@@ -123,6 +136,7 @@ struct host_its {
     unsigned int devid_bits;
     unsigned int evid_bits;
     unsigned int itte_size;
+    unsigned int its_number;            /* GITS_CTLR.ITS_Number, for VMOVP */
     spinlock_t cmd_lock;
     void *cmd_buf;
     unsigned int flags;
@@ -199,6 +213,25 @@ struct pending_irq *gicv3_assign_guest_event(struct domain *d, paddr_t doorbell,
                                              uint32_t virt_lpi);
 void gicv3_lpi_update_host_entry(uint32_t host_lpi, int domain_id,
                                  uint32_t virt_lpi);
+/* Like the above, but the host LPI only serves as a GICv4 doorbell. */
+void gicv3_lpi_update_host_doorbell(uint32_t host_lpi, int domain_id,
+                                    uint32_t virt_lpi);
+
+/* GICv4 host ITS commands, see gic-v4.c for their users. */
+int gicv3_its_map_vpe(uint16_t vpeid, unsigned int cpu, paddr_t vpt_addr,
+                      unsigned int vpt_bits, bool valid);
+int gicv3_its_move_vpe(uint16_t vpeid, unsigned int cpu);
+int gicv3_its_invall_vpe(uint16_t vpeid);
+int gicv3_its_map_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                       uint32_t vdevid, uint32_t eventid,
+                       uint16_t vpeid, uint32_t virt_lpi);
+int gicv3_its_unmap_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                         uint32_t vdevid, uint32_t eventid);
+int gicv3_its_move_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                        uint32_t vdevid, uint32_t eventid, uint16_t vpeid);
+int gicv3_its_vlpi_command(struct domain *d, paddr_t vdoorbell_address,
+                           uint32_t vdevid, uint32_t eventid,
+                           uint16_t vpeid, uint8_t command);
 
 #else
 
@@ -0,0 +1,125 @@
+/*
+ * ARM GICv4 direct virtual LPI injection
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ASM_ARM_GIC_V4_H__
+#define __ASM_ARM_GIC_V4_H__
+
+/*
+ * vPE IDs are a host wide resource. Only the hardware domain gets vPEs
+ * for now, so one for each possible vCPU is enough.
+ */
+#define GICV4_NR_VPES                   MAX_VIRT_CPUS
+
+struct pending_irq;
+
+#ifdef CONFIG_HAS_ITS
+
+/* Decide whether to use GICv4, once all host ITSes have been probed. */
+void gicv4_its_init(void);
+/* Set up this CPU's redistributor for vLPIs. */
+void gicv4_init_rdist(void __iomem *rdist_base, uint64_t typer);
+
+int gicv4_domain_init(struct domain *d);
+void gicv4_domain_free(struct domain *d);
+int gicv4_vcpu_init(struct vcpu *v);
+void gicv4_vcpu_free(struct vcpu *v);
+
+/* Move a vCPU's vPE to this CPU, before it is switched in. */
+void gicv4_vcpu_prepare(struct vcpu *v);
+/* Make a vCPU's vPE resident on this CPU's redistributor, or not anymore. */
+void gicv4_vcpu_restore(const struct vcpu *v);
+void gicv4_vcpu_save(struct vcpu *v);
+/* Called on context switch, before and after the previous vCPU is saved. */
+bool gicv4_vcpu_pending_last(struct vcpu *v);
+void gicv4_vcpu_saved(struct vcpu *v);
+
+/* A doorbell for virt_lpi fired on the host. */
+void gicv4_doorbell(struct domain *d, uint32_t virt_lpi);
+/* The guest's property table entry for virt_lpi has been (re-)read. */
+void gicv4_update_property(struct domain *d, uint32_t virt_lpi,
+                           uint8_t property);
+
+/*
+ * Have the host ITS deliver an event directly to the vPE of vCPU v, as the
+ * vLPI of p. Fails if this is not possible, the LPI is injected by Xen then.
+ */
+int gicv4_map_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                   uint32_t vdevid, uint32_t eventid,
+                   struct pending_irq *p, struct vcpu *v);
+int gicv4_move_vlpi(struct domain *d, paddr_t vdoorbell_address,
+                    uint32_t vdevid, uint32_t eventid, struct vcpu *v);
+int gicv4_vlpi_command(struct domain *d, paddr_t vdoorbell_address,
+                       uint32_t vdevid, uint32_t eventid,
+                       struct vcpu *v, uint8_t command);
+int gicv4_invall(struct vcpu *v);
+
+#else
+
+static inline void gicv4_init_rdist(void __iomem *rdist_base, uint64_t typer)
+{
+}
+
+static inline int gicv4_domain_init(struct domain *d)
+{
+    return 0;
+}
+
+static inline void gicv4_domain_free(struct domain *d)
+{
+}
+
+static inline int gicv4_vcpu_init(struct vcpu *v)
+{
+    return 0;
+}
+
+static inline void gicv4_vcpu_free(struct vcpu *v)
+{
+}
+
+static inline void gicv4_vcpu_prepare(struct vcpu *v)
+{
+}
+
+static inline void gicv4_vcpu_restore(const struct vcpu *v)
+{
+}
+
+static inline void gicv4_vcpu_save(struct vcpu *v)
+{
+}
+
+static inline bool gicv4_vcpu_pending_last(struct vcpu *v)
+{
+    return false;
+}
+
+static inline void gicv4_vcpu_saved(struct vcpu *v)
+{
+}
+
+#endif /* CONFIG_HAS_ITS */
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
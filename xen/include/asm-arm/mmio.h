@@ -20,12 +20,10 @@
 #define __ASM_ARM_MMIO_H__
 
 #include <xen/lib.h>
-#include <xen/rwlock.h>
+#include <xen/spinlock.h>
 #include <asm/processor.h>
 #include <asm/regs.h>
 
-#define MAX_IO_HANDLER  16
-
 typedef struct
 {
     struct hsr_dabt dabt;
@@ -50,18 +48,18 @@ struct mmio_handler {
     void *priv;
 };
 
+struct mmio_handlers;
+
 struct vmmio {
-    int num_entries;
-    int max_num_entries;
-    rwlock_t lock;
-    struct mmio_handler *handlers;
+    spinlock_t lock;                 /* Serialises the registrations */
+    struct mmio_handlers *handlers;  /* Protected by RCU */
 };
 
 extern int handle_mmio(mmio_info_t *info);
-void register_mmio_handler(struct domain *d,
-                           const struct mmio_handler_ops *ops,
-                           paddr_t addr, paddr_t size, void *priv);
-int domain_io_init(struct domain *d, int max_count);
+int register_mmio_handler(struct domain *d,
+                          const struct mmio_handler_ops *ops,
+                          paddr_t addr, paddr_t size, void *priv);
+int domain_io_init(struct domain *d);
 void domain_io_free(struct domain *d);
 
 
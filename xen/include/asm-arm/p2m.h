@@ -63,8 +63,14 @@ struct p2m_domain {
      *
      * If an immediate flush is required (e.g, if a super page is
      * shattered), call p2m_tlb_flush_sync().
+     *
+     * The GFNs whose translations were changed since the last flush are
+     * tracked in [flush_start, flush_end), so that a small range can be
+     * flushed by IPA rather than the whole VMID.
      */
     bool need_flush;
+    gfn_t flush_start;
+    gfn_t flush_end;
 
     /* Gather some statistics for information purposes only */
     struct {
@@ -73,6 +79,13 @@ struct p2m_domain {
         /* Number of times we have shattered a mapping
          * at each p2m tree level. */
         unsigned long shattered[4];
+        /* Number of times a table has been folded back into a
+         * mapping at each p2m tree level. */
+        unsigned long coalesced[4];
+        /* Number of times a group of entries has been given, or lost,
+         * the contiguous hint at each p2m tree level. */
+        unsigned long contig[4];
+        unsigned long uncontig[4];
     } stats;
 
     /*
@@ -46,6 +46,8 @@ PERFCOUNTER(vgic_sgi_others,            "vgic: SGI send to others")
 PERFCOUNTER(vgic_sgi_self,              "vgic: SGI send to self")
 PERFCOUNTER(vgic_cross_cpu_intr_inject, "vgic: cross-CPU irq inject")
 PERFCOUNTER(vgic_irq_migrates,          "vgic: irq migration")
+PERFCOUNTER(vgic_vlpi_doorbells,        "vgic: GICv4 doorbell")
+PERFCOUNTER(vgic_vpe_moves,             "vgic: GICv4 vPE move")
 
 PERFCOUNTER(vuart_reads,  "vuart: read")
 PERFCOUNTER(vuart_writes, "vuart: write")
@@ -75,6 +77,10 @@ PERFCOUNTER(maintenance_irqs, "Maintenance interrupts")
 PERFCOUNTER(atomics_guest,    "atomics: guest access")
 PERFCOUNTER(atomics_guest_paused,   "atomics: guest paused")
 
+PERFCOUNTER(p2m_flush_vmid,        "p2m: TLB flush of the VMID")
+PERFCOUNTER(p2m_flush_range,       "p2m: TLB flush by IPA")
+PERFCOUNTER(p2m_flush_range_pages, "p2m: pages flushed by IPA")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
 
 /*